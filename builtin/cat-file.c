@@ -280,6 +280,13 @@ struct expand_data {
 	const char *rest;
 	struct object_id delta_base_oid;
 
+	/*
+	 * The contents of the object, if they were read ahead of time, so
+	 * that printing the object does not read it again.
+	 */
+	void *contents;
+	unsigned long contents_size;
+
 	/*
 	 * If mark_query is true, we do not expand anything, but rather
 	 * just mark the object_info with items we wish to query.
@@ -415,6 +422,8 @@ static void print_object_or_die(struct batch_options *opt, struct expand_data *d
 				BUG("invalid transform_mode: %c", opt->transform_mode);
 			batch_write(opt, contents, size);
 			free(contents);
+		} else if (data->contents) {
+			batch_write(opt, data->contents, data->contents_size);
 		} else {
 			stream_blob(oid);
 		}
@@ -424,8 +433,15 @@ static void print_object_or_die(struct batch_options *opt, struct expand_data *d
 		unsigned long size;
 		void *contents;
 
-		contents = odb_read_object(the_repository->objects, oid,
-					   &type, &size);
+		if (data->contents) {
+			contents = data->contents;
+			data->contents = NULL;
+			type = data->type;
+			size = data->contents_size;
+		} else {
+			contents = odb_read_object(the_repository->objects, oid,
+						   &type, &size);
+		}
 		if (!contents)
 			die("object %s disappeared", oid_to_hex(oid));
 
@@ -564,16 +580,21 @@ static void batch_object_write(const char *obj_name,
 	}
 }
 
-static void batch_one_object(const char *obj_name,
-			     struct strbuf *scratch,
-			     struct batch_options *opt,
-			     struct expand_data *data)
+/*
+ * Look up the object named by "obj_name" into "data->oid" and "data->mode".
+ * Returns 0 if there is an object to write out, or reports why there is
+ * none and returns -1.
+ */
+static int batch_resolve_object(const char *obj_name,
+				struct batch_options *opt,
+				struct expand_data *data)
 {
 	struct object_context ctx = {0};
 	int flags =
 		GET_OID_HASH_ANY |
 		(opt->follow_symlinks ? GET_OID_FOLLOW_SYMLINKS : 0);
 	enum get_oid_result result;
+	int ret = -1;
 
 	result = get_oid_with_context(the_repository, obj_name,
 				      flags, &data->oid, &ctx);
@@ -619,10 +640,21 @@ static void batch_one_object(const char *obj_name,
 	}
 
 	data->mode = ctx.mode;
-	batch_object_write(obj_name, scratch, opt, data, NULL, 0);
+	ret = 0;
 
 out:
 	object_context_release(&ctx);
+	return ret;
+}
+
+static void batch_one_object(const char *obj_name,
+			     struct strbuf *scratch,
+			     struct batch_options *opt,
+			     struct expand_data *data)
+{
+	if (batch_resolve_object(obj_name, opt, data))
+		return;
+	batch_object_write(obj_name, scratch, opt, data, NULL, 0);
 }
 
 struct object_cb_data {
@@ -870,6 +902,94 @@ static void batch_each_object(struct batch_options *opt,
 	free_bitmap_index(bitmap);
 }
 
+struct unordered_input {
+	char *name;
+	char *rest;
+	unsigned short mode;
+};
+
+struct unordered_input_data {
+	struct batch_options *opt;
+	struct expand_data *expand;
+	struct strbuf *scratch;
+	struct unordered_input *inputs;
+	struct oid_array oids;
+};
+
+static int batch_unordered_input(size_t i,
+				 enum object_type type UNUSED,
+				 unsigned long size,
+				 void **buf, void *vdata)
+{
+	struct unordered_input_data *data = vdata;
+	struct unordered_input *input = &data->inputs[i];
+
+	oidcpy(&data->expand->oid, &data->oids.oid[i]);
+	data->expand->mode = input->mode;
+	data->expand->rest = input->rest;
+	data->expand->contents = *buf;
+	data->expand->contents_size = size;
+	*buf = NULL;
+
+	batch_object_write(input->name, data->scratch, data->opt,
+			   data->expand, NULL, 0);
+	FREE_AND_NULL(data->expand->contents);
+	return 0;
+}
+
+/*
+ * With --unordered and --buffer, read all of the input first and print
+ * the objects
+ * in the order in which they are stored, as odb_read_objects() sees fit.
+ * Names that do not resolve to an object are reported as they are read.
+ */
+static void batch_objects_unordered(struct batch_options *opt,
+				    struct strbuf *input,
+				    struct strbuf *output,
+				    struct expand_data *expand)
+{
+	struct unordered_input_data data = {
+		.opt = opt,
+		.expand = expand,
+		.scratch = output,
+		.oids = OID_ARRAY_INIT,
+	};
+	size_t alloc = 0;
+
+	while (strbuf_getdelim_strip_crlf(input, stdin, opt->input_delim) != EOF) {
+		struct unordered_input *in;
+		char *rest = NULL;
+
+		if (expand->split_on_whitespace) {
+			rest = strpbrk(input->buf, " \t");
+			if (rest) {
+				while (*rest && strchr(" \t", *rest))
+					*rest++ = '\0';
+			}
+		}
+
+		if (batch_resolve_object(input->buf, opt, expand))
+			continue;
+
+		ALLOC_GROW(data.inputs, data.oids.nr + 1, alloc);
+		in = &data.inputs[data.oids.nr];
+		in->name = xstrdup(input->buf);
+		in->rest = xstrdup_or_null(rest);
+		in->mode = expand->mode;
+		oid_array_append(&data.oids, &expand->oid);
+	}
+
+	odb_read_objects(the_repository->objects, data.oids.oid, data.oids.nr,
+			 batch_unordered_input, &data);
+
+	for (size_t i = 0; i < data.oids.nr; i++) {
+		free(data.inputs[i].name);
+		free(data.inputs[i].rest);
+	}
+	free(data.inputs);
+	oid_array_clear(&data.oids);
+}
+
 static int batch_objects(struct batch_options *opt)
 {
 	struct strbuf input = STRBUF_INIT;
@@ -955,6 +1075,17 @@ static int batch_objects(struct batch_options *opt)
 		goto cleanup;
 	}
 
+	/*
+	 * Holding back all output until the end of the input would hang
+	 * a caller that waits for each object before asking for the next,
+	 * so only do so when the output is buffered anyway.
+	 */
+	if (opt->unordered && opt->buffer_output &&
+	    opt->batch_mode == BATCH_MODE_CONTENTS && !opt->transform_mode) {
+		batch_objects_unordered(opt, &input, &output, &data);
+		goto cleanup;
+	}
+
 	while (strbuf_getdelim_strip_crlf(&input, stdin, opt->input_delim) != EOF) {
 		if (data.split_on_whitespace) {
 			/*
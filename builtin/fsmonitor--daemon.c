@@ -10,6 +10,7 @@
 #include "parse-options.h"
 #include "fsmonitor-ll.h"
 #include "fsmonitor-ipc.h"
+#include "fsmonitor-ring.h"
 #include "fsmonitor-settings.h"
 #include "compat/fsmonitor/fsm-health.h"
 #include "compat/fsmonitor/fsm-listen.h"
@@ -42,6 +43,10 @@ static int fsmonitor__start_timeout_sec = 60;
 #define FSMONITOR__ANNOUNCE_STARTUP "fsmonitor.announcestartup"
 static int fsmonitor__announce_startup = 0;
 
+#define FSMONITOR__SHARED_MEMORY "fsmonitor.sharedmemory"
+static int fsmonitor__shared_memory = 0;
+#define FSMONITOR_SHARED_MEMORY_SIZE (8 * 1024 * 1024)
+
 static int fsmonitor_config(const char *var, const char *value,
 			    const struct config_context *ctx, void *cb)
 {
@@ -73,6 +78,11 @@ static int fsmonitor_config(const char *var, const char *value,
 		return 0;
 	}
 
+	if (!strcmp(var, FSMONITOR__SHARED_MEMORY)) {
+		fsmonitor__shared_memory = git_config_bool(var, value);
+		return 0;
+	}
+
 	return git_default_config(var, value, ctx, cb);
 }
 
@@ -358,6 +368,9 @@ struct fsmonitor_batch {
 	const char **interned_paths;
 	size_t nr, alloc;
 	time_t pinned_time;
+
+	/* The position of the first path of this batch in the ring. */
+	uint64_t ring_begin;
 };
 
 static struct fsmonitor_token_data *fsmonitor_new_token_data(void)
@@ -676,6 +689,7 @@ static int do_handle_client(struct fsmonitor_daemon_state *state,
 	int do_trivial = 0;
 	int do_flush = 0;
 	int do_cookie = 0;
+	int want_ring = 0;
 	enum fsmonitor_cookie_item_result cookie_result;
 
 	/*
@@ -685,8 +699,15 @@ static int do_handle_client(struct fsmonitor_daemon_state *state,
 	 *            | flush NUL
 	 *            | <V1-time-since-epoch-ns> NUL
 	 *            | <V2-opaque-fsmonitor-token> NUL
+	 *            | ring SP <V2-opaque-fsmonitor-token> NUL
+	 *
+	 * where the last one asks for a reference to the paths in the
+	 * shared memory (see fsmonitor-ring.h).
 	 */
 
+	if (skip_prefix(command, FSMONITOR_RING_REQUEST, &command))
+		want_ring = 1;
+
 	if (!strcmp(command, "quit")) {
 		/*
 		 * A client has requested over the socket/pipe that the
@@ -840,6 +861,47 @@ static int do_handle_client(struct fsmonitor_daemon_state *state,
 		goto cleanup;
 	}
 
+	/*
+	 * The paths of the batches newer than the requested one start
+	 * at the oldest of these batches in the ring and end at the
+	 * current write position, since the head batch is now pinned.
+	 * Unless the client is too far behind and they have been
+	 * overwritten, just tell the client where to find them.
+	 */
+	if (want_ring && state->ring) {
+		uint64_t ring_end = fsmonitor_ring_pos(state->ring);
+		uint64_t ring_begin = ring_end;
+
+		for (batch = batch_head;
+		     batch && batch->batch_seq_nr > requested_oldest_seq_nr;
+		     batch = batch->next)
+			ring_begin = batch->ring_begin;
+
+		if (!fsmonitor_ring_format_response(state->ring, ring_begin,
+						    ring_end, &payload)) {
+			if (batch && !token_data->client_ref_count)
+				remainder = with_lock__truncate_old_batches(
+					state, batch);
+
+			pthread_mutex_unlock(&state->main_lock);
+
+			reply(reply_data, payload.buf, payload.len + 1);
+			total_response_len += payload.len + 1;
+
+			if (remainder)
+				fsmonitor_batch__free_list(remainder);
+
+			trace2_data_intmax("fsmonitor", the_repository,
+					   "response/length", total_response_len);
+			trace2_data_intmax("fsmonitor", the_repository,
+					   "response/ring", ring_end - ring_begin);
+			goto cleanup;
+		}
+
+		trace_printf_key(&trace_fsmonitor,
+				 "client requested overwritten shared memory");
+	}
+
 	/*
 	 * We're going to hold onto a pointer to the current
 	 * token-data while we walk the list of batches of files.
@@ -1083,6 +1145,24 @@ enum fsmonitor_path_type fsmonitor_classify_path_absolute(
  */
 #define MY_COMBINE_LIMIT (1024)
 
+/*
+ * Copy the paths of a batch that we add to the batch list into the
+ * shared memory, if any.
+ */
+static void with_lock__ring_append(struct fsmonitor_daemon_state *state,
+				   const struct fsmonitor_batch *batch)
+{
+	/* assert current thread holding state->main_lock */
+
+	size_t k;
+
+	if (!state->ring)
+		return;
+
+	for (k = 0; k < batch->nr; k++)
+		fsmonitor_ring_append(state->ring, batch->interned_paths[k]);
+}
+
 void fsmonitor_publish(struct fsmonitor_daemon_state *state,
 		       struct fsmonitor_batch *batch,
 		       const struct string_list *cookie_names)
@@ -1117,6 +1197,9 @@ void fsmonitor_publish(struct fsmonitor_daemon_state *state,
 			 */
 			batch->batch_seq_nr = head->batch_seq_nr + 1;
 			batch->next = head;
+			if (state->ring)
+				batch->ring_begin = fsmonitor_ring_pos(state->ring);
+			with_lock__ring_append(state, batch);
 			state->current_token_data->batch_head = batch;
 		} else if (!head->batch_seq_nr) {
 			/*
@@ -1135,6 +1218,9 @@ void fsmonitor_publish(struct fsmonitor_daemon_state *state,
 			 */
 			batch->batch_seq_nr = head->batch_seq_nr + 1;
 			batch->next = head;
+			if (state->ring)
+				batch->ring_begin = fsmonitor_ring_pos(state->ring);
+			with_lock__ring_append(state, batch);
 			state->current_token_data->batch_head = batch;
 		} else {
 			/*
@@ -1142,6 +1228,7 @@ void fsmonitor_publish(struct fsmonitor_daemon_state *state,
 			 * batch onto the end of the current head batch.
 			 */
 			fsmonitor_batch__combine(head, batch);
+			with_lock__ring_append(state, batch);
 			fsmonitor_batch__free_list(batch);
 		}
 	}
@@ -1359,6 +1446,22 @@ static int fsmonitor_run_daemon(void)
 
 	strbuf_addch(&state.path_cookie_prefix, '/');
 
+	/*
+	 * If asked to, publish the changed paths in shared memory
+	 * next to the cookie directory, too.  Clients fall back to
+	 * receiving them over IPC if we fail to set it up.
+	 */
+	if (fsmonitor__shared_memory) {
+		struct strbuf ring_path = STRBUF_INIT;
+
+		strbuf_addf(&ring_path, "%s/%s", state.path_gitdir_watch.buf,
+			    FSMONITOR_RING_PATH);
+		state.ring = fsmonitor_ring_create(ring_path.buf,
+			git_env_ulong("GIT_TEST_FSMONITOR_SHARED_MEMORY_SIZE",
+				      FSMONITOR_SHARED_MEMORY_SIZE));
+		strbuf_release(&ring_path);
+	}
+
 	/*
 	 * We create a named-pipe or unix domain socket inside of the
 	 * ".git" directory.  (Well, on Windows, we base our named
@@ -1409,6 +1512,7 @@ static int fsmonitor_run_daemon(void)
 	fsm_health__dtor(&state);
 
 	ipc_server_free(state.ipc_server_data);
+	fsmonitor_ring_free(state.ring);
 
 	strbuf_release(&state.path_worktree_watch);
 	strbuf_release(&state.path_gitdir_watch);
@@ -45,11 +45,15 @@ static int recurse_submodules;
 
 static int num_threads;
 
-static pthread_t *threads;
+static struct task_pool *pool;
 
-/* We use one producer thread and THREADS consumer
- * threads. The producer adds struct work_items to 'todo' and the
- * consumers pick work items from the same array.
+/* The options and result of each thread of the pool. */
+static struct grep_opt **worker_opts;
+static int *worker_hits;
+
+/* We use one producer thread and a pool of THREADS consumer
+ * threads. The producer adds struct work_items to 'todo' and hands
+ * each of them to the pool as a task.
  */
 struct work_item {
 	struct grep_source source;
@@ -57,24 +61,17 @@ struct work_item {
 	struct strbuf out;
 };
 
-/* In the range [todo_done, todo_start) in 'todo' we have work_items
- * that have been or are processed by a consumer thread. We haven't
- * written the result for these to stdout yet.
- *
- * The work_items in [todo_start, todo_end) are waiting to be picked
- * up by a consumer thread.
+/* In the range [todo_done, todo_end) in 'todo' we have work_items
+ * that have been handed to the pool. We haven't written the result
+ * for these to stdout yet.
  *
  * The ranges are modulo TODO_SIZE.
  */
 #define TODO_SIZE 128
 static struct work_item todo[TODO_SIZE];
-static int todo_start;
 static int todo_end;
 static int todo_done;
 
-/* Has all work items been added? */
-static int all_work_added;
-
 static struct repository **repos_to_free;
 static size_t repos_to_free_nr, repos_to_free_alloc;
 
@@ -91,21 +88,19 @@ static inline void grep_unlock(void)
 	pthread_mutex_unlock(&grep_mutex);
 }
 
-/* Signalled when a new work_item is added to todo. */
-static pthread_cond_t cond_add;
-
 /* Signalled when the result from one work_item is written to
  * stdout.
  */
 static pthread_cond_t cond_write;
 
-/* Signalled when we are finished with everything. */
-static pthread_cond_t cond_result;
-
 static int skip_first_line;
 
+static void run(void *arg, int worker);
+
 static void add_work(struct grep_opt *opt, struct grep_source *gs)
 {
+	struct work_item *w;
+
 	if (opt->binary != GREP_BINARY_TEXT)
 		grep_source_load_driver(gs, opt->repo->index);
 
@@ -115,32 +110,15 @@ static void add_work(struct grep_opt *opt, struct grep_source *gs)
 		pthread_cond_wait(&cond_write, &grep_mutex);
 	}
 
-	todo[todo_end].source = *gs;
-	todo[todo_end].done = 0;
-	strbuf_reset(&todo[todo_end].out);
+	w = &todo[todo_end];
+	w->source = *gs;
+	w->done = 0;
+	strbuf_reset(&w->out);
 	todo_end = (todo_end + 1) % ARRAY_SIZE(todo);
 
-	pthread_cond_signal(&cond_add);
 	grep_unlock();
-}
 
-static struct work_item *get_work(void)
-{
-	struct work_item *ret;
-
-	grep_lock();
-	while (todo_start == todo_end && !all_work_added) {
-		pthread_cond_wait(&cond_add, &grep_mutex);
-	}
-
-	if (todo_start == todo_end && all_work_added) {
-		ret = NULL;
-	} else {
-		ret = &todo[todo_start];
-		todo_start = (todo_start + 1) % ARRAY_SIZE(todo);
-	}
-	grep_unlock();
-	return ret;
+	task_pool_add(pool, run, w);
 }
 
 static void work_done(struct work_item *w)
@@ -150,7 +128,7 @@ static void work_done(struct work_item *w)
 	grep_lock();
 	w->done = 1;
 	old_done = todo_done;
-	for(; todo[todo_done].done && todo_done != todo_start;
+	for(; todo[todo_done].done && todo_done != todo_end;
 	    todo_done = (todo_done+1) % ARRAY_SIZE(todo)) {
 		w = &todo[todo_done];
 		if (w->out.len) {
@@ -175,9 +153,6 @@ static void work_done(struct work_item *w)
 	if (old_done != todo_done)
 		pthread_cond_signal(&cond_write);
 
-	if (all_work_added && todo_done == todo_end)
-		pthread_cond_signal(&cond_result);
-
 	grep_unlock();
 }
 
@@ -194,25 +169,15 @@ static void free_repos(void)
 	repos_to_free_alloc = 0;
 }
 
-static void *run(void *arg)
+static void run(void *arg, int worker)
 {
-	int hit = 0;
-	struct grep_opt *opt = arg;
-
-	while (1) {
-		struct work_item *w = get_work();
-		if (!w)
-			break;
-
-		opt->output_priv = w;
-		hit |= grep_source(opt, &w->source);
-		grep_source_clear_data(&w->source);
-		work_done(w);
-	}
-	free_grep_patterns(opt);
-	free(opt);
+	struct work_item *w = arg;
+	struct grep_opt *opt = worker_opts[worker];
 
-	return (void*) (intptr_t) hit;
+	opt->output_priv = w;
+	worker_hits[worker] |= grep_source(opt, &w->source);
+	grep_source_clear_data(&w->source);
+	work_done(w);
 }
 
 static void strbuf_out(struct grep_opt *opt, const void *buf, size_t size)
@@ -227,9 +192,7 @@ static void start_threads(struct grep_opt *opt)
 
 	pthread_mutex_init(&grep_mutex, NULL);
 	pthread_mutex_init(&grep_attr_mutex, NULL);
-	pthread_cond_init(&cond_add, NULL);
 	pthread_cond_init(&cond_write, NULL);
-	pthread_cond_init(&cond_result, NULL);
 	grep_use_locks = 1;
 	enable_obj_read_lock();
 
@@ -237,18 +200,15 @@ static void start_threads(struct grep_opt *opt)
 		strbuf_init(&todo[i].out, 0);
 	}
 
-	CALLOC_ARRAY(threads, num_threads);
+	CALLOC_ARRAY(worker_opts, num_threads);
+	CALLOC_ARRAY(worker_hits, num_threads);
 	for (i = 0; i < num_threads; i++) {
-		int err;
 		struct grep_opt *o = grep_opt_dup(opt);
 		o->output = strbuf_out;
 		compile_grep_patterns(o);
-		err = pthread_create(&threads[i], NULL, run, o);
-
-		if (err)
-			die(_("grep: failed to create thread: %s"),
-			    strerror(err));
+		worker_opts[i] = o;
 	}
+	pool = task_pool_new(num_threads);
 }
 
 static int wait_all(void)
@@ -259,32 +219,24 @@ static int wait_all(void)
 	if (!HAVE_THREADS)
 		BUG("Never call this function unless you have started threads");
 
-	grep_lock();
-	all_work_added = 1;
-
-	/* Wait until all work is done. */
-	while (todo_done != todo_end)
-		pthread_cond_wait(&cond_result, &grep_mutex);
-
-	/* Wake up all the consumer threads so they can see that there
-	 * is no more work to do.
+	/*
+	 * Once all tasks are done, the last of them has written out
+	 * the results of all work_items.
 	 */
-	pthread_cond_broadcast(&cond_add);
-	grep_unlock();
+	task_pool_free(pool);
+	pool = NULL;
 
 	for (i = 0; i < num_threads; i++) {
-		void *h;
-		pthread_join(threads[i], &h);
-		hit |= (int) (intptr_t) h;
+		hit |= worker_hits[i];
+		free_grep_patterns(worker_opts[i]);
+		free(worker_opts[i]);
 	}
-
-	free(threads);
+	FREE_AND_NULL(worker_opts);
+	FREE_AND_NULL(worker_hits);
 
 	pthread_mutex_destroy(&grep_mutex);
 	pthread_mutex_destroy(&grep_attr_mutex);
-	pthread_cond_destroy(&cond_add);
 	pthread_cond_destroy(&cond_write);
-	pthread_cond_destroy(&cond_result);
 	grep_use_locks = 0;
 	disable_obj_read_lock();
 
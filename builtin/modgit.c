@@ -1,106 +1,533 @@
 #define USE_THE_REPOSITORY_VARIABLE
 
 #include "builtin.h"
+#include "abspath.h"
+#include "advice.h"
+#include "cache-tree.h"
+#include "commit.h"
 #include "config.h"
+#include "environment.h"
 #include "parse-options.h"
 #include "repository.h"
 #include "modgit.h"
+#include "modgit-affected.h"
+#include "modgit-context.h"
+#include "modgit-graph.h"
+#include "modgit-permissions.h"
 #include "strvec.h"
 #include "run-command.h"
 #include "dir.h"
 #include "gettext.h"
+#include "setup.h"
+#include "sparse-checkout.h"
+#include "sparse-index.h"
+#include "hex.h"
+#include "hook.h"
+#include "ident.h"
+#include "lockfile.h"
+#include "odb.h"
+#include "oid-array.h"
+#include "object-name.h"
+#include "path-walk.h"
+#include "preload-index.h"
+#include "promisor-remote.h"
+#include "read-cache-ll.h"
+#include "refs.h"
+#include "revision.h"
+#include "trace2.h"
+#include "thread-utils.h"
+#include "tree.h"
+#include "unpack-trees.h"
+#include "worktree.h"
+#include "wt-status.h"
 
 static const char * const modgit_usage[] = {
 	N_("git modgit clone --module=<name> <url> [dir]"),
 	N_("git modgit list"),
-	N_("git modgit status"),
+	N_("git modgit status [--module=<name>] [--short | --porcelain]"),
 	N_("git modgit switch <module>"),
-	N_("git modgit run <command>"),
-	N_("git modgit commit [message]"),
-	N_("git modgit ai-context --module=<name>"),
+	N_("git modgit worktree add [--rev=<commit-ish>] <module> [<path>]"),
+	N_("git modgit affected [--direct] <revision-range>"),
+	N_("git modgit run [--each [--affected <revision-range>] [-j <n>]] <command>"),
+	N_("git modgit commit [--module=<name>] [-m <message> | <message>]"),
+	N_("git modgit ai-context --module=<name> [--rev=<revision>] [--format=(paths|markdown|json)] [-j <n>] [--budget=<n>]"),
 	NULL
 };
 
-// Helper to run internal git commands
+/* Helper to run internal git commands */
 static int run_git_cmd(const char **argv)
 {
-    struct child_process cmd = CHILD_PROCESS_INIT;
-    cmd.git_cmd = 1;
-    cmd.args.v = argv;
-    return run_command(&cmd);
+	struct child_process cmd = CHILD_PROCESS_INIT;
+
+	cmd.git_cmd = 1;
+	strvec_pushv(&cmd.args, argv);
+	return run_command(&cmd);
+}
+
+/* Helper for user-friendly errors */
+static NORETURN void die_with_hint(const char *err, const char *hint)
+{
+	fprintf(stderr, _("error: %s\n"), err);
+	if (hint)
+		fprintf(stderr, _("hint: %s\n"), hint);
+	exit(128);
+}
+
+/*
+ * Parse the .modgit file at the top of the worktree once; every
+ * subcommand works on the resulting in-memory graph.
+ */
+static void load_module_graph(struct module_graph *graph)
+{
+	module_graph_init(graph);
+	module_graph_load(graph, MODGIT_FILE);
+}
+
+/*
+ * Look up the closure of a module, going through the compiled
+ * modgit-graph of `r` unless it is NULL.
+ */
+static void resolve_module_or_die(struct repository *r, const char *module_name,
+				  struct strvec *paths)
+{
+	switch (lookup_module_closure(r, module_name, paths)) {
+	case 0:
+		return;
+	case MODULE_NOT_FOUND:
+		die_with_hint(_("module not found"),
+			      _("Run 'git modgit list' to see available modules. Check .modgit file presence."));
+	default:
+		die_with_hint(_("cannot resolve module dependencies"),
+			      _("Remove the dependency cycle from the .modgit file."));
+	}
+}
+
+/*
+ * Look up the module `name`, or the one recorded by "modgit switch" if
+ * `name` is NULL. Append it and its dependencies to `modules`, in
+ * dependency order, and its closure to `paths`.
+ */
+static struct module_def *resolve_current_module(struct repository *r,
+						 struct module_graph *graph,
+						 const char *name,
+						 struct module_list *modules,
+						 struct strvec *paths)
+{
+	struct module_def *module;
+	char *current = NULL;
+
+	if (!name) {
+		if (repo_config_get_string(r, "modgit.module", &current))
+			die_with_hint(_("not on a module"),
+				      _("Run 'git modgit switch <module>' first, or pass --module."));
+		name = current;
+	}
+
+	module = module_graph_lookup(graph, name);
+	if (!module)
+		die_with_hint(_("module not found"),
+			      _("Run 'git modgit list' to see available modules. Check .modgit file presence."));
+	if (module_graph_topo_order(graph, module, modules) < 0 ||
+	    resolve_dependencies(graph, module, paths) < 0)
+		die_with_hint(_("cannot resolve module dependencies"),
+			      _("Remove the dependency cycle from the .modgit file."));
+
+	free(current);
+	return module;
 }
 
-    return run_command(&cmd);
+static int collect_missing_blobs(const char *path UNUSED,
+				 struct oid_array *list,
+				 enum object_type type,
+				 void *data)
+{
+	struct oid_array *missing = data;
+
+	if (type != OBJ_BLOB)
+		return 0;
+
+	for (size_t i = 0; i < list->nr; i++) {
+		if (!odb_has_object(the_repository->objects, &list->oid[i],
+				    OBJECT_INFO_FOR_PREFETCH))
+			oid_array_append(missing, &list->oid[i]);
+	}
+	return 0;
+}
+
+/*
+ * Download every blob of `rev` inside the sparse-checkout cone that is
+ * missing from a partial clone, in a single request to the promisor
+ * remote, the way 'git backfill --sparse' does for the whole history.
+ */
+static int prefetch_module_blobs(struct repository *r, const char *rev)
+{
+	struct rev_info revs;
+	struct path_walk_info info = PATH_WALK_INFO_INIT;
+	struct oid_array missing = OID_ARRAY_INIT;
+	int ret;
+
+	if (!repo_has_promisor_remote(r))
+		return 0;
+
+	CALLOC_ARRAY(info.pl, 1);
+	if (get_sparse_checkout_patterns(info.pl)) {
+		path_walk_info_clear(&info);
+		return error(_("problem loading sparse-checkout"));
+	}
+
+	repo_init_revisions(r, &revs, NULL);
+	if (handle_revision_arg(rev, &revs, 0, 0)) {
+		ret = error(_("bad revision '%s'"), rev);
+		goto out;
+	}
+	revs.no_walk = 1;
+
+	info.blobs = 1;
+	info.tags = info.commits = info.trees = 0;
+	info.revs = &revs;
+	info.path_fn = collect_missing_blobs;
+	info.path_fn_data = &missing;
+
+	trace2_region_enter("modgit", "prefetch", r);
+	ret = walk_objects_by_path(&info);
+	if (!ret && missing.nr) {
+		trace2_data_intmax("modgit", r, "prefetch/blobs", missing.nr);
+		promisor_remote_get_direct(r, missing.oid, missing.nr);
+		odb_reprepare(r->objects);
+	}
+	trace2_region_leave("modgit", "prefetch", r);
+
+out:
+	oid_array_clear(&missing);
+	path_walk_info_clear(&info);
+	release_revisions(&revs);
+	return ret;
 }
 
-// Helper for user-friendly errors
-static void die_with_hint(const char *err, const char *hint)
+/*
+ * Populate the index and the worktree of a clone made with --no-checkout
+ * from HEAD, like the checkout at the end of 'git clone' does.
+ */
+static void checkout_head(struct repository *r)
 {
-    fprintf(stderr, _("error: %s\n"), err);
-    if (hint)
-        fprintf(stderr, _("hint: %s\n"), hint);
-    exit(128);
+	struct lock_file lock_file = LOCK_INIT;
+	struct unpack_trees_options opts;
+	struct object_id oid;
+	struct tree *tree;
+	struct tree_desc t;
+	char *head;
+
+	head = refs_resolve_refdup(get_main_ref_store(r), "HEAD",
+				   RESOLVE_REF_READING, &oid, NULL);
+	if (!head)
+		die(_("HEAD does not point to a commit"));
+
+	repo_hold_locked_index(r, &lock_file, LOCK_DIE_ON_ERROR);
+
+	/*
+	 * The index is still empty, so it is as collapsed as it gets:
+	 * let unpack_trees() add the directories outside of the cone as
+	 * sparse-directory entries without reading their trees, which a
+	 * clone made with a module filter does not even have.
+	 */
+	if (r->settings.sparse_index && !r->index->cache_nr) {
+		/* Decide on the cone that was just set, not a stale one. */
+		if (r->index->sparse_checkout_patterns) {
+			clear_pattern_list(r->index->sparse_checkout_patterns);
+			FREE_AND_NULL(r->index->sparse_checkout_patterns);
+		}
+		r->index->sparse_index = INDEX_COLLAPSED;
+	} else {
+		give_advice_on_expansion = 0;
+		ensure_full_index(r->index);
+	}
+
+	memset(&opts, 0, sizeof(opts));
+	opts.update = 1;
+	opts.merge = 1;
+	opts.clone = 1;
+	opts.fn = oneway_merge;
+	opts.verbose_update = isatty(2);
+	opts.src_index = r->index;
+	opts.dst_index = r->index;
+	init_checkout_metadata(&opts.meta, head, &oid, NULL);
+
+	tree = repo_parse_tree_indirect(r, &oid);
+	if (!tree || repo_parse_tree(r, tree) < 0)
+		die(_("unable to parse commit %s"), oid_to_hex(&oid));
+	init_tree_desc(&t, &tree->object.oid, tree->buffer, tree->size);
+	if (unpack_trees(1, &t, &opts) < 0)
+		die(_("unable to checkout working tree"));
+
+	if (write_locked_index(r->index, &lock_file, COMMIT_LOCK))
+		die(_("unable to write new index file"));
+
+	run_hooks_l(r, "post-checkout", oid_to_hex(null_oid(r->hash_algo)),
+		    oid_to_hex(&oid), "1", NULL);
+	free(head);
+}
+
+/*
+ * Rewrite the index of `r`, which was written while the sparse index was
+ * disabled, as a sparse index. Reading it collapses it in memory only,
+ * which every later command would have to do again.
+ */
+static void collapse_index(struct repository *r)
+{
+	struct lock_file lock_file = LOCK_INIT;
+
+	trace2_region_enter("modgit", "collapse-index", r);
+	repo_hold_locked_index(r, &lock_file, LOCK_DIE_ON_ERROR);
+	discard_index(r->index);
+	repo_read_index(r);
+	if (write_locked_index(r->index, &lock_file, COMMIT_LOCK))
+		die(_("unable to write new index file"));
+	trace2_region_leave("modgit", "collapse-index", r);
+}
+
+static int switch_to_module(struct repository *r, const char *module_name)
+{
+	struct strvec paths = STRVEC_INIT;
+	int initial_checkout, enable_sparse_index;
+
+	if (!startup_info->have_repository)
+		die(_("not a git repository"));
+
+	repo_config(r, git_default_config, NULL);
+	prepare_repo_settings(r);
+	r->settings.command_requires_full_index = 0;
+
+	/*
+	 * In a clone made with --no-checkout there is neither an index nor
+	 * a .modgit in the worktree yet: resolve the module from HEAD, then
+	 * fetch its blobs in one go before checking it out.
+	 */
+	setup_work_tree();
+	repo_read_index(r);
+	initial_checkout = is_index_unborn(r->index) && !file_exists(MODGIT_FILE);
+
+	if (initial_checkout) {
+		switch (lookup_module_closure_rev(r, "HEAD", module_name, &paths)) {
+		case 0:
+			break;
+		case MODULE_NOT_FOUND:
+			die_with_hint(_("module not found"),
+				      _("Check that HEAD has a .modgit file defining the module."));
+		default:
+			die_with_hint(_("cannot resolve module dependencies"),
+				      _("Remove the dependency cycle from the .modgit file."));
+		}
+	} else {
+		resolve_module_or_die(r, module_name, &paths);
+	}
+	if (!paths.nr)
+		warning(_("module '%s' has no paths defined"), module_name);
+
+	/*
+	 * Configure Sparse Checkout, in process, so that the index we read
+	 * to validate the module paths is the one we update. When switching
+	 * from another module, only the paths that enter or leave the cone
+	 * are checked out or removed.
+	 */
+	if (sparse_checkout_set_cone_dirs(r, paths.v, paths.nr))
+		die_with_hint(_("failed to configure sparse-checkout"),
+			      _("Check 'git status' for conflicts or local changes in the way."));
+
+	/*
+	 * Keep only the closure in the index, too: every directory outside
+	 * of the cone becomes a single sparse-directory entry, so that
+	 * reading and writing the index, and "git status", cost in
+	 * proportion to the module instead of the whole repository. Only
+	 * do so once the module has been checked out, so that a failed
+	 * switch leaves the configuration alone.
+	 */
+	enable_sparse_index = !r->settings.sparse_index;
+	if (enable_sparse_index &&
+	    (init_worktree_config(r) || set_sparse_index_config(r, 1)))
+		warning(_("could not enable the sparse index"));
+
+	if (initial_checkout) {
+		if (prefetch_module_blobs(r, "HEAD"))
+			warning(_("could not prefetch the blobs of module '%s'"),
+				module_name);
+		checkout_head(r);
+	}
+	if (enable_sparse_index && !initial_checkout)
+		collapse_index(r);
+
+	/* The cone is the closure; remember which module it belongs to. */
+	if (repo_config_set_worktree_gently(r, "modgit.module", module_name))
+		warning(_("could not record the active module"));
+
+	printf(_("Switched to module '%s'\n"), module_name);
+
+	strvec_clear(&paths);
+	return 0;
+}
+
+static int cmd_modgit_switch(int argc, const char **argv, const char *prefix,
+			     struct repository *repo UNUSED)
+{
+	const char *module_name = NULL;
+
+	struct option options[] = {
+		OPT_STRING(0, "module", &module_name, N_("name"), N_("name of the module to switch to")),
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, prefix, options, modgit_usage, 0);
+
+	/* If no --module flag, maybe the first arg is the name */
+	if (!module_name && argc > 0)
+		module_name = argv[0];
+
+	if (!module_name)
+		die(_("module name is required"));
+
+	return switch_to_module(the_repository, module_name);
 }
 
-static int switch_to_module(const char *module_name)
+static int cmd_modgit_worktree_add(int argc, const char **argv,
+				   const char *prefix,
+				   struct repository *repo UNUSED)
 {
-    struct module_def *mod = load_module_def(module_name);
-    if (!mod)
-        die_with_hint(_("module not found"), 
-                     _("Run 'git modgit list' to see available modules. Check .modgit file presence."));
+	struct repository *r = the_repository;
+	const char *module_name, *rev = "HEAD";
+	struct strvec paths = STRVEC_INIT;
+	char *path;
+	int workers;
+
+	struct option options[] = {
+		OPT_STRING(0, "rev", &rev, N_("commit-ish"),
+			   N_("check out this revision instead of HEAD")),
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, prefix, options, modgit_usage, 0);
+	if (argc < 1 || argc > 2)
+		usage_with_options(modgit_usage, options);
+	module_name = argv[0];
+
+	repo_config(r, git_default_config, NULL);
+
+	/* Fail before creating anything if the module does not exist. */
+	switch (lookup_module_closure_rev(r, rev, module_name, &paths)) {
+	case 0:
+		break;
+	case MODULE_NOT_FOUND:
+		die_with_hint(_("module not found"),
+			      _("Check that the revision has a .modgit file defining the module."));
+	default:
+		die_with_hint(_("cannot resolve module dependencies"),
+			      _("Remove the dependency cycle from the .modgit file."));
+	}
+
+	if (argc > 1) {
+		path = prefix_filename(prefix, argv[1]);
+	} else {
+		/* Next to this worktree, e.g. "../repo-frontend". */
+		char *name = xstrdup(module_name);
+
+		for (char *p = name; *p; p++)
+			if (is_dir_sep(*p))
+				*p = '-';
+		path = xstrfmt("%s-%s", r->worktree, name);
+		free(name);
+	}
+
+	printf(_("Preparing worktree for module '%s' in '%s'\n"), module_name, path);
+
+	/*
+	 * 1. A linked worktree sharing our object store, without a checkout:
+	 * the switch below only checks out the closure of the module.
+	 */
+	{
+		const char *add_args[] = {
+			"worktree", "add", "--no-checkout", "--detach", path, rev, NULL
+		};
+		if (run_git_cmd(add_args))
+			die_with_hint(_("failed to add worktree"),
+				      _("Check that the path does not exist yet."));
+	}
+
+	/*
+	 * 2. Give the new worktree its own cone-mode sparse-checkout and a
+	 * sparse index, in its own config.worktree, so that it does not
+	 * change the sparse-checkout of any other worktree.
+	 */
+	{
+		struct child_process cmd = CHILD_PROCESS_INIT;
 
-    struct strvec paths = STRVEC_INIT;
-    resolve_dependencies(mod, &paths);
-    
-    if (paths.nr == 0) {
-        warning(_("module '%s' has no paths defined"), module_name);
-    }
+		cmd.git_cmd = 1;
+		cmd.dir = path;
+		strvec_pushl(&cmd.args, "sparse-checkout", "init", "--cone",
+			     "--sparse-index", NULL);
+		if (run_command(&cmd))
+			die_with_hint(_("failed to configure sparse-checkout"),
+				      _("Check 'git worktree list' and remove the new worktree."));
+	}
 
-    // Configure Sparse Checkout
-    struct strvec sparse_args = STRVEC_INIT;
-    strvec_push(&sparse_args, "sparse-checkout");
-    strvec_push(&sparse_args, "set");
-    for (int i = 0; i < paths.nr; i++)
-        strvec_push(&sparse_args, paths.v[i]);
-    strvec_push(&sparse_args, NULL);
-    
-    if (run_git_cmd((const char **)sparse_args.v))
-        die_with_hint(_("bfailed to configure sparse-checkout"), 
-                     _("Ensure your git version supports sparse-checkout (v2.25+)"));
+	/*
+	 * 3. Switch it to the module, checking the closure out with parallel
+	 * checkout unless the user configured the number of workers.
+	 */
+	{
+		struct child_process cmd = CHILD_PROCESS_INIT;
+		int ret;
 
-    printf(_("Switched to module '%s'\n"), module_name);
+		cmd.git_cmd = 1;
+		cmd.dir = path;
+		if (repo_config_get_int(r, "checkout.workers", &workers))
+			strvec_pushl(&cmd.args, "-c", "checkout.workers=0", NULL);
+		strvec_pushl(&cmd.args, "modgit", "switch", module_name, NULL);
+		ret = run_command(&cmd);
 
-    free_module_def(mod);
-    strvec_clear(&paths);
-    strvec_clear(&sparse_args);
-    return 0;
+		free(path);
+		strvec_clear(&paths);
+		return ret;
+	}
 }
 
-static int cmd_modgit_switch(int argc, const char **argv, const char *prefix)
+static int cmd_modgit_worktree(int argc, const char **argv, const char *prefix,
+			       struct repository *repo)
 {
-    const char *module_name = NULL;
-    
-    struct option options[] = {
-        OPT_STRING(0, "module", &module_name, N_("name"), N_("name of the module to switch to")),
-        OPT_END()
-    };
+	parse_opt_subcommand_fn *fn = NULL;
+	struct option options[] = {
+		OPT_SUBCOMMAND("add", &fn, cmd_modgit_worktree_add),
+		OPT_END()
+	};
 
-    argc = parse_options(argc, argv, prefix, options, modgit_usage, 0);
-    
-    // If no --module flag, maybe the first arg is the name
-    if (!module_name && argc > 0)
-        module_name = argv[0];
+	argc = parse_options(argc, argv, prefix, options, modgit_usage, 0);
+	return fn(argc, argv, prefix, repo);
+}
 
-    if (!module_name)
-        die(_("module name is required"));
+static int clone_partial(const char *module_name, const char *repo_url,
+			 const char *repo_dir, int module_filter)
+{
+	char *filter = module_filter ?
+		xstrfmt("--filter=module:%s", module_name) :
+		xstrdup("--filter=blob:none");
+	const char *clone_args[] = {
+		"clone",
+		filter,
+		"--sparse",
+		"--no-checkout",
+		repo_url,
+		repo_dir,
+		NULL
+	};
+	int ret = run_git_cmd(clone_args);
 
-    return switch_to_module(module_name);
+	free(filter);
+	return ret;
 }
 
-static int cmd_modgit_clone(int argc, const char **argv, const char *prefix)
+static int cmd_modgit_clone(int argc, const char **argv, const char *prefix,
+			    struct repository *repo UNUSED)
 {
 	const char *module_name = NULL;
-	
+	const char *repo_url, *repo_dir;
+
 	struct option options[] = {
 		OPT_STRING(0, "module", &module_name, N_("name"), N_("name of the module to clone")),
 		OPT_END()
@@ -110,149 +537,777 @@ static int cmd_modgit_clone(int argc, const char **argv, const char *prefix)
 
 	if (!module_name)
 		die(_("module name is required for clone"));
-    
-    if (argc < 1)
-        die(_("repository url is required"));
-        
-    const char *repo_url = argv[0];
-    const char *repo_dir = (argc > 1) ? argv[1] : "repo"; // Simple default
+
+	if (argc < 1)
+		die(_("repository url is required"));
+
+	repo_url = argv[0];
+	repo_dir = (argc > 1) ? argv[1] : "repo"; /* Simple default */
 
 	printf(_("Cloning module '%s' from '%s'...\n"), module_name, repo_url);
 
-    // 1. Partial Clone (Blob:None) + Sparse
-    const char *clone_args[] = {
-        "clone",
-        "--filter=blob:none",
-        "--sparse",
-        repo_url,
-        repo_dir,
-        NULL
-    };
-    if (run_git_cmd(clone_args))
-        die_with_hint(_("failed to clone repository"), 
-                     _("Check your network connection and repository URL access permissions."));
-
-    // 2. Resolve Module Dependencies
-    // We must switch context to the new repo dir
-    if (chdir(repo_dir))
-        die_errno("cannot chdir to newly cloned repo");
-
-    // 3. Switch to module (Configure Sparse Checkout)
-    return switch_to_module(module_name);
-}
-
-static int cmd_modgit_list(int argc, const char **argv, const char *prefix)
-{
-    struct strvec modules = STRVEC_INIT;
-    
-    list_modules(&modules);
-    
-    if (modules.nr == 0) {
-        printf(_("No modules found.\n"));
-        printf(_("hint: Create a .modgit file in the root to define modules.\n"));
-    } else {
-        printf(_("Available modules:\n"));
-        for (int i = 0; i < modules.nr; i++) {
-            printf("  %s\n", modules.v[i]);
-        }
-    }
-    
-    strvec_clear(&modules);
-    return 0;
-}
-
-static int cmd_modgit_run(int argc, const char **argv, const char *prefix)
-{
-    // modgit run <command>
-    if (argc < 1)
-        die(_("usage: modgit run <command>"));
-
-    printf(_("Running in module overlay: %s...\n"), argv[0]);
-    
-    struct child_process cmd = CHILD_PROCESS_INIT;
-    cmd.use_shell = 1;
-    cmd.args.v = argv;
-    int ret = run_command(&cmd);
-    if (ret)
-        warning(_("command '%s' exited with error code %d"), argv[0], ret);
-    return ret;
-}
-
-static int cmd_modgit_commit(int argc, const char **argv, const char *prefix)
-{
-    // modgit commit [message]
-    const char *msg = (argc > 0) ? argv[0] : "Module update";
-
-    printf(_("Committing overlay changes...\n"));
-    
-    // 1. Create a dynamic branchname: modgit/patch-<timestamp>
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char branch_name[100];
-    strftime(branch_name, sizeof(branch_name), "modgit/patch-%Y%m%d-%H%M%S", t);
-    
-    printf(_("Creating branch '%s'...\n"), branch_name);
-    
-    const char *checkout_args[] = { "checkout", "-b", branch_name, NULL };
-    if (run_git_cmd(checkout_args))
-        warning(_("Could not create branch (maybe already on it?)\n"
-                 "hint: Proceeding with commit on current branch."));
-        
-    // 2. Add only modified files that are tracked
-    const char *add_args[] = { "add", "-u", NULL }; 
-    if (run_git_cmd(add_args))
-        die_with_hint(_("failed to add changes"), _("Check if files are locked or permissions are correct."));
-    
-    const char *commit_args[] = { "commit", "-m", msg, NULL };
-    return run_git_cmd(commit_args);
-}
-
-static int cmd_modgit_status(int argc, const char **argv, const char *prefix)
-{
-    printf(_("ModuleGit Status:\n"));
-    
-    // 1. Check if we are in a sparse-checkout (module mode)
-    // This is a rough check. Real implementation would check core.sparseCheckout
-    
-    // 2. Run git status
-    const char *status_args[] = { "status", NULL };
-    return run_git_cmd(status_args);
-}
-
-static int cmd_modgit_ai_context(int argc, const char **argv, const char *prefix)
-{
-    const char *module_name = NULL;
-    
-    struct option options[] = {
-        OPT_STRING(0, "module", &module_name, N_("name"), N_("name of the module to generate context for")),
-        OPT_END()
-    };
-
-    argc = parse_options(argc, argv, prefix, options, modgit_usage, 0);
-
-    if (!module_name)
-        die(_("module name is required"));
-
-    struct module_def *mod = load_module_def(module_name);
-    if (!mod)
-        die(_("module '%s' not found"), module_name);
-
-    struct strvec paths = STRVEC_INIT;
-    resolve_dependencies(mod, &paths);
-    
-    // Output format: Just the file paths for now, maybe content later
-    // Could support different formats like --format=xml/json
-    printf("Subject: Context for module '%s'\n\n", module_name);
-    printf("This context includes the following paths:\n");
-    for (int i = 0; i < paths.nr; i++) {
-        printf("- %s\n", paths.v[i]);
-    }
-    
-    // TODO: Actually dump file contents or generate XML/Markdown for LLM
-    
-    free_module_def(mod);
-    strvec_clear(&paths);
-    return 0;
+	/*
+	 * 1. Partial Clone + Sparse, without a checkout. The module:<name>
+	 * filter leaves out the trees and blobs outside of the module; a
+	 * server that does not allow it still serves a blob:none clone,
+	 * whose module blobs the switch below then fetches at once.
+	 */
+	if (clone_partial(module_name, repo_url, repo_dir, 1)) {
+		warning(_("retrying the clone without the module filter"));
+		if (clone_partial(module_name, repo_url, repo_dir, 0))
+			die_with_hint(_("failed to clone repository"),
+				      _("Check your network connection and repository URL access permissions."));
+	}
+
+	/*
+	 * 2. Switch to module (Configure Sparse Checkout)
+	 * We are not set up in the new repository, so let a child process
+	 * that is do it.
+	 */
+	{
+		struct child_process cmd = CHILD_PROCESS_INIT;
+
+		cmd.git_cmd = 1;
+		cmd.dir = repo_dir;
+		strvec_pushl(&cmd.args, "modgit", "switch", module_name, NULL);
+		return run_command(&cmd);
+	}
+}
+
+static int cmd_modgit_list(int argc UNUSED, const char **argv UNUSED,
+			   const char *prefix UNUSED,
+			   struct repository *repo UNUSED)
+{
+	struct module_graph graph;
+
+	load_module_graph(&graph);
+
+	if (!graph.modules_nr) {
+		printf(_("No modules found.\n"));
+		printf(_("hint: Create a .modgit file in the root to define modules.\n"));
+	} else {
+		printf(_("Available modules:\n"));
+		for (size_t i = 0; i < graph.modules_nr; i++)
+			printf("  %s\n", graph.modules[i]->name);
+	}
+
+	module_graph_release(&graph);
+	return 0;
+}
+
+enum run_state {
+	RUN_SKIPPED,
+	RUN_PENDING,
+	RUN_RUNNING,
+	RUN_DONE,
+	RUN_FAILED,
+};
+
+struct run_each {
+	const char **argv;
+
+	/* All modules in dependency order, with their state by index. */
+	struct module_list order;
+	enum run_state *state;
+	int failed;
+};
+
+/*
+ * Return the first pending module whose dependencies have all finished,
+ * skipping the modules that depend on a failed one.
+ */
+static struct module_def *next_ready_module(struct run_each *each,
+					    struct strbuf *out)
+{
+	for (size_t i = 0; i < each->order.nr; i++) {
+		struct module_def *module = each->order.items[i];
+		struct module_def *failed_dep = NULL;
+		int blocked = 0;
+
+		if (each->state[module->index] != RUN_PENDING)
+			continue;
+		for (size_t j = 0; !failed_dep && j < module->deps_nr; j++) {
+			struct module_def *dep = module->deps[j];
+
+			if (each->state[dep->index] == RUN_FAILED)
+				failed_dep = dep;
+			else if (each->state[dep->index] == RUN_PENDING ||
+				 each->state[dep->index] == RUN_RUNNING)
+				blocked = 1;
+		}
+
+		if (failed_dep) {
+			strbuf_addf(out, _("Skipping module '%s': '%s' failed\n"),
+				    module->name, failed_dep->name);
+			each->state[module->index] = RUN_FAILED;
+			each->failed++;
+			continue;
+		}
+		if (blocked)
+			continue;
+		if (!module->paths_nr || !is_directory(module->paths[0])) {
+			if (module->paths_nr)
+				strbuf_addf(out, _("Skipping module '%s': not checked out\n"),
+					    module->name);
+			each->state[module->index] = RUN_DONE;
+			continue;
+		}
+		return module;
+	}
+	return NULL;
+}
+
+/*
+ * The command runs in the first path declared for the module. All of its
+ * paths, relative to the top of the worktree, are in MODGIT_PATHS,
+ * separated by colons, for commands that need to look at the others.
+ */
+static int run_each_next(struct child_process *cp, struct strbuf *out,
+			 void *cb, void **task_cb)
+{
+	struct run_each *each = cb;
+	struct module_def *module = next_ready_module(each, out);
+	struct strbuf paths = STRBUF_INIT;
+
+	if (!module)
+		return 0;
+
+	each->state[module->index] = RUN_RUNNING;
+	*task_cb = module;
+
+	strbuf_addf(out, _("Running in module '%s'\n"), module->name);
+	cp->use_shell = 1;
+	cp->dir = module->paths[0];
+	strvec_pushv(&cp->args, each->argv);
+	strvec_pushf(&cp->env, "MODGIT_MODULE=%s", module->name);
+	for (size_t i = 0; i < module->paths_nr; i++) {
+		if (i)
+			strbuf_addch(&paths, ':');
+		strbuf_addstr(&paths, module->paths[i]);
+	}
+	strvec_pushf(&cp->env, "MODGIT_PATHS=%s", paths.buf);
+	strbuf_release(&paths);
+	return 1;
+}
+
+static int run_each_finished(int result, struct strbuf *out,
+			     void *cb, void *task_cb)
+{
+	struct run_each *each = cb;
+	struct module_def *module = task_cb;
+
+	if (!result) {
+		each->state[module->index] = RUN_DONE;
+		return 0;
+	}
+	strbuf_addf(out, _("Command failed in module '%s'\n"), module->name);
+	each->state[module->index] = RUN_FAILED;
+	each->failed++;
+	return 0;
+}
+
+static int run_each_start_failure(struct strbuf *out, void *cb, void *task_cb)
+{
+	return run_each_finished(-1, out, cb, task_cb);
+}
+
+/*
+ * Run `argv` in the directory of each module, or of each module touched
+ * by the revision range `affected`, in parallel. A module only starts
+ * after the modules it depends on have finished, and is skipped if one
+ * of them failed. The output of each command is buffered and shown in
+ * one piece, in the order the commands were started.
+ */
+static int run_in_each_module(struct repository *r, const char **argv,
+			      const char *affected, int jobs)
+{
+	struct module_graph graph;
+	struct run_each each = { .argv = argv, .order = MODULE_LIST_INIT };
+	struct run_process_parallel_opts opts = {
+		.tr2_category = "modgit",
+		.tr2_label = "run",
+		.processes = jobs > 0 ? jobs : online_cpus(),
+		.get_next_task = run_each_next,
+		.start_failure = run_each_start_failure,
+		.task_finished = run_each_finished,
+		.data = &each,
+	};
+
+	load_module_graph(&graph);
+	if (module_graph_topo_order_all(&graph, &each.order) < 0)
+		die(_("cannot order the modules by their dependencies"));
+	CALLOC_ARRAY(each.state, graph.modules_nr);
+
+	if (affected) {
+		struct module_list modules = MODULE_LIST_INIT;
+		struct rev_info revs;
+		const char *rev_argv[] = { NULL, affected, NULL };
+
+		repo_init_revisions(r, &revs, NULL);
+		if (setup_revisions(2, rev_argv, &revs, NULL) > 1 ||
+		    !revs.pending.nr)
+			die(_("invalid revision range '%s'"), affected);
+		if (modgit_affected_modules(r, &graph, &revs, 1, &modules))
+			die(_("unable to compute the affected modules"));
+		for (size_t i = 0; i < modules.nr; i++)
+			each.state[modules.items[i]->index] = RUN_PENDING;
+		release_revisions(&revs);
+		module_list_clear(&modules);
+	} else {
+		for (size_t i = 0; i < graph.modules_nr; i++)
+			each.state[i] = RUN_PENDING;
+	}
+
+	run_processes_parallel(&opts);
+
+	free(each.state);
+	module_list_clear(&each.order);
+	module_graph_release(&graph);
+	return each.failed ? 1 : 0;
+}
+
+static int cmd_modgit_run(int argc, const char **argv,
+			  const char *prefix,
+			  struct repository *repo UNUSED)
+{
+	struct child_process cmd = CHILD_PROCESS_INIT;
+	const char *affected = NULL;
+	int each = 0, jobs = 0;
+	int ret;
+
+	struct option options[] = {
+		OPT_BOOL(0, "each", &each, N_("run the command in the first path of every module")),
+		OPT_STRING(0, "affected", &affected, N_("revision-range"),
+			   N_("only run in the modules affected by the range")),
+		OPT_INTEGER('j', "jobs", &jobs,
+			    N_("run this many commands at once")),
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, prefix, options, modgit_usage,
+			     PARSE_OPT_STOP_AT_NON_OPTION);
+	if (argc < 1)
+		usage_with_options(modgit_usage, options);
+	if ((affected || jobs) && !each)
+		die(_("--affected and --jobs require --each"));
+
+	if (each) {
+		repo_config(the_repository, git_default_config, NULL);
+		return run_in_each_module(the_repository, argv, affected, jobs);
+	}
+
+	printf(_("Running in module overlay: %s...\n"), argv[0]);
+
+	cmd.use_shell = 1;
+	strvec_pushv(&cmd.args, argv);
+	ret = run_command(&cmd);
+	if (ret)
+		warning(_("command '%s' exited with error code %d"), argv[0], ret);
+	return ret;
+}
+
+static int cmd_modgit_affected(int argc, const char **argv, const char *prefix,
+			       struct repository *repo UNUSED)
+{
+	struct repository *r = the_repository;
+	struct module_graph graph;
+	struct module_list affected = MODULE_LIST_INIT;
+	struct rev_info revs;
+	int direct = 0;
+	int ret;
+
+	struct option options[] = {
+		OPT_BOOL(0, "direct", &direct,
+			 N_("omit the modules that only depend on a changed module")),
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, prefix, options, modgit_usage,
+			     PARSE_OPT_KEEP_ARGV0 | PARSE_OPT_KEEP_UNKNOWN_OPT);
+
+	repo_config(r, git_default_config, NULL);
+	repo_init_revisions(r, &revs, prefix);
+	if (setup_revisions(argc, argv, &revs, NULL) > 1)
+		die(_("unrecognized argument: %s"), argv[1]);
+	if (!revs.pending.nr)
+		die(_("no revision range given"));
+
+	load_module_graph(&graph);
+	ret = modgit_affected_modules(r, &graph, &revs, !direct, &affected);
+	for (size_t i = 0; i < affected.nr; i++)
+		printf("%s\n", affected.items[i]->name);
+
+	release_revisions(&revs);
+	module_list_clear(&affected);
+	module_graph_release(&graph);
+	return !!ret;
+}
+
+/*
+ * Die if committing `tree` on top of HEAD would change a read-only
+ * module, or an owners-only module the committer does not own. The
+ * permissions come from the .modgit of HEAD, not the worktree one
+ * the committer could have edited.
+ */
+static void check_module_permissions(struct repository *r,
+				     const struct object_id *tree)
+{
+	struct module_graph graph;
+	struct module_trie trie = MODULE_TRIE_INIT;
+	struct strbuf err = STRBUF_INIT;
+	const char *committer;
+	struct ident_split ident;
+	struct object_id head_oid, modgit_oid;
+	struct commit *head;
+	char *email;
+
+	if (repo_get_oid(r, "HEAD", &head_oid) ||
+	    repo_get_oid(r, "HEAD:" MODGIT_FILE, &modgit_oid))
+		return;
+
+	head = lookup_commit_reference(r, &head_oid);
+	if (!head || repo_parse_commit(r, head))
+		die(_("could not parse HEAD commit"));
+
+	module_graph_init(&graph);
+	if (module_graph_load_blob(&graph, r, &modgit_oid) < 0)
+		die(_("could not load '%s' from HEAD"), MODGIT_FILE);
+	module_trie_build(&trie, &graph, 1);
+	if (!trie.modules_nr)
+		goto out;
+
+	committer = git_committer_info(IDENT_STRICT);
+	if (split_ident_line(&ident, committer, strlen(committer)))
+		die(_("malformed committer identity '%s'"), committer);
+	email = xmemdupz(ident.mail_begin, ident.mail_end - ident.mail_begin);
+
+	if (modgit_check_tree_change(r, &trie, get_commit_tree_oid(head),
+				     tree, email, &err))
+		die(_("refusing to commit: %s"), err.buf);
+	free(email);
+
+out:
+	strbuf_release(&err);
+	module_trie_clear(&trie);
+	module_graph_release(&graph);
+}
+
+static int cmd_modgit_commit(int argc, const char **argv, const char *prefix,
+			     struct repository *repo UNUSED)
+{
+	struct repository *r = the_repository;
+	struct ref_store *refs = get_main_ref_store(r);
+	const char *module_name = NULL;
+	const char *message = NULL;
+	struct module_graph graph;
+	struct module_list modules = MODULE_LIST_INIT;
+	struct strvec paths = STRVEC_INIT;
+	struct pathspec pathspec = { 0 };
+	struct lock_file index_lock = LOCK_INIT;
+	struct ref_transaction *transaction;
+	struct commit_list *parents = NULL;
+	struct strbuf msg = STRBUF_INIT;
+	struct strbuf branch = STRBUF_INIT;
+	struct strbuf reflog_msg = STRBUF_INIT;
+	struct strbuf err = STRBUF_INIT;
+	struct object_id head_oid, commit_oid;
+	const struct object_id *tree_oid;
+	const char *head_target;
+	int head_flags, new_branch = 1;
+	char *head_ref;
+	struct tm tm;
+	time_t now;
+
+	struct option options[] = {
+		OPT_STRING(0, "module", &module_name, N_("name"),
+			   N_("commit the changes of this module instead of the current one")),
+		OPT_STRING('m', "message", &message, N_("message"), N_("commit message")),
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, prefix, options, modgit_usage, 0);
+	if (!message)
+		message = argc > 0 ? argv[0] : "Module update";
+
+	repo_config(r, git_default_config, NULL);
+	prepare_repo_settings(r);
+	r->settings.command_requires_full_index = 0;
+	setup_work_tree();
+
+	load_module_graph(&graph);
+	resolve_current_module(r, &graph, module_name, &modules, &paths);
+	if (!paths.nr)
+		die(_("module '%s' has no paths"), modules.items[modules.nr - 1]->name);
+	parse_pathspec(&pathspec, 0, PATHSPEC_LITERAL_PATH,
+		       NULL, (const char **)paths.v);
+
+	/* Fail before touching the index if we cannot commit anyway. */
+	git_committer_info(IDENT_STRICT);
+
+	trace2_region_enter("modgit", "commit", r);
+
+	/*
+	 * Refresh and stage only the tracked files of the module, like
+	 * "git add -u" limited to its paths would. Updating an entry
+	 * invalidates the cache-tree along its path only, so the subtrees
+	 * of the other directories are reused when writing the tree.
+	 */
+	repo_hold_locked_index(r, &index_lock, LOCK_DIE_ON_ERROR);
+	repo_read_index_preload(r, &pathspec, 0);
+	refresh_index(r->index, REFRESH_QUIET, &pathspec, NULL, NULL);
+	if (add_files_to_cache(r, NULL, &pathspec, NULL, 0, 0))
+		die_with_hint(_("failed to add changes"),
+			      _("Check if files are locked or permissions are correct."));
+
+	/*
+	 * Like "git commit", let the pre-commit hook see the index we are
+	 * about to commit, and pick up what it changes in it.
+	 */
+	if (hook_exists(r, "pre-commit")) {
+		struct run_hooks_opt hook_opt = RUN_HOOKS_OPT_INIT;
+		const char *index_file = get_lock_file_path(&index_lock);
+
+		if (write_locked_index(r->index, &index_lock, 0))
+			die(_("unable to write new index file"));
+		strvec_pushf(&hook_opt.env, "GIT_INDEX_FILE=%s", index_file);
+		if (run_hooks_opt(r, "pre-commit", &hook_opt))
+			die(_("the pre-commit hook refused the commit"));
+		discard_index(r->index);
+		read_index_from(r->index, index_file, repo_get_git_dir(r));
+		if (reopen_lock_file(&index_lock) < 0)
+			die(_("unable to write new index file"));
+	}
+	if (cache_tree_update(r->index, WRITE_TREE_SILENT))
+		die(_("unable to write the tree of the module"));
+	tree_oid = &r->index->cache_tree->oid;
+	check_module_permissions(r, tree_oid);
+	if (write_locked_index(r->index, &index_lock, COMMIT_LOCK))
+		die(_("unable to write new index file"));
+
+	head_target = refs_resolve_ref_unsafe(refs, "HEAD", 0, &head_oid,
+					      &head_flags);
+	if (!head_target)
+		die(_("unable to resolve HEAD"));
+	head_ref = xstrdup(head_target);
+	if (!is_null_oid(&head_oid)) {
+		struct commit *head = lookup_commit_reference(r, &head_oid);
+
+		if (!head || repo_parse_commit(r, head))
+			die(_("could not parse HEAD commit"));
+		if (oideq(tree_oid, get_commit_tree_oid(head))) {
+			printf(_("nothing to commit in module '%s'\n"),
+			       modules.items[modules.nr - 1]->name);
+			trace2_region_leave("modgit", "commit", r);
+			goto out;
+		}
+		commit_list_insert(head, &parents);
+	}
+
+	strbuf_addstr(&msg, message);
+	strbuf_complete_line(&msg);
+	if (commit_tree(msg.buf, msg.len, tree_oid, parents, &commit_oid,
+			NULL, NULL))
+		die(_("failed to write commit object"));
+
+	/* Commit onto a new branch modgit/patch-<timestamp>. */
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	strbuf_addstr(&branch, "refs/heads/");
+	strbuf_addftime(&branch, "modgit/patch-%Y%m%d-%H%M%S", &tm, 0, 0);
+	if (refs_ref_exists(refs, branch.buf)) {
+		warning(_("Could not create branch '%s'\n"
+			  "hint: Proceeding with commit on current branch."),
+			branch.buf + strlen("refs/heads/"));
+		new_branch = 0;
+	}
+
+	strbuf_addf(&reflog_msg, "modgit commit%s: ",
+		    parents ? "" : " (initial)");
+	strbuf_add(&reflog_msg, msg.buf, strchrnul(msg.buf, '\n') - msg.buf);
+
+	/*
+	 * Create the branch and point HEAD at it, or advance the current
+	 * branch, in a single ref transaction.
+	 */
+	transaction = ref_store_transaction_begin(refs, 0, &err);
+	if (!transaction ||
+	    (new_branch &&
+	     (ref_transaction_create(transaction, branch.buf, &commit_oid,
+				     NULL, 0, reflog_msg.buf, &err) ||
+	      ref_transaction_update(transaction, "HEAD", NULL,
+				     (head_flags & REF_ISSYMREF) ? NULL : &head_oid,
+				     branch.buf,
+				     (head_flags & REF_ISSYMREF) ? head_ref : NULL,
+				     REF_NO_DEREF, reflog_msg.buf, &err))) ||
+	    (!new_branch &&
+	     ref_transaction_update(transaction, "HEAD", &commit_oid, &head_oid,
+				    NULL, NULL, 0, reflog_msg.buf, &err)) ||
+	    ref_transaction_commit(transaction, &err))
+		die("%s", err.buf);
+	ref_transaction_free(transaction);
+
+	trace2_region_leave("modgit", "commit", r);
+
+	if (new_branch)
+		printf(_("Committed to new branch '%s'\n"),
+		       branch.buf + strlen("refs/heads/"));
+	printf("[%s] %s\n",
+	       repo_find_unique_abbrev(r, &commit_oid, DEFAULT_ABBREV),
+	       message);
+
+	run_hooks(r, "post-commit");
+
+out:
+	free(head_ref);
+	free_commit_list(parents);
+	strbuf_release(&msg);
+	strbuf_release(&branch);
+	strbuf_release(&reflog_msg);
+	strbuf_release(&err);
+	clear_pathspec(&pathspec);
+	strvec_clear(&paths);
+	module_list_clear(&modules);
+	module_graph_release(&graph);
+	return 0;
+}
+
+/*
+ * Return whether `path`, as listed by wt_status, lies inside one of the
+ * own paths of `module`.
+ */
+static int module_contains(const struct module_def *module, const char *path)
+{
+	for (size_t i = 0; i < module->paths_nr; i++) {
+		const char *rest;
+
+		if (skip_prefix(path, module->paths[i], &rest) &&
+		    (!*rest || *rest == '/'))
+			return 1;
+	}
+	return 0;
+}
+
+static size_t count_in_module(const struct module_def *module,
+			      const struct string_list *paths)
+{
+	size_t nr = 0;
+
+	for (size_t i = 0; i < paths->nr; i++)
+		nr += module_contains(module, paths->items[i].string);
+	return nr;
+}
+
+static void print_module_counts(struct wt_status *s, struct module_list *modules)
+{
+	printf(_("\nChanges by module:\n"));
+	for (size_t i = 0; i < modules->nr; i++) {
+		struct module_def *module = modules->items[i];
+		size_t changed = count_in_module(module, &s->change);
+		size_t untracked = count_in_module(module, &s->untracked);
+
+		if (!changed && !untracked)
+			printf(_("  %s: clean\n"), module->name);
+		else
+			printf(_("  %s: %"PRIuMAX" changed, %"PRIuMAX" untracked\n"),
+			       module->name, (uintmax_t)changed,
+			       (uintmax_t)untracked);
+	}
+}
+
+/*
+ * Honour status.showUntrackedFiles, which "git status" reads through
+ * its own config callback.
+ */
+static enum untracked_status_type untracked_files_config(struct repository *r)
+{
+	const char *v;
+
+	if (repo_config_get_string_tmp(r, "status.showuntrackedfiles", &v))
+		return SHOW_NORMAL_UNTRACKED_FILES;
+
+	switch (git_parse_maybe_bool(v)) {
+	case 0:
+		return SHOW_NO_UNTRACKED_FILES;
+	case 1:
+		return SHOW_NORMAL_UNTRACKED_FILES;
+	}
+	if (!strcmp(v, "no"))
+		return SHOW_NO_UNTRACKED_FILES;
+	if (!strcmp(v, "normal"))
+		return SHOW_NORMAL_UNTRACKED_FILES;
+	if (!strcmp(v, "all"))
+		return SHOW_ALL_UNTRACKED_FILES;
+	die(_("Invalid untracked files mode '%s'"), v);
+}
+
+static int cmd_modgit_status(int argc, const char **argv, const char *prefix,
+			     struct repository *repo UNUSED)
+{
+	struct repository *r = the_repository;
+	const char *module_name = NULL;
+	int status_format = STATUS_FORMAT_LONG;
+	struct module_graph graph;
+	struct module_def *module;
+	struct module_list modules = MODULE_LIST_INIT;
+	struct strvec paths = STRVEC_INIT;
+	struct lock_file index_lock = LOCK_INIT;
+	struct wt_status s;
+	struct object_id oid;
+	int fd;
+
+	struct option options[] = {
+		OPT_STRING(0, "module", &module_name, N_("name"),
+			   N_("show the status of this module instead of the current one")),
+		OPT_SET_INT('s', "short", &status_format,
+			    N_("show status concisely"), STATUS_FORMAT_SHORT),
+		OPT_SET_INT(0, "porcelain", &status_format,
+			    N_("machine-readable output"), STATUS_FORMAT_PORCELAIN),
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, prefix, options, modgit_usage, 0);
+
+	repo_config(r, git_default_config, NULL);
+	prepare_repo_settings(r);
+	r->settings.command_requires_full_index = 0;
+	setup_work_tree();
+
+	load_module_graph(&graph);
+	module = resolve_current_module(r, &graph, module_name, &modules, &paths);
+
+	wt_status_prepare(r, &s);
+	repo_config(r, git_diff_ui_config, NULL);
+	s.status_format = status_format;
+	s.show_branch = 0;
+	s.ahead_behind_flags = AHEAD_BEHIND_FULL;
+	s.hints = advice_enabled(ADVICE_STATUS_HINTS);
+	s.show_untracked_files = untracked_files_config(r);
+
+	trace2_region_enter("modgit", "status", r);
+
+	/*
+	 * An empty pathspec would match everything; a module without
+	 * paths has nothing to report.
+	 */
+	if (paths.nr)
+		parse_pathspec(&s.pathspec, 0, PATHSPEC_LITERAL_PATH,
+			       NULL, (const char **)paths.v);
+	else
+		s.show_untracked_files = SHOW_NO_UNTRACKED_FILES;
+
+	repo_read_index_preload(r, &s.pathspec, 0);
+	refresh_index(r->index, REFRESH_QUIET | REFRESH_UNMERGED,
+		      &s.pathspec, NULL, NULL);
+
+	if (use_optional_locks())
+		fd = repo_hold_locked_index(r, &index_lock, 0);
+	else
+		fd = -1;
+
+	s.is_initial = repo_get_oid(r, s.reference, &oid) ? 1 : 0;
+	if (!s.is_initial)
+		oidcpy(&s.oid_commit, &oid);
+
+	if (paths.nr)
+		wt_status_collect(&s);
+
+	if (0 <= fd)
+		repo_update_index_if_able(r, &index_lock);
+
+	trace2_data_intmax("modgit", r, "status/changed", s.change.nr);
+	trace2_data_intmax("modgit", r, "status/untracked", s.untracked.nr);
+	trace2_region_leave("modgit", "status", r);
+
+	if (status_format == STATUS_FORMAT_LONG)
+		printf(_("On module '%s'\n"), module->name);
+	wt_status_print(&s);
+	if (status_format == STATUS_FORMAT_LONG)
+		print_module_counts(&s, &modules);
+
+	wt_status_collect_free_buffers(&s);
+	clear_pathspec(&s.pathspec);
+	strvec_clear(&paths);
+	module_list_clear(&modules);
+	module_graph_release(&graph);
+	return 0;
+}
+
+static int parse_context_format(const struct option *opt, const char *arg,
+				int unset)
+{
+	int *format = opt->value;
+
+	BUG_ON_OPT_NEG(unset);
+
+	if (!strcmp(arg, "paths"))
+		*format = -1;
+	else if (!strcmp(arg, "markdown"))
+		*format = MODGIT_CONTEXT_MARKDOWN;
+	else if (!strcmp(arg, "json"))
+		*format = MODGIT_CONTEXT_JSON;
+	else
+		return error(_("invalid --format value '%s'"), arg);
+	return 0;
+}
+
+static int cmd_modgit_ai_context(int argc, const char **argv, const char *prefix,
+				 struct repository *repo UNUSED)
+{
+	const char *module_name = NULL;
+	const char *rev = NULL;
+	struct modgit_context_options opts = MODGIT_CONTEXT_OPTIONS_INIT;
+	int format = -1;
+	struct strvec paths = STRVEC_INIT;
+	int ret;
+
+	struct option options[] = {
+		OPT_STRING(0, "module", &module_name, N_("name"), N_("name of the module to generate context for")),
+		OPT_STRING(0, "rev", &rev, N_("revision"), N_("read the files from <revision> instead of HEAD")),
+		OPT_CALLBACK(0, "format", &format, N_("(paths|markdown|json)"),
+			     N_("list the module paths, or dump its files as Markdown or JSON"),
+			     parse_context_format),
+		OPT_INTEGER('j', "jobs", &opts.nr_threads, N_("number of threads reading files")),
+		OPT_UNSIGNED(0, "budget", &opts.budget,
+			     N_("only dump the files that fit into <n> bytes")),
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, prefix, options, modgit_usage, 0);
+
+	if (!module_name)
+		die(_("module name is required"));
+
+	/*
+	 * The files are read from <revision>, so the module must be
+	 * resolved from the .modgit there, too.
+	 */
+	if (rev)
+		ret = lookup_module_closure_rev(the_repository, rev,
+						module_name, &paths);
+	else
+		ret = lookup_module_closure(the_repository, module_name, &paths);
+	if (ret == MODULE_NOT_FOUND)
+		die(_("module '%s' not found"), module_name);
+	if (ret < 0)
+		die(_("cannot resolve dependencies of module '%s'"), module_name);
+
+	if (format < 0 && opts.budget)
+		die(_("--budget requires --format=markdown or --format=json"));
+	if (format < 0) {
+		printf("Subject: Context for module '%s'\n\n", module_name);
+		printf("This context includes the following paths:\n");
+		for (size_t i = 0; i < paths.nr; i++)
+			printf("- %s\n", paths.v[i]);
+		strvec_clear(&paths);
+		return 0;
+	}
+
+	opts.format = format;
+	ret = write_module_context(the_repository, module_name,
+				   rev ? rev : "HEAD", &paths, &opts);
+
+	strvec_clear(&paths);
+	return ret ? 1 : 0;
 }
 
 int cmd_modgit(int argc, const char **argv, const char *prefix, struct repository *repo)
@@ -263,17 +1318,15 @@ int cmd_modgit(int argc, const char **argv, const char *prefix, struct repositor
 		OPT_SUBCOMMAND("list", &fn, cmd_modgit_list),
 		OPT_SUBCOMMAND("status", &fn, cmd_modgit_status),
 		OPT_SUBCOMMAND("switch", &fn, cmd_modgit_switch),
+		OPT_SUBCOMMAND("worktree", &fn, cmd_modgit_worktree),
 		OPT_SUBCOMMAND("run", &fn, cmd_modgit_run),
 		OPT_SUBCOMMAND("commit", &fn, cmd_modgit_commit),
+		OPT_SUBCOMMAND("affected", &fn, cmd_modgit_affected),
 		OPT_SUBCOMMAND("ai-context", &fn, cmd_modgit_ai_context),
 		OPT_END()
 	};
 
 	argc = parse_options(argc, argv, prefix, options, modgit_usage, 0);
-	
-    if (fn)
-		return fn(argc, argv, prefix);
-    
-    usage_with_options(modgit_usage, options);
-    return 1;
+
+	return fn(argc, argv, prefix, repo);
 }
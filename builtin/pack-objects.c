@@ -178,12 +178,14 @@ static inline void oe_set_delta_size(struct packing_data *pack,
 #define SIZE(obj) oe_size(&to_pack, obj)
 #define SET_SIZE(obj,size) oe_set_size(&to_pack, obj, size)
 #define DELTA_SIZE(obj) oe_delta_size(&to_pack, obj)
+#define DELTA_DATA(obj) oe_delta_data(&to_pack, obj)
 #define DELTA(obj) oe_delta(&to_pack, obj)
 #define DELTA_CHILD(obj) oe_delta_child(&to_pack, obj)
 #define DELTA_SIBLING(obj) oe_delta_sibling(&to_pack, obj)
 #define SET_DELTA(obj, val) oe_set_delta(&to_pack, obj, val)
 #define SET_DELTA_EXT(obj, oid) oe_set_delta_ext(&to_pack, obj, oid)
 #define SET_DELTA_SIZE(obj, val) oe_set_delta_size(&to_pack, obj, val)
+#define SET_DELTA_DATA(obj, val) oe_set_delta_data(&to_pack, obj, val)
 #define SET_DELTA_CHILD(obj, val) oe_set_delta_child(&to_pack, obj, val)
 #define SET_DELTA_SIBLING(obj, val) oe_set_delta_sibling(&to_pack, obj, val)
 
@@ -537,12 +539,13 @@ static unsigned long write_no_reuse_object(struct hashfile *f, struct object_ent
 		 * make sure no cached delta data remains from a
 		 * previous attempt before a pack split occurred.
 		 */
-		FREE_AND_NULL(entry->delta_data);
+		free(DELTA_DATA(entry));
+		SET_DELTA_DATA(entry, NULL);
 		entry->z_delta_size = 0;
-	} else if (entry->delta_data) {
+	} else if (DELTA_DATA(entry)) {
 		size = DELTA_SIZE(entry);
-		buf = entry->delta_data;
-		entry->delta_data = NULL;
+		buf = DELTA_DATA(entry);
+		SET_DELTA_DATA(entry, NULL);
 		type = (allow_ofs_delta && DELTA(entry)->idx.offset) ?
 			OBJ_OFS_DELTA : OBJ_REF_DELTA;
 	} else {
@@ -1357,6 +1360,8 @@ static void write_pack_file(void)
 				break;
 			display_progress(progress_state, written);
 		}
+		if (i == to_pack.nr_objects)
+			oe_clear_delta_data(&to_pack);
 
 		if (pack_to_stdout) {
 			/*
@@ -2664,18 +2669,30 @@ static pthread_mutex_t cache_mutex;
 #define cache_unlock()		pthread_mutex_unlock(&cache_mutex)
 
 /*
- * Protect object list partitioning (e.g. struct thread_param) and
- * progress_state
+ * Protect object list partitioning of the path-based search (struct
+ * thread_params) and progress_state
  */
 static pthread_mutex_t progress_mutex;
 #define progress_lock()		pthread_mutex_lock(&progress_mutex)
 #define progress_unlock()	pthread_mutex_unlock(&progress_mutex)
 
+/*
+ * A part of the sorted object list whose deltas one thread is
+ * searching.  The thread takes objects from the front of the list,
+ * while other threads may steal objects from its end, so both are
+ * done with the mutex held.
+ */
+struct delta_segment {
+	struct object_entry **list;
+	unsigned remaining;
+	pthread_mutex_t mutex;
+};
+
 /*
  * Access to struct object_entry is unprotected since each thread owns
  * a portion of the main object list. Just don't access object entries
  * ahead in the list because they can be stolen and would need
- * progress_mutex for protection.
+ * the mutex of their struct delta_segment for protection.
  */
 
 static inline int oe_size_less_than(struct packing_data *pack,
@@ -2869,16 +2886,16 @@ static int try_delta(struct unpacked *trg, struct unpacked *src,
 	 * accounting lock.  Compiler will optimize the strangeness
 	 * away when NO_PTHREADS is defined.
 	 */
-	free(trg_entry->delta_data);
+	free(DELTA_DATA(trg_entry));
 	cache_lock();
-	if (trg_entry->delta_data) {
+	if (DELTA_DATA(trg_entry)) {
 		delta_cache_size -= DELTA_SIZE(trg_entry);
-		trg_entry->delta_data = NULL;
+		SET_DELTA_DATA(trg_entry, NULL);
 	}
 	if (delta_cacheable(src_size, trg_size, delta_size)) {
 		delta_cache_size += delta_size;
 		cache_unlock();
-		trg_entry->delta_data = xrealloc(delta_buf, delta_size);
+		SET_DELTA_DATA(trg_entry, xrealloc(delta_buf, delta_size));
 	} else {
 		cache_unlock();
 		free(delta_buf);
@@ -2918,12 +2935,29 @@ static unsigned long free_unpacked(struct unpacked *n)
 	return freed_mem;
 }
 
-static void find_deltas(struct object_entry **list, unsigned *list_size,
+/*
+ * Number of objects a thread searches before it updates the shared
+ * progress counter.
+ */
+#define DELTA_PROGRESS_BATCH 64
+
+static void add_delta_progress(unsigned *processed, unsigned nr)
+{
+	if (!nr)
+		return;
+	progress_lock();
+	*processed += nr;
+	display_progress(progress_state, *processed);
+	progress_unlock();
+}
+
+static void find_deltas(struct delta_segment *segment,
 			int window, int depth, unsigned *processed)
 {
 	uint32_t i, idx = 0, count = 0;
 	struct unpacked *array;
 	unsigned long mem_usage = 0;
+	unsigned done = 0;
 
 	CALLOC_ARRAY(array, window);
 
@@ -2932,18 +2966,20 @@ static void find_deltas(struct object_entry **list, unsigned *list_size,
 		struct unpacked *n = array + idx;
 		int j, max_depth, best_base = -1;
 
-		progress_lock();
-		if (!*list_size) {
-			progress_unlock();
+		pthread_mutex_lock(&segment->mutex);
+		if (!segment->remaining) {
+			pthread_mutex_unlock(&segment->mutex);
 			break;
 		}
-		entry = *list++;
-		(*list_size)--;
-		if (!entry->preferred_base) {
-			(*processed)++;
-			display_progress(progress_state, *processed);
+		entry = *segment->list++;
+		segment->remaining--;
+		pthread_mutex_unlock(&segment->mutex);
+
+		if (!entry->preferred_base &&
+		    ++done == DELTA_PROGRESS_BATCH) {
+			add_delta_progress(processed, done);
+			done = 0;
 		}
-		progress_unlock();
 
 		mem_usage -= free_unpacked(n);
 		n->entry = entry;
@@ -3005,18 +3041,21 @@ static void find_deltas(struct object_entry **list, unsigned *list_size,
 		 * instead, as we can afford spending more time compressing
 		 * between writes at that moment.
 		 */
-		if (entry->delta_data && !pack_to_stdout) {
+		if (DELTA_DATA(entry) && !pack_to_stdout) {
+			void *delta_data = DELTA_DATA(entry);
 			unsigned long size;
 
-			size = do_compress(&entry->delta_data, DELTA_SIZE(entry));
+			size = do_compress(&delta_data, DELTA_SIZE(entry));
 			if (size < (1U << OE_Z_DELTA_BITS)) {
+				SET_DELTA_DATA(entry, delta_data);
 				entry->z_delta_size = size;
 				cache_lock();
 				delta_cache_size -= DELTA_SIZE(entry);
 				delta_cache_size += entry->z_delta_size;
 				cache_unlock();
 			} else {
-				FREE_AND_NULL(entry->delta_data);
+				free(delta_data);
+				SET_DELTA_DATA(entry, NULL);
 				entry->z_delta_size = 0;
 			}
 		}
@@ -3053,6 +3092,8 @@ static void find_deltas(struct object_entry **list, unsigned *list_size,
 			idx = 0;
 	}
 
+	add_delta_progress(processed, done);
+
 	for (i = 0; i < window; ++i) {
 		free_delta_index(array[i].index);
 		free(array[i].data);
@@ -3061,8 +3102,8 @@ static void find_deltas(struct object_entry **list, unsigned *list_size,
 }
 
 /*
- * The main object list is split into smaller lists, each is handed to
- * one worker.
+ * The regions of the path-based search are split into smaller lists,
+ * each is handed to one worker.
  *
  * The main thread waits on the condition that (at least) one of the workers
  * has stopped working (which is indicated in the .working member of
@@ -3078,7 +3119,6 @@ static void find_deltas(struct object_entry **list, unsigned *list_size,
 
 struct thread_params {
 	pthread_t thread;
-	struct object_entry **list;
 	struct packing_region *regions;
 	unsigned list_size;
 	unsigned remaining;
@@ -3110,170 +3150,174 @@ static void cleanup_threaded_search(void)
 	pthread_mutex_destroy(&progress_mutex);
 }
 
-static void *threaded_find_deltas(void *arg)
-{
-	struct thread_params *me = arg;
+/*
+ * The sorted object list is split into one segment per worker of a
+ * task pool.  Once a worker is done with its segment, it steals the
+ * second half of the largest segment left and goes on with that,
+ * until the remaining segments are simply too short to be worth
+ * splitting anymore.  Each steal only locks the segments involved, so
+ * that workers do not wait for each other while searching.
+ */
+struct delta_search {
+	struct delta_segment *segments;
+	int nr_segments;
+	int window;
+	int depth;
+	unsigned *processed;
+};
 
-	progress_lock();
-	while (me->remaining) {
-		progress_unlock();
+struct delta_search_task {
+	struct delta_search *search;
+	struct object_entry **list;
+	unsigned size;
+};
 
-		find_deltas(me->list, &me->remaining,
-			    me->window, me->depth, me->processed);
+static int steal_delta_segment(struct delta_search *search,
+			       struct delta_segment *thief)
+{
+	for (;;) {
+		struct delta_segment *victim = NULL;
+		unsigned victim_remaining = 0;
+		struct object_entry **list;
+		unsigned sub_size;
+		int i;
 
-		progress_lock();
-		me->working = 0;
-		pthread_cond_signal(&progress_cond);
-		progress_unlock();
+		for (i = 0; i < search->nr_segments; i++) {
+			struct delta_segment *segment = &search->segments[i];
+			unsigned remaining;
 
-		/*
-		 * We must not set ->data_ready before we wait on the
-		 * condition because the main thread may have set it to 1
-		 * before we get here. In order to be sure that new
-		 * work is available if we see 1 in ->data_ready, it
-		 * was initialized to 0 before this thread was spawned
-		 * and we reset it to 0 right away.
-		 */
-		pthread_mutex_lock(&me->mutex);
-		while (!me->data_ready)
-			pthread_cond_wait(&me->cond, &me->mutex);
-		me->data_ready = 0;
-		pthread_mutex_unlock(&me->mutex);
+			if (segment == thief)
+				continue;
+			pthread_mutex_lock(&segment->mutex);
+			remaining = segment->remaining;
+			pthread_mutex_unlock(&segment->mutex);
+			if (remaining > 2 * search->window &&
+			    remaining > victim_remaining) {
+				victim = segment;
+				victim_remaining = remaining;
+			}
+		}
+		if (!victim)
+			return 0;
 
-		progress_lock();
+		pthread_mutex_lock(&victim->mutex);
+		if (victim->remaining <= 2 * search->window) {
+			/* it went on meanwhile, look again */
+			pthread_mutex_unlock(&victim->mutex);
+			continue;
+		}
+		sub_size = victim->remaining / 2;
+		list = victim->list + victim->remaining - sub_size;
+		while (sub_size && list[0]->hash &&
+		       list[0]->hash == list[-1]->hash) {
+			list++;
+			sub_size--;
+		}
+		if (!sub_size) {
+			/*
+			 * It is possible for some "paths" to have
+			 * so many objects that no hash boundary
+			 * might be found.  Let's just steal the
+			 * exact half in that case.
+			 */
+			sub_size = victim->remaining / 2;
+			list -= sub_size;
+		}
+		victim->remaining -= sub_size;
+		pthread_mutex_unlock(&victim->mutex);
+
+		pthread_mutex_lock(&thief->mutex);
+		thief->list = list;
+		thief->remaining = sub_size;
+		pthread_mutex_unlock(&thief->mutex);
+		return 1;
 	}
-	progress_unlock();
-	/* leave ->working 1 so that this doesn't get more work assigned */
-	return NULL;
+}
+
+static void delta_search_task(void *data, int worker)
+{
+	struct delta_search_task *task = data;
+	struct delta_search *search = task->search;
+	struct delta_segment *segment = &search->segments[worker];
+
+	pthread_mutex_lock(&segment->mutex);
+	segment->list = task->list;
+	segment->remaining = task->size;
+	pthread_mutex_unlock(&segment->mutex);
+
+	do {
+		find_deltas(segment, search->window, search->depth,
+			    search->processed);
+	} while (steal_delta_segment(search, segment));
 }
 
 static void ll_find_deltas(struct object_entry **list, unsigned list_size,
 			   int window, int depth, unsigned *processed)
 {
-	struct thread_params *p;
-	int i, ret, active_threads = 0;
+	struct delta_search search = {
+		.window = window,
+		.depth = depth,
+		.processed = processed,
+	};
+	struct delta_search_task *tasks;
+	struct task_pool *pool;
+	int i;
 
 	init_threaded_search();
 
 	if (delta_search_threads <= 1) {
-		find_deltas(list, &list_size, window, depth, processed);
+		struct delta_segment segment = {
+			.list = list,
+			.remaining = list_size,
+		};
+
+		pthread_mutex_init(&segment.mutex, NULL);
+		find_deltas(&segment, window, depth, processed);
+		pthread_mutex_destroy(&segment.mutex);
 		cleanup_threaded_search();
 		return;
 	}
 	if (progress > pack_to_stdout)
 		fprintf_ln(stderr, _("Delta compression using up to %d threads"),
 			   delta_search_threads);
-	CALLOC_ARRAY(p, delta_search_threads);
+
+	pool = task_pool_new(delta_search_threads);
+	search.nr_segments = task_pool_nr_workers(pool);
+	CALLOC_ARRAY(search.segments, search.nr_segments);
+	for (i = 0; i < search.nr_segments; i++)
+		pthread_mutex_init(&search.segments[i].mutex, NULL);
+	CALLOC_ARRAY(tasks, search.nr_segments);
 
 	/* Partition the work amongst work threads. */
-	for (i = 0; i < delta_search_threads; i++) {
-		unsigned sub_size = list_size / (delta_search_threads - i);
+	for (i = 0; i < search.nr_segments; i++) {
+		unsigned sub_size = list_size / (search.nr_segments - i);
 
 		/* don't use too small segments or no deltas will be found */
-		if (sub_size < 2*window && i+1 < delta_search_threads)
+		if (sub_size < 2*window && i+1 < search.nr_segments)
 			sub_size = 0;
 
-		p[i].window = window;
-		p[i].depth = depth;
-		p[i].processed = processed;
-		p[i].working = 1;
-		p[i].data_ready = 0;
-
 		/* try to split chunks on "path" boundaries */
 		while (sub_size && sub_size < list_size &&
 		       list[sub_size]->hash &&
 		       list[sub_size]->hash == list[sub_size-1]->hash)
 			sub_size++;
 
-		p[i].list = list;
-		p[i].list_size = sub_size;
-		p[i].remaining = sub_size;
+		tasks[i].search = &search;
+		tasks[i].list = list;
+		tasks[i].size = sub_size;
+		if (sub_size)
+			task_pool_add(pool, delta_search_task, &tasks[i]);
 
 		list += sub_size;
 		list_size -= sub_size;
 	}
 
-	/* Start work threads. */
-	for (i = 0; i < delta_search_threads; i++) {
-		if (!p[i].list_size)
-			continue;
-		pthread_mutex_init(&p[i].mutex, NULL);
-		pthread_cond_init(&p[i].cond, NULL);
-		ret = pthread_create(&p[i].thread, NULL,
-				     threaded_find_deltas, &p[i]);
-		if (ret)
-			die(_("unable to create thread: %s"), strerror(ret));
-		active_threads++;
-	}
-
-	/*
-	 * Now let's wait for work completion.  Each time a thread is done
-	 * with its work, we steal half of the remaining work from the
-	 * thread with the largest number of unprocessed objects and give
-	 * it to that newly idle thread.  This ensure good load balancing
-	 * until the remaining object list segments are simply too short
-	 * to be worth splitting anymore.
-	 */
-	while (active_threads) {
-		struct thread_params *target = NULL;
-		struct thread_params *victim = NULL;
-		unsigned sub_size = 0;
-
-		progress_lock();
-		for (;;) {
-			for (i = 0; !target && i < delta_search_threads; i++)
-				if (!p[i].working)
-					target = &p[i];
-			if (target)
-				break;
-			pthread_cond_wait(&progress_cond, &progress_mutex);
-		}
-
-		for (i = 0; i < delta_search_threads; i++)
-			if (p[i].remaining > 2*window &&
-			    (!victim || victim->remaining < p[i].remaining))
-				victim = &p[i];
-		if (victim) {
-			sub_size = victim->remaining / 2;
-			list = victim->list + victim->list_size - sub_size;
-			while (sub_size && list[0]->hash &&
-			       list[0]->hash == list[-1]->hash) {
-				list++;
-				sub_size--;
-			}
-			if (!sub_size) {
-				/*
-				 * It is possible for some "paths" to have
-				 * so many objects that no hash boundary
-				 * might be found.  Let's just steal the
-				 * exact half in that case.
-				 */
-				sub_size = victim->remaining / 2;
-				list -= sub_size;
-			}
-			target->list = list;
-			victim->list_size -= sub_size;
-			victim->remaining -= sub_size;
-		}
-		target->list_size = sub_size;
-		target->remaining = sub_size;
-		target->working = 1;
-		progress_unlock();
-
-		pthread_mutex_lock(&target->mutex);
-		target->data_ready = 1;
-		pthread_cond_signal(&target->cond);
-		pthread_mutex_unlock(&target->mutex);
-
-		if (!sub_size) {
-			pthread_join(target->thread, NULL);
-			pthread_cond_destroy(&target->cond);
-			pthread_mutex_destroy(&target->mutex);
-			active_threads--;
-		}
-	}
+	task_pool_free(pool);
+	for (i = 0; i < search.nr_segments; i++)
+		pthread_mutex_destroy(&search.segments[i].mutex);
+	free(search.segments);
+	free(tasks);
 	cleanup_threaded_search();
-	free(p);
 }
 
 static int obj_is_packed(const struct object_id *oid)
@@ -3358,6 +3402,7 @@ static void find_deltas_for_region(struct object_entry *list,
 {
 	struct object_entry **delta_list;
 	unsigned int delta_list_nr = 0;
+	struct delta_segment segment;
 
 	ALLOC_ARRAY(delta_list, region->nr);
 	for (size_t i = 0; i < region->nr; i++) {
@@ -3367,7 +3412,11 @@ static void find_deltas_for_region(struct object_entry *list,
 	}
 
 	QSORT(delta_list, delta_list_nr, type_size_sort);
-	find_deltas(delta_list, &delta_list_nr, window, depth, processed);
+	segment.list = delta_list;
+	segment.remaining = delta_list_nr;
+	pthread_mutex_init(&segment.mutex, NULL);
+	find_deltas(&segment, window, depth, processed);
+	pthread_mutex_destroy(&segment.mutex);
 	free(delta_list);
 }
 
@@ -3582,6 +3631,8 @@ static void prepare_pack(int window, int depth)
 	if (!to_pack.nr_objects || !window || !depth)
 		return;
 
+	oe_prepare_delta_data(&to_pack);
+
 	if (path_walk)
 		ll_find_deltas_by_region(to_pack.objects, to_pack.regions,
 					 0, to_pack.nr_regions);
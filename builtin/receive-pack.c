@@ -9,6 +9,7 @@
 #include "gettext.h"
 #include "hex.h"
 #include "lockfile.h"
+#include "modgit-permissions.h"
 #include "pack.h"
 #include "refs.h"
 #include "pkt-line.h"
@@ -59,6 +60,7 @@ enum deny_action {
 
 static int deny_deletes;
 static int deny_non_fast_forwards;
+static int modgit_permissions;
 static enum deny_action deny_current_branch = DENY_UNCONFIGURED;
 static enum deny_action deny_delete_current = DENY_UNCONFIGURED;
 static int receive_fsck_objects = -1;
@@ -162,6 +164,11 @@ static int receive_pack_config(const char *var, const char *value,
 		return 0;
 	}
 
+	if (strcmp(var, "receive.modgitpermissions") == 0) {
+		modgit_permissions = git_config_bool(var, value);
+		return 0;
+	}
+
 	if (strcmp(var, "receive.unpacklimit") == 0) {
 		receive_unpack_limit = git_config_int(var, value, ctx->kvi);
 		return 0;
@@ -1988,6 +1995,26 @@ static void execute_commands_atomic(struct command *commands,
 	strbuf_release(&err);
 }
 
+static void reject_modgit_violations(struct command *commands)
+{
+	struct strbuf err = STRBUF_INIT;
+	struct command *cmd;
+
+	for (cmd = commands; cmd; cmd = cmd->next) {
+		if (!should_process_cmd(cmd) || is_null_oid(&cmd->new_oid))
+			continue;
+
+		strbuf_reset(&err);
+		if (!modgit_check_push(the_repository, &cmd->old_oid,
+				       &cmd->new_oid, &err))
+			continue;
+		rp_error("%s: %s", cmd->ref_name, err.buf);
+		cmd->error_string = "module permission denied";
+	}
+
+	strbuf_release(&err);
+}
+
 static void execute_commands(struct command *commands,
 			     const char *unpacker_error,
 			     struct shallow_info *si,
@@ -2032,6 +2059,9 @@ static void execute_commands(struct command *commands,
 
 	reject_updates_to_hidden(commands);
 
+	if (modgit_permissions)
+		reject_modgit_violations(commands);
+
 	/*
 	 * Try to find commands that have special prefix in their reference names,
 	 * and mark them to run an external "proc-receive" hook later.
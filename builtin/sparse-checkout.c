@@ -18,6 +18,7 @@
 #include "unpack-trees.h"
 #include "quote.h"
 #include "setup.h"
+#include "sparse-checkout.h"
 #include "sparse-index.h"
 #include "worktree.h"
 
@@ -28,25 +29,6 @@ static char const * const builtin_sparse_checkout_usage[] = {
 	NULL
 };
 
-static void write_patterns_to_file(FILE *fp, struct pattern_list *pl)
-{
-	int i;
-
-	for (i = 0; i < pl->nr; i++) {
-		struct path_pattern *p = pl->patterns[i];
-
-		if (p->flags & PATTERN_FLAG_NEGATIVE)
-			fprintf(fp, "!");
-
-		fprintf(fp, "%s", p->pattern);
-
-		if (p->flags & PATTERN_FLAG_MUSTBEDIR)
-			fprintf(fp, "/");
-
-		fprintf(fp, "\n");
-	}
-}
-
 static char const * const builtin_sparse_checkout_list_usage[] = {
 	"git sparse-checkout list",
 	NULL
@@ -112,293 +94,6 @@ static int sparse_checkout_list(int argc, const char **argv, const char *prefix,
 	return 0;
 }
 
-static void clean_tracked_sparse_directories(struct repository *r)
-{
-	int i, was_full = 0;
-	struct strbuf path = STRBUF_INIT;
-	size_t pathlen;
-	struct string_list_item *item;
-	struct string_list sparse_dirs = STRING_LIST_INIT_DUP;
-
-	/*
-	 * If we are not using cone mode patterns, then we cannot
-	 * delete directories outside of the sparse cone.
-	 */
-	if (!r || !r->index || !r->worktree)
-		return;
-	if (init_sparse_checkout_patterns(r->index) ||
-	    !r->index->sparse_checkout_patterns->use_cone_patterns)
-		return;
-
-	/*
-	 * Use the sparse index as a data structure to assist finding
-	 * directories that are safe to delete. This conversion to a
-	 * sparse index will not delete directories that contain
-	 * conflicted entries or submodules.
-	 */
-	if (r->index->sparse_index == INDEX_EXPANDED) {
-		/*
-		 * If something, such as a merge conflict or other concern,
-		 * prevents us from converting to a sparse index, then do
-		 * not try deleting files.
-		 */
-		if (convert_to_sparse(r->index, SPARSE_INDEX_MEMORY_ONLY))
-			return;
-		was_full = 1;
-	}
-
-	strbuf_addstr(&path, r->worktree);
-	strbuf_complete(&path, '/');
-	pathlen = path.len;
-
-	/*
-	 * Collect directories that have gone out of scope but also
-	 * exist on disk, so there is some work to be done. We need to
-	 * store the entries in a list before exploring, since that might
-	 * expand the sparse-index again.
-	 */
-	for (i = 0; i < r->index->cache_nr; i++) {
-		struct cache_entry *ce = r->index->cache[i];
-
-		if (S_ISSPARSEDIR(ce->ce_mode) &&
-		    repo_file_exists(r, ce->name))
-			string_list_append(&sparse_dirs, ce->name);
-	}
-
-	for_each_string_list_item(item, &sparse_dirs) {
-		struct dir_struct dir = DIR_INIT;
-		struct pathspec p = { 0 };
-		struct strvec s = STRVEC_INIT;
-
-		strbuf_setlen(&path, pathlen);
-		strbuf_addstr(&path, item->string);
-
-		dir.flags |= DIR_SHOW_IGNORED_TOO;
-
-		setup_standard_excludes(&dir);
-		strvec_push(&s, path.buf);
-
-		parse_pathspec(&p, PATHSPEC_GLOB, 0, NULL, s.v);
-		fill_directory(&dir, r->index, &p);
-
-		if (dir.nr) {
-			warning(_("directory '%s' contains untracked files,"
-				  " but is not in the sparse-checkout cone"),
-				item->string);
-		} else if (remove_dir_recursively(&path, 0)) {
-			/*
-			 * Removal is "best effort". If something blocks
-			 * the deletion, then continue with a warning.
-			 */
-			warning(_("failed to remove directory '%s'"),
-				item->string);
-		}
-
-		strvec_clear(&s);
-		clear_pathspec(&p);
-		dir_clear(&dir);
-	}
-
-	string_list_clear(&sparse_dirs, 0);
-	strbuf_release(&path);
-
-	if (was_full)
-		ensure_full_index(r->index);
-}
-
-static int update_working_directory(struct repository *r,
-				    struct pattern_list *pl)
-{
-	enum update_sparsity_result result;
-	struct unpack_trees_options o;
-	struct lock_file lock_file = LOCK_INIT;
-	struct pattern_list *old_pl;
-
-	/* If no branch has been checked out, there are no updates to make. */
-	if (is_index_unborn(r->index))
-		return UPDATE_SPARSITY_SUCCESS;
-
-	old_pl = r->index->sparse_checkout_patterns;
-	r->index->sparse_checkout_patterns = pl;
-
-	memset(&o, 0, sizeof(o));
-	o.verbose_update = isatty(2);
-	o.update = 1;
-	o.head_idx = -1;
-	o.src_index = r->index;
-	o.dst_index = r->index;
-	o.skip_sparse_checkout = 0;
-
-	setup_work_tree();
-
-	repo_hold_locked_index(r, &lock_file, LOCK_DIE_ON_ERROR);
-
-	setup_unpack_trees_porcelain(&o, "sparse-checkout");
-	result = update_sparsity(&o, pl);
-	clear_unpack_trees_porcelain(&o);
-
-	if (result == UPDATE_SPARSITY_WARNINGS)
-		/*
-		 * We don't do any special handling of warnings from untracked
-		 * files in the way or dirty entries that can't be removed.
-		 */
-		result = UPDATE_SPARSITY_SUCCESS;
-	if (result == UPDATE_SPARSITY_SUCCESS)
-		write_locked_index(r->index, &lock_file, COMMIT_LOCK);
-	else
-		rollback_lock_file(&lock_file);
-
-	clean_tracked_sparse_directories(r);
-
-	if (r->index->sparse_checkout_patterns != pl) {
-		clear_pattern_list(r->index->sparse_checkout_patterns);
-		FREE_AND_NULL(r->index->sparse_checkout_patterns);
-	}
-	r->index->sparse_checkout_patterns = old_pl;
-
-	return result;
-}
-
-static char *escaped_pattern(char *pattern)
-{
-	char *p = pattern;
-	struct strbuf final = STRBUF_INIT;
-
-	while (*p) {
-		if (is_glob_special(*p))
-			strbuf_addch(&final, '\\');
-
-		strbuf_addch(&final, *p);
-		p++;
-	}
-
-	return strbuf_detach(&final, NULL);
-}
-
-static void write_cone_to_file(FILE *fp, struct pattern_list *pl)
-{
-	int i;
-	struct pattern_entry *pe;
-	struct hashmap_iter iter;
-	struct string_list sl = STRING_LIST_INIT_DUP;
-	struct strbuf parent_pattern = STRBUF_INIT;
-
-	hashmap_for_each_entry(&pl->parent_hashmap, &iter, pe, ent) {
-		if (hashmap_get_entry(&pl->recursive_hashmap, pe, ent, NULL))
-			continue;
-
-		if (!hashmap_contains_parent(&pl->recursive_hashmap,
-					     pe->pattern,
-					     &parent_pattern))
-			string_list_append(&sl, pe->pattern);
-	}
-
-	string_list_sort(&sl);
-	string_list_remove_duplicates(&sl, 0);
-
-	fprintf(fp, "/*\n!/*/\n");
-
-	for (i = 0; i < sl.nr; i++) {
-		char *pattern = escaped_pattern(sl.items[i].string);
-
-		if (strlen(pattern))
-			fprintf(fp, "%s/\n!%s/*/\n", pattern, pattern);
-		free(pattern);
-	}
-
-	string_list_clear(&sl, 0);
-
-	hashmap_for_each_entry(&pl->recursive_hashmap, &iter, pe, ent) {
-		if (!hashmap_contains_parent(&pl->recursive_hashmap,
-					     pe->pattern,
-					     &parent_pattern))
-			string_list_append(&sl, pe->pattern);
-	}
-
-	strbuf_release(&parent_pattern);
-
-	string_list_sort(&sl);
-	string_list_remove_duplicates(&sl, 0);
-
-	for (i = 0; i < sl.nr; i++) {
-		char *pattern = escaped_pattern(sl.items[i].string);
-		fprintf(fp, "%s/\n", pattern);
-		free(pattern);
-	}
-
-	string_list_clear(&sl, 0);
-}
-
-static int write_patterns_and_update(struct repository *repo,
-				     struct pattern_list *pl)
-{
-	char *sparse_filename;
-	FILE *fp;
-	struct lock_file lk = LOCK_INIT;
-	int result;
-
-	sparse_filename = get_sparse_checkout_filename();
-
-	if (safe_create_leading_directories(repo, sparse_filename))
-		die(_("failed to create directory for sparse-checkout file"));
-
-	hold_lock_file_for_update(&lk, sparse_filename, LOCK_DIE_ON_ERROR);
-
-	result = update_working_directory(repo, pl);
-	if (result) {
-		rollback_lock_file(&lk);
-		update_working_directory(repo, NULL);
-		goto out;
-	}
-
-	fp = fdopen_lock_file(&lk, "w");
-	if (!fp)
-		die_errno(_("unable to fdopen %s"), get_lock_file_path(&lk));
-
-	if (core_sparse_checkout_cone)
-		write_cone_to_file(fp, pl);
-	else
-		write_patterns_to_file(fp, pl);
-
-	if (commit_lock_file(&lk))
-		die_errno(_("unable to write %s"), sparse_filename);
-
-out:
-	clear_pattern_list(pl);
-	free(sparse_filename);
-	return result;
-}
-
-enum sparse_checkout_mode {
-	MODE_NO_PATTERNS = 0,
-	MODE_ALL_PATTERNS = 1,
-	MODE_CONE_PATTERNS = 2,
-};
-
-static int set_config(struct repository *repo,
-		      enum sparse_checkout_mode mode)
-{
-	/* Update to use worktree config, if not already. */
-	if (init_worktree_config(repo)) {
-		error(_("failed to initialize worktree config"));
-		return 1;
-	}
-
-	if (repo_config_set_worktree_gently(repo,
-					    "core.sparseCheckout",
-					    mode ? "true" : "false") ||
-	    repo_config_set_worktree_gently(repo,
-					    "core.sparseCheckoutCone",
-					    mode == MODE_CONE_PATTERNS ?
-						"true" : "false"))
-		return 1;
-
-	if (mode == MODE_NO_PATTERNS)
-		return set_sparse_index_config(repo, 0);
-
-	return 0;
-}
-
 static enum sparse_checkout_mode update_cone_mode(int *cone_mode) {
 	/* If not specified, use previous definition of cone mode */
 	if (*cone_mode == -1 && core_apply_sparse_checkout)
@@ -422,7 +117,7 @@ static int update_modes(struct repository *repo, int *cone_mode, int *sparse_ind
 	record_mode = (*cone_mode != -1) || !core_apply_sparse_checkout;
 
 	mode = update_cone_mode(cone_mode);
-	if (record_mode && set_config(repo, mode))
+	if (record_mode && set_sparse_checkout_config(repo, mode))
 		return 1;
 
 	/* Set sparse-index/non-sparse-index mode if specified */
@@ -518,59 +213,6 @@ static int sparse_checkout_init(int argc, const char **argv, const char *prefix,
 	return write_patterns_and_update(repo, &pl);
 }
 
-static void insert_recursive_pattern(struct pattern_list *pl, struct strbuf *path)
-{
-	struct pattern_entry *e = xmalloc(sizeof(*e));
-	e->patternlen = path->len;
-	e->pattern = strbuf_detach(path, NULL);
-	hashmap_entry_init(&e->ent, fspathhash(e->pattern));
-
-	hashmap_add(&pl->recursive_hashmap, &e->ent);
-
-	while (e->patternlen) {
-		char *slash = strrchr(e->pattern, '/');
-		char *oldpattern = e->pattern;
-		size_t newlen;
-		struct pattern_entry *dup;
-
-		if (!slash || slash == e->pattern)
-			break;
-
-		newlen = slash - e->pattern;
-		e = xmalloc(sizeof(struct pattern_entry));
-		e->patternlen = newlen;
-		e->pattern = xstrndup(oldpattern, newlen);
-		hashmap_entry_init(&e->ent, fspathhash(e->pattern));
-
-		dup = hashmap_get_entry(&pl->parent_hashmap, e, ent, NULL);
-		if (!dup) {
-			hashmap_add(&pl->parent_hashmap, &e->ent);
-		} else {
-			free(e->pattern);
-			free(e);
-			e = dup;
-		}
-	}
-}
-
-static void strbuf_to_cone_pattern(struct strbuf *line, struct pattern_list *pl)
-{
-	strbuf_trim(line);
-
-	strbuf_trim_trailing_dir_sep(line);
-
-	if (strbuf_normalize_path(line))
-		die(_("could not normalize path %s"), line->buf);
-
-	if (!line->len)
-		return;
-
-	if (line->buf[0] != '/')
-		strbuf_insertstr(line, 0, "/");
-
-	insert_recursive_pattern(pl, line);
-}
-
 static void add_patterns_from_input(struct pattern_list *pl,
 				    int argc, const char **argv,
 				    FILE *file)
@@ -701,7 +343,7 @@ static int modify_pattern_list(struct repository *repo,
 	}
 
 	if (!core_apply_sparse_checkout) {
-		set_config(repo, MODE_ALL_PATTERNS);
+		set_sparse_checkout_config(repo, MODE_ALL_PATTERNS);
 		core_apply_sparse_checkout = 1;
 		changed_config = 1;
 	}
@@ -709,7 +351,7 @@ static int modify_pattern_list(struct repository *repo,
 	result = write_patterns_and_update(repo, pl);
 
 	if (result && changed_config)
-		set_config(repo, MODE_NO_PATTERNS);
+		set_sparse_checkout_config(repo, MODE_NO_PATTERNS);
 
 	clear_pattern_list(pl);
 	free(pl);
@@ -1073,7 +715,7 @@ static int sparse_checkout_disable(int argc, const char **argv,
 		die(_("error while refreshing working directory"));
 
 	clear_pattern_list(&pl);
-	return set_config(repo, MODE_NO_PATTERNS);
+	return set_sparse_checkout_config(repo, MODE_NO_PATTERNS);
 }
 
 static char const * const builtin_sparse_checkout_check_rules_usage[] = {
@@ -0,0 +1,499 @@
+#include "git-compat-util.h"
+#include "dir.h"
+#include "fsmonitor-ll.h"
+#include "fsm-listen.h"
+#include "fsmonitor--daemon.h"
+#include "gettext.h"
+#include "hashmap.h"
+#include "simple-ipc.h"
+#include "string-list.h"
+#include "strbuf.h"
+#include "trace.h"
+#include <poll.h>
+#include <sys/inotify.h>
+
+/*
+ * inotify only watches single directories, so we add a watch for every
+ * directory of the worktree and keep a map from the watch descriptors
+ * to the absolute paths of the directories.  Within the <gitdir> we only
+ * watch the directory itself, to notice when it goes away, and the
+ * directory of the cookie files.
+ */
+struct watch_entry {
+	struct hashmap_entry ent;
+	int wd;
+	unsigned is_cookie_dir : 1;
+	char path[FLEX_ARRAY];
+};
+
+struct fsm_listen_data
+{
+	int fd_inotify;
+
+	/* fsm_listen__stop_async() writes into fd_stop[1]. */
+	int fd_stop[2];
+
+	struct hashmap watches;
+	int nr_watches;
+
+	enum shutdown_style {
+		SHUTDOWN_EVENT = 0,
+		FORCE_SHUTDOWN,
+		FORCE_ERROR_STOP,
+	} shutdown_style;
+};
+
+#define WORKTREE_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+			 IN_DELETE | IN_DELETE_SELF | IN_MODIFY | \
+			 IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF)
+#define GITDIR_EVENTS (IN_DELETE_SELF | IN_MOVE_SELF)
+#define COOKIE_EVENTS (IN_CREATE | IN_MOVED_TO)
+
+static int watch_entry_cmp(const void *cmp_data UNUSED,
+			   const struct hashmap_entry *he1,
+			   const struct hashmap_entry *he2,
+			   const void *keydata UNUSED)
+{
+	const struct watch_entry *a =
+		container_of(he1, const struct watch_entry, ent);
+	const struct watch_entry *b =
+		container_of(he2, const struct watch_entry, ent);
+
+	return a->wd != b->wd;
+}
+
+static struct watch_entry *find_watch(struct fsm_listen_data *data, int wd)
+{
+	struct watch_entry key;
+
+	hashmap_entry_init(&key.ent, memhash(&wd, sizeof(wd)));
+	key.wd = wd;
+	return hashmap_get_entry(&data->watches, &key, ent, NULL);
+}
+
+static void forget_watch(struct fsm_listen_data *data, struct watch_entry *w)
+{
+	hashmap_remove(&data->watches, &w->ent, NULL);
+	data->nr_watches--;
+	free(w);
+}
+
+static int add_watch(struct fsm_listen_data *data, const char *path,
+		     uint32_t mask, int is_cookie_dir)
+{
+	struct watch_entry *w;
+	int wd = inotify_add_watch(data->fd_inotify, path,
+				   mask | IN_ONLYDIR | IN_DONT_FOLLOW |
+				   IN_EXCL_UNLINK);
+
+	if (wd < 0) {
+		/* The directory went away before we got to it. */
+		if (errno == ENOENT || errno == ENOTDIR)
+			return 0;
+		if (errno == ENOSPC)
+			return error(_("inotify watch limit reached while watching '%s';"
+				       " consider raising fs.inotify.max_user_watches"),
+				     path);
+		return error_errno(_("could not watch '%s'"), path);
+	}
+
+	/*
+	 * Watching an inode that is already watched returns the same
+	 * descriptor, e.g. for a directory that was moved back and forth.
+	 */
+	w = find_watch(data, wd);
+	if (w)
+		forget_watch(data, w);
+
+	FLEX_ALLOC_STR(w, path, path);
+	w->wd = wd;
+	w->is_cookie_dir = is_cookie_dir;
+	hashmap_entry_init(&w->ent, memhash(&wd, sizeof(wd)));
+	hashmap_add(&data->watches, &w->ent);
+	data->nr_watches++;
+	return 0;
+}
+
+/*
+ * Watch `path` and every directory below it.  The watch on a directory
+ * is added before its entries are read, so that a subdirectory created
+ * in the meantime is either seen by readdir() or reported by inotify.
+ */
+static int add_watch_recursive(struct fsmonitor_daemon_state *state,
+			       struct strbuf *path)
+{
+	struct fsm_listen_data *data = state->listen_data;
+	struct dirent *de;
+	size_t len = path->len;
+	DIR *dir;
+	int ret = 0;
+
+	if (add_watch(data, path->buf, WORKTREE_EVENTS, 0))
+		return -1;
+
+	dir = opendir(path->buf);
+	if (!dir)
+		return 0;
+
+	while (!ret && (de = readdir_skip_dot_and_dotdot(dir))) {
+		strbuf_setlen(path, len);
+		strbuf_addch(path, '/');
+		strbuf_addstr(path, de->d_name);
+
+		if (get_dtype(de, path, 0) != DT_DIR)
+			continue;
+
+		/* The <gitdir> has its own, non-recursive watches. */
+		if (fsmonitor_classify_path_absolute(state, path->buf) != IS_WORKDIR_PATH)
+			continue;
+
+		ret = add_watch_recursive(state, path);
+	}
+
+	strbuf_setlen(path, len);
+	closedir(dir);
+	return ret;
+}
+
+/*
+ * Stop watching the directories at and below `path`, which was moved
+ * away.  If it was moved within the worktree, the new location is
+ * watched anew when its IN_MOVED_TO event arrives.
+ */
+static void remove_watch_recursive(struct fsm_listen_data *data,
+				   const char *path)
+{
+	struct hashmap_iter iter;
+	struct watch_entry *w, **gone = NULL;
+	size_t gone_nr = 0, gone_alloc = 0;
+	size_t len = strlen(path);
+
+	hashmap_for_each_entry(&data->watches, &iter, w, ent) {
+		if (strncmp(w->path, path, len) ||
+		    (w->path[len] && w->path[len] != '/'))
+			continue;
+		ALLOC_GROW(gone, gone_nr + 1, gone_alloc);
+		gone[gone_nr++] = w;
+	}
+
+	for (size_t i = 0; i < gone_nr; i++) {
+		inotify_rm_watch(data->fd_inotify, gone[i]->wd);
+		forget_watch(data, gone[i]);
+	}
+	free(gone);
+}
+
+static void add_rel_path(struct fsmonitor_daemon_state *state,
+			 struct fsmonitor_batch **batch,
+			 const char *path, int is_dir)
+{
+	const char *rel = path + state->path_worktree_watch.len;
+
+	while (*rel == '/')
+		rel++;
+	if (!*rel)
+		return;
+
+	if (!*batch)
+		*batch = fsmonitor_batch__new();
+
+	if (is_dir) {
+		struct strbuf tmp = STRBUF_INIT;
+
+		strbuf_addf(&tmp, "%s/", rel);
+		fsmonitor_batch__add_path(*batch, tmp.buf);
+		strbuf_release(&tmp);
+	} else {
+		fsmonitor_batch__add_path(*batch, rel);
+	}
+}
+
+/*
+ * Handle one event.  Returns 1 if the daemon has to shut down because
+ * the worktree root or the <gitdir> went away, and -1 if a new directory
+ * could not be watched.
+ */
+static int handle_event(struct fsmonitor_daemon_state *state,
+			const struct inotify_event *ev,
+			struct fsmonitor_batch **batch,
+			struct string_list *cookie_list,
+			struct strbuf *path)
+{
+	struct fsm_listen_data *data = state->listen_data;
+	struct watch_entry *w = find_watch(data, ev->wd);
+	int is_dir = !!(ev->mask & IN_ISDIR);
+
+	/* Events still queued for a directory we stopped watching. */
+	if (!w)
+		return 0;
+
+	if (ev->mask & IN_IGNORED) {
+		forget_watch(data, w);
+		return 0;
+	}
+
+	strbuf_reset(path);
+	strbuf_addstr(path, w->path);
+	if (ev->len) {
+		strbuf_addch(path, '/');
+		strbuf_addstr(path, ev->name);
+	}
+
+	if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+		switch (fsmonitor_classify_path_absolute(state, w->path)) {
+		case IS_DOT_GIT:
+		case IS_GITDIR:
+			trace_printf_key(&trace_fsmonitor,
+					 "event: gitdir removed or renamed");
+			return 1;
+		case IS_INSIDE_DOT_GIT_WITH_COOKIE_PREFIX:
+		case IS_INSIDE_GITDIR_WITH_COOKIE_PREFIX:
+		case IS_INSIDE_DOT_GIT:
+		case IS_INSIDE_GITDIR:
+			/* The <gitdir> event follows, if it is the cause. */
+			return 0;
+		default:
+			break;
+		}
+		if (!strcmp(w->path, state->path_worktree_watch.buf)) {
+			trace_printf_key(&trace_fsmonitor,
+					 "event: worktree root removed or renamed");
+			return 1;
+		}
+		/* The parent directory reports the change itself. */
+		return 0;
+	}
+
+	switch (fsmonitor_classify_path_absolute(state, path->buf)) {
+	case IS_INSIDE_DOT_GIT_WITH_COOKIE_PREFIX:
+	case IS_INSIDE_GITDIR_WITH_COOKIE_PREFIX:
+		if (w->is_cookie_dir && (ev->mask & COOKIE_EVENTS))
+			string_list_append(cookie_list, ev->name);
+		break;
+
+	case IS_INSIDE_DOT_GIT:
+	case IS_INSIDE_GITDIR:
+		/* ignore all other paths inside of .git or gitdir */
+		break;
+
+	case IS_DOT_GIT:
+	case IS_GITDIR:
+		/* If .git directory is deleted or renamed away, quit. */
+		if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			trace_printf_key(&trace_fsmonitor,
+					 "event: gitdir removed or renamed");
+			return 1;
+		}
+		break;
+
+	case IS_WORKDIR_PATH:
+		add_rel_path(state, batch, path->buf, is_dir);
+		if (!is_dir)
+			break;
+		if (ev->mask & IN_MOVED_FROM)
+			remove_watch_recursive(data, path->buf);
+		/*
+		 * A new directory may already have entries, created before
+		 * our watch was added: "dir/" makes the clients look at all
+		 * of them anyway.
+		 */
+		if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+		    add_watch_recursive(state, path))
+			return -1;
+		break;
+
+	case IS_OUTSIDE_CONE:
+	default:
+		trace_printf_key(&trace_fsmonitor,
+				 "ignoring '%s'", path->buf);
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Read the queued events and publish them as one batch.  Returns like
+ * handle_event(), or -1 if the events could not be read.
+ */
+static int read_events(struct fsmonitor_daemon_state *state)
+{
+	struct fsm_listen_data *data = state->listen_data;
+	union {
+		struct inotify_event ev;
+		char buf[64 * 1024];
+	} u;
+	struct fsmonitor_batch *batch = NULL;
+	struct string_list cookie_list = STRING_LIST_INIT_DUP;
+	struct strbuf path = STRBUF_INIT;
+	ssize_t len;
+	int ret = 0;
+
+	len = read(data->fd_inotify, u.buf, sizeof(u.buf));
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		return error_errno(_("could not read inotify events"));
+	}
+
+	for (char *p = u.buf; p < u.buf + len; ) {
+		const struct inotify_event *ev = (const struct inotify_event *)p;
+
+		p += sizeof(*ev) + ev->len;
+
+		/*
+		 * The kernel dropped events: flush the cached data, which
+		 * also wakes the clients waiting for a cookie, and discard
+		 * the batch built so far, which is relative to the flushed
+		 * token.
+		 */
+		if (ev->mask & IN_Q_OVERFLOW) {
+			trace_printf_key(&trace_fsmonitor, "event: queue overflow");
+			fsmonitor_force_resync(state);
+			fsmonitor_batch__free_list(batch);
+			string_list_clear(&cookie_list, 0);
+			batch = NULL;
+			continue;
+		}
+
+		ret = handle_event(state, ev, &batch, &cookie_list, &path);
+		if (ret)
+			break;
+	}
+
+	if (!ret)
+		fsmonitor_publish(state, batch, &cookie_list);
+	else
+		fsmonitor_batch__free_list(batch);
+	string_list_clear(&cookie_list, 0);
+	strbuf_release(&path);
+	return ret;
+}
+
+int fsm_listen__ctor(struct fsmonitor_daemon_state *state)
+{
+	struct fsm_listen_data *data;
+	struct strbuf path = STRBUF_INIT;
+
+	CALLOC_ARRAY(data, 1);
+	state->listen_data = data;
+	hashmap_init(&data->watches, watch_entry_cmp, NULL, 0);
+	data->fd_stop[0] = data->fd_stop[1] = -1;
+
+	data->fd_inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (data->fd_inotify < 0) {
+		error_errno(_("could not initialize inotify"));
+		goto failed;
+	}
+	if (pipe(data->fd_stop) < 0) {
+		error_errno(_("could not create pipe"));
+		goto failed;
+	}
+
+	strbuf_addbuf(&path, &state->path_worktree_watch);
+	if (add_watch_recursive(state, &path))
+		goto failed;
+
+	if (add_watch(data, state->path_gitdir_watch.buf, GITDIR_EVENTS, 0))
+		goto failed;
+	strbuf_reset(&path);
+	strbuf_addbuf(&path, &state->path_cookie_prefix);
+	strbuf_strip_suffix(&path, "/");
+	if (add_watch(data, path.buf, COOKIE_EVENTS, 1))
+		goto failed;
+
+	trace_printf_key(&trace_fsmonitor, "watching %d directories",
+			 data->nr_watches);
+	strbuf_release(&path);
+	return 0;
+
+failed:
+	error(_("Unable to watch '%s'."), state->path_worktree_watch.buf);
+	strbuf_release(&path);
+	fsm_listen__dtor(state);
+	return -1;
+}
+
+void fsm_listen__dtor(struct fsmonitor_daemon_state *state)
+{
+	struct fsm_listen_data *data;
+
+	if (!state || !state->listen_data)
+		return;
+
+	data = state->listen_data;
+
+	if (data->fd_inotify >= 0)
+		close(data->fd_inotify);
+	if (data->fd_stop[0] >= 0)
+		close(data->fd_stop[0]);
+	if (data->fd_stop[1] >= 0)
+		close(data->fd_stop[1]);
+	hashmap_clear_and_free(&data->watches, struct watch_entry, ent);
+
+	FREE_AND_NULL(state->listen_data);
+}
+
+void fsm_listen__stop_async(struct fsmonitor_daemon_state *state)
+{
+	struct fsm_listen_data *data = state->listen_data;
+
+	data->shutdown_style = SHUTDOWN_EVENT;
+	if (write(data->fd_stop[1], "", 1) < 0)
+		error_errno(_("could not stop the fsmonitor listener"));
+}
+
+void fsm_listen__loop(struct fsmonitor_daemon_state *state)
+{
+	struct fsm_listen_data *data = state->listen_data;
+	struct pollfd pfd[2];
+
+	/*
+	 * Our fs event listener is now running, so it's safe to start
+	 * serving client requests.
+	 */
+	ipc_server_start_async(state->ipc_server_data);
+
+	pfd[0].fd = data->fd_stop[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = data->fd_inotify;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			error_errno(_("could not poll for inotify events"));
+			data->shutdown_style = FORCE_ERROR_STOP;
+			break;
+		}
+
+		if (pfd[0].revents)
+			break;
+
+		if (pfd[1].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			data->shutdown_style = FORCE_ERROR_STOP;
+			break;
+		}
+		if (pfd[1].revents & POLLIN) {
+			int ret = read_events(state);
+
+			if (ret) {
+				data->shutdown_style = ret < 0 ?
+					FORCE_ERROR_STOP : FORCE_SHUTDOWN;
+				break;
+			}
+		}
+	}
+
+	switch (data->shutdown_style) {
+	case FORCE_ERROR_STOP:
+		state->listen_error_code = -1;
+		/* fall thru */
+	case FORCE_SHUTDOWN:
+		ipc_server_stop_async(state->ipc_server_data);
+		/* fall thru */
+	case SHUTDOWN_EVENT:
+	default:
+		break;
+	}
+}
@@ -0,0 +1,91 @@
+#include "git-compat-util.h"
+#include "fsmonitor-ll.h"
+#include "fsmonitor-path-utils.h"
+#include "gettext.h"
+#include "trace.h"
+#include <sys/vfs.h>
+
+/*
+ * statfs() on Linux only reports the magic number of the filesystem
+ * type, see statfs(2) and <linux/magic.h>.  Name the ones we care about:
+ * the network filesystems, on which inotify does not see the changes
+ * made by other clients, and the Windows formats that cannot hold the
+ * Unix domain socket of the daemon.
+ */
+static const struct fs_type {
+	unsigned long magic;
+	const char *name;
+	int is_remote;
+} fs_types[] = {
+	{ 0x6969, "nfs", 1 },
+	{ 0x517b, "smbfs", 1 },
+	{ 0xff534d42, "cifs", 1 },
+	{ 0xfe534d42, "smb2", 1 },
+	{ 0x73757245, "coda", 1 },
+	{ 0x5346414f, "afs", 1 },
+	{ 0x6b414653, "afs", 1 },
+	{ 0x01021997, "9p", 1 },
+	{ 0x00c36400, "ceph", 1 },
+	{ 0x65735546, "fuse", 1 },
+	{ 0x564c, "ncpfs", 1 },
+	{ 0x4d44, "msdos", 0 },
+	{ 0x5346544e, "ntfs", 0 },
+	{ 0x2011bab0, "exfat", 0 },
+};
+
+int fsmonitor__get_fs_info(const char *path, struct fs_info *fs_info)
+{
+	struct statfs fs;
+	const char *name = "unknown";
+
+	if (statfs(path, &fs) == -1) {
+		int saved_errno = errno;
+		trace_printf_key(&trace_fsmonitor, "statfs('%s') failed: %s",
+				 path, strerror(saved_errno));
+		errno = saved_errno;
+		return -1;
+	}
+
+	fs_info->is_remote = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(fs_types); i++) {
+		if ((unsigned long)fs.f_type == fs_types[i].magic) {
+			name = fs_types[i].name;
+			fs_info->is_remote = fs_types[i].is_remote;
+			break;
+		}
+	}
+	fs_info->typename = xstrdup(name);
+
+	trace_printf_key(&trace_fsmonitor,
+			 "statfs('%s') [type 0x%08lx] '%s' is_remote: %d",
+			 path, (unsigned long)fs.f_type, fs_info->typename,
+			 fs_info->is_remote);
+	return 0;
+}
+
+int fsmonitor__is_fs_remote(const char *path)
+{
+	struct fs_info fs;
+	if (fsmonitor__get_fs_info(path, &fs))
+		return -1;
+
+	free(fs.typename);
+
+	return fs.is_remote;
+}
+
+/*
+ * Linux has no equivalent of the synthetic firmlinks of macOS: the
+ * paths reported by inotify are the ones we asked to watch.
+ */
+int fsmonitor__get_alias(const char *path UNUSED,
+			 struct alias_info *info UNUSED)
+{
+	return 0;
+}
+
+char *fsmonitor__resolve_alias(const char *path UNUSED,
+			       const struct alias_info *info UNUSED)
+{
+	return NULL;
+}
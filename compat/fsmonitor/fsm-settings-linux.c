@@ -0,0 +1,48 @@
+#include "git-compat-util.h"
+#include "config.h"
+#include "fsmonitor-ll.h"
+#include "fsmonitor-ipc.h"
+#include "fsmonitor-settings.h"
+#include "fsmonitor-path-utils.h"
+
+/*
+ * The builtin FSMonitor uses a Unix domain socket for IPC, created in
+ * the .git directory unless that is on a remote file system (see
+ * fsm-ipc-unix.c).  Like on macOS, a socket cannot be created on a
+ * FAT32 or NTFS volume, e.g. one mounted from a Windows partition, so
+ * mark those as incompatible for the daemon.
+ *
+ * Remote working directories are rejected by the common code unless
+ * 'fsmonitor.allowRemote' is true: inotify only reports the changes
+ * made through the local kernel.
+ */
+static enum fsmonitor_reason check_uds_volume(struct repository *r)
+{
+	struct fs_info fs;
+	const char *ipc_path = fsmonitor_ipc__get_path(r);
+	char *dir = xstrdup(ipc_path);
+	enum fsmonitor_reason reason = FSMONITOR_REASON_OK;
+
+	if (fsmonitor__get_fs_info(dirname(dir), &fs) == -1) {
+		free(dir);
+		return FSMONITOR_REASON_ERROR;
+	}
+	free(dir);
+
+	if (fs.is_remote ||
+	    !strcmp(fs.typename, "msdos") ||
+	    !strcmp(fs.typename, "ntfs") ||
+	    !strcmp(fs.typename, "exfat"))
+		reason = FSMONITOR_REASON_NOSOCKETS;
+
+	free(fs.typename);
+	return reason;
+}
+
+enum fsmonitor_reason fsm_os__incompatible(struct repository *r, int ipc)
+{
+	if (ipc)
+		return check_uds_volume(r);
+
+	return FSMONITOR_REASON_OK;
+}
@@ -2010,7 +2010,7 @@ _git_fetch ()
 		return
 		;;
 	--filter=*)
-		__gitcomp "blob:none blob:limit= sparse:oid=" "" "${cur##--filter=}"
+		__gitcomp "blob:none blob:limit= sparse:oid= module:" "" "${cur##--filter=}"
 		return
 		;;
 	--*)
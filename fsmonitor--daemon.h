@@ -8,6 +8,7 @@
 #include "fsmonitor-path-utils.h"
 
 struct fsmonitor_batch;
+struct fsmonitor_ring;
 struct fsmonitor_token_data;
 
 /*
@@ -59,6 +60,8 @@ struct fsmonitor_daemon_state {
 	struct ipc_server_data *ipc_server_data;
 	struct strbuf path_ipc;
 
+	struct fsmonitor_ring *ring;
+
 };
 
 /*
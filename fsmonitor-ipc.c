@@ -4,6 +4,7 @@
 #include "gettext.h"
 #include "simple-ipc.h"
 #include "fsmonitor-ipc.h"
+#include "fsmonitor-ring.h"
 #include "repository.h"
 #include "run-command.h"
 #include "strbuf.h"
@@ -37,6 +38,12 @@ int fsmonitor_ipc__send_query(const char *since_token UNUSED,
 	return -1;
 }
 
+int fsmonitor_ipc__send_ring_query(const char *since_token UNUSED,
+				   struct strbuf *answer UNUSED)
+{
+	return -1;
+}
+
 int fsmonitor_ipc__send_command(const char *command UNUSED,
 				struct strbuf *answer UNUSED)
 {
@@ -67,8 +74,7 @@ static int spawn_daemon(void)
 	return run_command(&cmd);
 }
 
-int fsmonitor_ipc__send_query(const char *since_token,
-			      struct strbuf *answer)
+static int send_query(const char *tok, struct strbuf *answer)
 {
 	int ret = -1;
 	int tried_to_spawn = 0;
@@ -76,8 +82,7 @@ int fsmonitor_ipc__send_query(const char *since_token,
 	struct ipc_client_connection *connection = NULL;
 	struct ipc_client_connect_options options
 		= IPC_CLIENT_CONNECT_OPTIONS_INIT;
-	const char *tok = since_token ? since_token : "";
-	size_t tok_len = since_token ? strlen(since_token) : 0;
+	size_t tok_len = strlen(tok);
 
 	options.wait_if_busy = 1;
 	options.wait_if_not_found = 0;
@@ -138,6 +143,25 @@ int fsmonitor_ipc__send_query(const char *since_token,
 	return ret;
 }
 
+int fsmonitor_ipc__send_query(const char *since_token,
+			      struct strbuf *answer)
+{
+	return send_query(since_token ? since_token : "", answer);
+}
+
+int fsmonitor_ipc__send_ring_query(const char *since_token,
+				   struct strbuf *answer)
+{
+	struct strbuf command = STRBUF_INIT;
+	int ret;
+
+	strbuf_addf(&command, "%s%s", FSMONITOR_RING_REQUEST,
+		    since_token ? since_token : "");
+	ret = send_query(command.buf, answer);
+	strbuf_release(&command);
+	return ret;
+}
+
 int fsmonitor_ipc__send_command(const char *command,
 				struct strbuf *answer)
 {
@@ -37,6 +37,14 @@ enum ipc_active_state fsmonitor_ipc__get_state(void);
 int fsmonitor_ipc__send_query(const char *since_token,
 			      struct strbuf *answer);
 
+/*
+ * Like fsmonitor_ipc__send_query(), but ask the daemon to refer to its
+ * shared memory instead of sending the changed paths, if it can.  See
+ * fsmonitor-ring.h.
+ */
+int fsmonitor_ipc__send_ring_query(const char *since_token,
+				   struct strbuf *answer);
+
 /*
  * Connect to a `git-fsmonitor--daemon` process via simple-ipc and
  * send a command verb.  If no daemon is available, we DO NOT try to
@@ -0,0 +1,315 @@
+#include "git-compat-util.h"
+#include "fsmonitor-ring.h"
+#include "gettext.h"
+#include "path.h"
+#include "repository.h"
+#include "strbuf.h"
+
+int fsmonitor_ring_is_response(const char *response)
+{
+	return starts_with(response, "/ring ");
+}
+
+/*
+ * The daemon and its clients access the ring concurrently, without a
+ * lock, so it needs a real shared mapping (not the emulation used with
+ * NO_MMAP) and memory barriers.
+ */
+#if defined(HAVE_FSMONITOR_DAEMON_BACKEND) && !defined(GIT_WINDOWS_NATIVE) && \
+	!defined(NO_MMAP) && defined(__GNUC__)
+
+#define RING_SIGNATURE "FSMR"
+#define RING_VERSION 1
+#define RING_ALIGN 4
+#define RING_MIN_SIZE 1024
+
+struct ring_header {
+	char signature[4];
+	uint32_t version;
+	uint64_t instance;
+	uint64_t size;
+	uint64_t write_pos;
+};
+
+/*
+ * The daemon advances the write position before it writes a record,
+ * and a client checks the write position after it has read records,
+ * so that it notices when they were overwritten meanwhile.  The
+ * barriers keep the processor from reordering these accesses.
+ */
+#define ring_barrier() __sync_synchronize()
+
+static uint64_t ring_write_pos(const struct ring_header *header)
+{
+	return *(const volatile uint64_t *)&header->write_pos;
+}
+
+static int ring_intact(const struct ring_header *header, uint64_t pos)
+{
+	return ring_write_pos(header) - pos <= header->size;
+}
+
+/*
+ * The buffer is followed by zeroes that are never written, so that a
+ * path read while it is being overwritten is still terminated.
+ */
+static size_t ring_mapped_len(uint64_t size)
+{
+	return sizeof(struct ring_header) + size + RING_ALIGN;
+}
+
+static uint64_t ring_record_len(uint64_t path_len)
+{
+	return (sizeof(uint32_t) + path_len + 1 + RING_ALIGN - 1) &
+		~(uint64_t)(RING_ALIGN - 1);
+}
+
+struct fsmonitor_ring {
+	char *path;
+	struct ring_header *header;
+	char *buf;
+	size_t mapped_len;
+	uint64_t size;
+	uint64_t pos;
+};
+
+struct fsmonitor_ring *fsmonitor_ring_create(const char *path, size_t size)
+{
+	struct fsmonitor_ring *ring;
+	struct ring_header *header;
+	size_t len;
+	void *map;
+	int fd;
+
+	size &= ~(size_t)(RING_ALIGN - 1);
+	if (size < RING_MIN_SIZE)
+		size = RING_MIN_SIZE;
+	len = ring_mapped_len(size);
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		error_errno(_("could not create '%s'"), path);
+		return NULL;
+	}
+	if (ftruncate(fd, len) < 0) {
+		error_errno(_("could not resize '%s'"), path);
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	map = xmmap_gently(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		error_errno(_("could not map '%s'"), path);
+		unlink(path);
+		return NULL;
+	}
+
+	header = map;
+	header->version = RING_VERSION;
+	header->instance = ((uint64_t)getpid() << 32) | git_rand(CSPRNG_BYTES_INSECURE);
+	header->size = size;
+	header->write_pos = 0;
+	ring_barrier();
+	memcpy(header->signature, RING_SIGNATURE, sizeof(header->signature));
+
+	CALLOC_ARRAY(ring, 1);
+	ring->path = xstrdup(path);
+	ring->header = header;
+	ring->buf = (char *)map + sizeof(*header);
+	ring->mapped_len = len;
+	ring->size = size;
+	return ring;
+}
+
+void fsmonitor_ring_free(struct fsmonitor_ring *ring)
+{
+	if (!ring)
+		return;
+	munmap(ring->header, ring->mapped_len);
+	unlink(ring->path);
+	free(ring->path);
+	free(ring);
+}
+
+static void ring_reserve(struct fsmonitor_ring *ring, uint64_t len)
+{
+	ring->pos += len;
+	*(volatile uint64_t *)&ring->header->write_pos = ring->pos;
+	ring_barrier();
+}
+
+void fsmonitor_ring_append(struct fsmonitor_ring *ring, const char *path)
+{
+	size_t len = strlen(path);
+	uint64_t rec = ring_record_len(len);
+	uint64_t off = ring->pos % ring->size;
+	uint32_t len32 = len;
+
+	/* A zero length marks the wrap-around. */
+	if (!len)
+		return;
+
+	if (rec > ring->size) {
+		/*
+		 * The record never fits: skip more than the whole buffer,
+		 * so that every range containing it counts as overwritten.
+		 */
+		ring_reserve(ring, ring->size + RING_ALIGN);
+		return;
+	}
+
+	if (rec > ring->size - off) {
+		uint32_t wrap = 0;
+
+		ring_reserve(ring, ring->size - off);
+		memcpy(ring->buf + off, &wrap, sizeof(wrap));
+		off = 0;
+	}
+
+	ring_reserve(ring, rec);
+	memcpy(ring->buf + off, &len32, sizeof(len32));
+	memcpy(ring->buf + off + sizeof(len32), path, len + 1);
+}
+
+uint64_t fsmonitor_ring_pos(const struct fsmonitor_ring *ring)
+{
+	return ring->pos;
+}
+
+int fsmonitor_ring_format_response(const struct fsmonitor_ring *ring,
+				   uint64_t begin, uint64_t end,
+				   struct strbuf *response)
+{
+	if (!ring_intact(ring->header, begin))
+		return -1;
+	strbuf_addf(response, "/ring %"PRIu64" %"PRIu64" %"PRIu64,
+		    ring->header->instance, begin, end);
+	return 0;
+}
+
+static int parse_ring_response(const char *response, uint64_t *instance,
+			       uint64_t *begin, uint64_t *end)
+{
+	const char *p;
+	char *p_end;
+
+	if (!skip_prefix(response, "/ring ", &p))
+		return -1;
+	*instance = strtoumax(p, &p_end, 10);
+	if (*p_end != ' ')
+		return -1;
+	*begin = strtoumax(p_end + 1, &p_end, 10);
+	if (*p_end != ' ')
+		return -1;
+	*end = strtoumax(p_end + 1, &p_end, 10);
+	if (*p_end || *end < *begin)
+		return -1;
+	return 0;
+}
+
+int fsmonitor_ring_read(struct repository *r, const char *response,
+			fsmonitor_ring_fn *fn, void *data)
+{
+	uint64_t instance, begin, end, pos;
+	const struct ring_header *header;
+	const char *buf;
+	char *path;
+	struct stat st;
+	size_t len;
+	void *map;
+	int fd, ret = -1;
+
+	if (parse_ring_response(response, &instance, &begin, &end))
+		return -1;
+
+	path = repo_git_path(r, FSMONITOR_RING_PATH);
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 ||
+	    (len = xsize_t(st.st_size)) < sizeof(*header)) {
+		close(fd);
+		return -1;
+	}
+	map = xmmap_gently(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	header = map;
+	buf = (const char *)map + sizeof(*header);
+	if (memcmp(header->signature, RING_SIGNATURE, sizeof(header->signature)) ||
+	    header->version != RING_VERSION ||
+	    header->instance != instance ||
+	    header->size % RING_ALIGN ||
+	    ring_mapped_len(header->size) != len ||
+	    !ring_intact(header, begin))
+		goto done;
+
+	for (pos = begin; pos < end; ) {
+		uint64_t off = pos % header->size;
+		uint64_t rec;
+		uint32_t len32;
+
+		memcpy(&len32, buf + off, sizeof(len32));
+		if (!len32) {
+			pos += header->size - off;
+			continue;
+		}
+
+		rec = ring_record_len(len32);
+		if (rec > header->size - off ||
+		    buf[off + sizeof(len32) + len32])
+			goto done;
+		fn(buf + off + sizeof(len32), data);
+		pos += rec;
+	}
+
+	ring_barrier();
+	if (pos == end && ring_intact(header, begin))
+		ret = 0;
+
+done:
+	munmap(map, len);
+	return ret;
+}
+
+#else
+
+struct fsmonitor_ring *fsmonitor_ring_create(const char *path UNUSED,
+					     size_t size UNUSED)
+{
+	return NULL;
+}
+
+void fsmonitor_ring_free(struct fsmonitor_ring *ring UNUSED)
+{
+}
+
+void fsmonitor_ring_append(struct fsmonitor_ring *ring UNUSED,
+			   const char *path UNUSED)
+{
+}
+
+uint64_t fsmonitor_ring_pos(const struct fsmonitor_ring *ring UNUSED)
+{
+	return 0;
+}
+
+int fsmonitor_ring_format_response(const struct fsmonitor_ring *ring UNUSED,
+				   uint64_t begin UNUSED, uint64_t end UNUSED,
+				   struct strbuf *response UNUSED)
+{
+	return -1;
+}
+
+int fsmonitor_ring_read(struct repository *r UNUSED,
+			const char *response UNUSED,
+			fsmonitor_ring_fn *fn UNUSED, void *data UNUSED)
+{
+	return -1;
+}
+
+#endif
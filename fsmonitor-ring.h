@@ -0,0 +1,88 @@
+#ifndef FSMONITOR_RING_H
+#define FSMONITOR_RING_H
+
+struct repository;
+struct strbuf;
+
+/*
+ * With "fsmonitor.sharedMemory", the builtin fsmonitor daemon also
+ * publishes the changed paths in a ring buffer in the file
+ * "<gitdir>/fsmonitor--daemon/changes", which it maps into memory, and
+ * clients read the paths in place instead of receiving them over the
+ * IPC channel.
+ *
+ * The file starts with a 32-byte header holding the signature "FSMR",
+ * a version, an id for the daemon instance, the size of the buffer and
+ * the write position.  The buffer follows and holds a stream of
+ * records: a 32-bit length and the NUL-terminated path, padded to a
+ * multiple of four bytes.  A zero length means that the record did not
+ * fit before the end of the buffer and continues at its start.
+ *
+ * Positions are offsets into the stream of all records ever written,
+ * so a record at `pos` is at `pos % size` in the buffer and has been
+ * overwritten once the write position is more than `size` past it.
+ *
+ * A client asks for the shared memory by prefixing the token in its
+ * query with "ring ".  If the records of the batches it asks for are
+ * still in the buffer, the daemon answers with the new token followed
+ * by "/ring <instance> <begin> <end>" instead of the paths; otherwise
+ * it sends the paths as usual.  If the buffer has wrapped by the time
+ * the client has read the records, the client repeats the query
+ * without the prefix.
+ */
+
+#define FSMONITOR_RING_PATH "fsmonitor--daemon/changes"
+#define FSMONITOR_RING_REQUEST "ring "
+
+/*
+ * The daemon side.  The ring is not synchronized, so the daemon must
+ * serialize the calls, e.g. using its main lock.
+ */
+struct fsmonitor_ring;
+
+/*
+ * Create the file at `path` with a buffer of `size` bytes, rounded down
+ * to a multiple of four, and map it.  Returns NULL if that fails or if
+ * shared memory is not supported on this platform.
+ */
+struct fsmonitor_ring *fsmonitor_ring_create(const char *path, size_t size);
+
+/* Unmap and remove the file. */
+void fsmonitor_ring_free(struct fsmonitor_ring *ring);
+
+/* Append the record for `path`. */
+void fsmonitor_ring_append(struct fsmonitor_ring *ring, const char *path);
+
+/* The position at which the next record will be written. */
+uint64_t fsmonitor_ring_pos(const struct fsmonitor_ring *ring);
+
+/*
+ * Append the answer to a query for the records from `begin` to `end`
+ * to `response`.  Returns -1 without doing so if the records starting
+ * at `begin` have been overwritten.
+ */
+int fsmonitor_ring_format_response(const struct fsmonitor_ring *ring,
+				   uint64_t begin, uint64_t end,
+				   struct strbuf *response);
+
+/*
+ * The client side.
+ */
+
+/* Does the answer of the daemon, after the token, refer to the ring? */
+int fsmonitor_ring_is_response(const char *response);
+
+typedef void fsmonitor_ring_fn(const char *path, void *data);
+
+/*
+ * Map the ring of the daemon for the worktree of `r` and call `fn` for
+ * every path in the records named in `response`.  The paths point into
+ * the shared memory and are only valid during the call.
+ *
+ * Returns -1 if the ring cannot be read or the records have been
+ * overwritten, possibly after some of the paths were passed to `fn`.
+ */
+int fsmonitor_ring_read(struct repository *r, const char *response,
+			fsmonitor_ring_fn *fn, void *data);
+
+#endif /* FSMONITOR_RING_H */
@@ -8,6 +8,7 @@
 #include "ewah/ewok.h"
 #include "fsmonitor.h"
 #include "fsmonitor-ipc.h"
+#include "fsmonitor-ring.h"
 #include "name-hash.h"
 #include "repository.h"
 #include "run-command.h"
@@ -432,7 +433,8 @@ static size_t handle_path_with_trailing_slash(
 	return nr_in_cone;
 }
 
-static void fsmonitor_refresh_callback(struct index_state *istate, char *name)
+static void fsmonitor_refresh_callback(struct index_state *istate,
+				       const char *name)
 {
 	int len = strlen(name);
 	int pos = index_name_pos(istate, name, len);
@@ -503,6 +505,19 @@ static void fsmonitor_refresh_callback(struct index_state *istate, char *name)
  */
 static int fsmonitor_force_update_threshold = 100;
 
+struct ring_refresh_data {
+	struct index_state *istate;
+	int count;
+};
+
+static void ring_refresh_callback(const char *name, void *data)
+{
+	struct ring_refresh_data *d = data;
+
+	fsmonitor_refresh_callback(d->istate, name);
+	d->count++;
+}
+
 void refresh_fsmonitor(struct index_state *istate)
 {
 	static int warn_once = 0;
@@ -514,6 +529,7 @@ void refresh_fsmonitor(struct index_state *istate)
 	char *buf;
 	unsigned int i;
 	int is_trivial = 0;
+	int ring_count = -1;
 	struct repository *r = istate->repo;
 	enum fsmonitor_mode fsm_mode = fsm_settings__get_mode(r);
 	enum fsmonitor_reason reason = fsm_settings__get_reason(r);
@@ -534,10 +550,18 @@ void refresh_fsmonitor(struct index_state *istate)
 	trace_printf_key(&trace_fsmonitor, "refresh fsmonitor");
 
 	if (fsm_mode == FSMONITOR_MODE_IPC) {
-		query_success = !fsmonitor_ipc__send_query(
-			istate->fsmonitor_last_update ?
-			istate->fsmonitor_last_update : "builtin:fake",
-			&query_result);
+		const char *since_token = istate->fsmonitor_last_update ?
+			istate->fsmonitor_last_update : "builtin:fake";
+		int use_ring = 0;
+
+		repo_config_get_bool(r, "fsmonitor.sharedmemory", &use_ring);
+query_daemon:
+		if (use_ring)
+			query_success = !fsmonitor_ipc__send_ring_query(
+				since_token, &query_result);
+		else
+			query_success = !fsmonitor_ipc__send_query(
+				since_token, &query_result);
 		if (query_success) {
 			/*
 			 * The response contains a series of nul terminated
@@ -551,7 +575,37 @@ void refresh_fsmonitor(struct index_state *istate)
 			buf = query_result.buf;
 			strbuf_addstr(&last_update_token, buf);
 			bol = last_update_token.len + 1;
-			is_trivial = query_result.buf[bol] == '/';
+
+			/*
+			 * Instead of the paths, the daemon may tell us
+			 * where to find them in its shared memory.  If
+			 * they have been overwritten before we are done,
+			 * ask again for the paths themselves; marking
+			 * some paths as dirty twice does no harm.
+			 */
+			if (use_ring && fsmonitor_ring_is_response(buf + bol)) {
+				struct ring_refresh_data data = {
+					.istate = istate,
+				};
+
+				trace2_region_enter("fsmonitor", "apply_ring", r);
+				if (!fsmonitor_ring_read(r, buf + bol,
+							 ring_refresh_callback,
+							 &data))
+					ring_count = data.count;
+				trace2_region_leave("fsmonitor", "apply_ring", r);
+
+				if (ring_count < 0) {
+					trace2_data_intmax("fsm_client", NULL,
+							   "query/ring-overwritten", 1);
+					strbuf_reset(&query_result);
+					strbuf_reset(&last_update_token);
+					use_ring = 0;
+					goto query_daemon;
+				}
+			} else {
+				is_trivial = query_result.buf[bol] == '/';
+			}
 			if (is_trivial)
 				trace2_data_intmax("fsm_client", NULL,
 						   "query/trivial-response", 1);
@@ -666,16 +720,21 @@ void refresh_fsmonitor(struct index_state *istate)
 		int count = 0;
 
 		buf = query_result.buf;
-		for (i = bol; i < query_result.len; i++) {
-			if (buf[i] != '\0')
-				continue;
-			fsmonitor_refresh_callback(istate, buf + bol);
-			bol = i + 1;
-			count++;
-		}
-		if (bol < query_result.len) {
-			fsmonitor_refresh_callback(istate, buf + bol);
-			count++;
+		if (ring_count >= 0) {
+			/* The paths were read from the shared memory. */
+			count = ring_count;
+		} else {
+			for (i = bol; i < query_result.len; i++) {
+				if (buf[i] != '\0')
+					continue;
+				fsmonitor_refresh_callback(istate, buf + bol);
+				bol = i + 1;
+				count++;
+			}
+			if (bol < query_result.len) {
+				fsmonitor_refresh_callback(istate, buf + bol);
+				count++;
+			}
 		}
 
 		/* Now mark the untracked cache for fsmonitor usage */
@@ -15,15 +15,11 @@ void jw_release(struct json_writer *jw)
 	strbuf_release(&jw->open_stack);
 }
 
-/*
- * Append JSON-quoted version of the given string to 'out'.
- */
-static void append_quoted_string(struct strbuf *out, const char *in)
+void jw_strbuf_add_escaped(struct strbuf *out, const char *in, size_t len)
 {
-	unsigned char c;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = in[i];
 
-	strbuf_addch(out, '"');
-	while ((c = *in++) != '\0') {
 		if (c == '"')
 			strbuf_addstr(out, "\\\"");
 		else if (c == '\\')
@@ -43,6 +39,15 @@ static void append_quoted_string(struct strbuf *out, const char *in)
 		else
 			strbuf_addch(out, c);
 	}
+}
+
+/*
+ * Append JSON-quoted version of the given string to 'out'.
+ */
+static void append_quoted_string(struct strbuf *out, const char *in)
+{
+	strbuf_addch(out, '"');
+	jw_strbuf_add_escaped(out, in, strlen(in));
 	strbuf_addch(out, '"');
 }
 
@@ -263,6 +263,13 @@ void jw_array_inline_begin_object(struct json_writer *jw);
  */
 void jw_array_inline_begin_array(struct json_writer *jw);
 
+/*
+ * Append the `len` bytes at `in` to `out`, escaped for use inside a JSON
+ * string but without the surrounding quotes. This lets callers emit a
+ * string value piecewise, e.g. while streaming a file into it.
+ */
+void jw_strbuf_add_escaped(struct strbuf *out, const char *in, size_t len);
+
 /*
  * Return whether the json_writer is terminated. In other words, if the all the
  * objects and arrays are already closed.
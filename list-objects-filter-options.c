@@ -32,6 +32,8 @@ const char *list_object_filter_config_name(enum list_objects_filter_choice c)
 		return "object:type";
 	case LOFC_COMBINE:
 		return "combine";
+	case LOFC_MODULE:
+		return "module";
 	case LOFC__COUNT:
 		/* not a real filter type; just the count of all filters */
 		break;
@@ -99,6 +101,15 @@ int gently_parse_list_objects_filter(
 	} else if (skip_prefix(arg, "combine:", &v0)) {
 		return parse_combine_filter(filter_options, v0, errbuf);
 
+	} else if (skip_prefix(arg, "module:", &v0)) {
+		if (!*v0) {
+			strbuf_addstr(errbuf, _("expected 'module:<name>'"));
+			return 1;
+		}
+		filter_options->module_name = xstrdup(v0);
+		filter_options->choice = LOFC_MODULE;
+		return 0;
+
 	}
 	/*
 	 * Please update _git_fetch() in git-completion.bash when you
@@ -322,6 +333,7 @@ void list_objects_filter_release(
 		return;
 	strbuf_release(&filter_options->filter_spec);
 	free(filter_options->sparse_oid_name);
+	free(filter_options->module_name);
 	for (sub = 0; sub < filter_options->sub_nr; sub++)
 		list_objects_filter_release(&filter_options->sub[sub]);
 	free(filter_options->sub);
@@ -400,6 +412,7 @@ void list_objects_filter_copy(
 	strbuf_init(&dest->filter_spec, 0);
 	strbuf_addbuf(&dest->filter_spec, &src->filter_spec);
 	dest->sparse_oid_name = xstrdup_or_null(src->sparse_oid_name);
+	dest->module_name = xstrdup_or_null(src->module_name);
 
 	ALLOC_ARRAY(dest->sub, dest->sub_alloc);
 	for (size_t i = 0; i < src->sub_nr; i++)
@@ -18,6 +18,7 @@ enum list_objects_filter_choice {
 	LOFC_SPARSE_OID,
 	LOFC_OBJECT_TYPE,
 	LOFC_COMBINE,
+	LOFC_MODULE,
 	LOFC__COUNT /* must be last */
 };
 
@@ -56,6 +57,7 @@ struct list_objects_filter_options {
 	 */
 
 	char *sparse_oid_name;
+	char *module_name;
 	unsigned long blob_limit_value;
 	unsigned long tree_exclude_depth;
 	enum object_type object_type;
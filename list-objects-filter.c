@@ -9,10 +9,13 @@
 #include "revision.h"
 #include "list-objects-filter.h"
 #include "list-objects-filter-options.h"
+#include "modgit.h"
 #include "oidmap.h"
 #include "oidset.h"
 #include "object-name.h"
 #include "odb.h"
+#include "sparse-checkout.h"
+#include "tree-walk.h"
 
 /* Remember to update object flag allocation in object.h */
 /*
@@ -620,6 +623,232 @@ static void filter_object_type__init(
 	filter->free_fn = free;
 }
 
+/*
+ * A filter driven by the module definitions of .modgit to only include
+ * the trees and blobs that 'git modgit switch <module>' would populate:
+ * the closure of the module, the directories leading to it and the
+ * top-level files. Trees outside of it are omitted without being walked.
+ *
+ * Every commit is filtered with the .modgit of its own root tree, so the
+ * closure follows the module definitions through history. A commit whose
+ * .modgit does not define the module only keeps its top-level files. The
+ * cone-mode patterns compiled from each .modgit blob are cached.
+ */
+struct module_cone {
+	struct oidmap_entry entry; /* the .modgit blob, or the null OID */
+	struct pattern_list pl;
+};
+
+struct filter_module_data {
+	const char *name;
+	struct oidmap cones;
+	struct pattern_list *pl;
+	struct strbuf dir;
+	unsigned int depth; /* of the tree being walked */
+	unsigned int whole:1; /* walking below a tree given directly */
+};
+
+static struct pattern_list *module_cone(struct repository *r,
+					struct filter_module_data *d,
+					struct object *root)
+{
+	struct module_cone *cone;
+	struct object_id oid;
+	unsigned short mode;
+
+	if (get_tree_entry(r, &root->oid, MODGIT_FILE, &oid, &mode) ||
+	    !S_ISREG(mode))
+		oidclr(&oid, r->hash_algo);
+
+	cone = oidmap_get(&d->cones, &oid);
+	if (cone)
+		return &cone->pl;
+
+	CALLOC_ARRAY(cone, 1);
+	oidcpy(&cone->entry.oid, &oid);
+	hashmap_init(&cone->pl.recursive_hashmap, pl_hashmap_cmp, NULL, 0);
+	hashmap_init(&cone->pl.parent_hashmap, pl_hashmap_cmp, NULL, 0);
+	cone->pl.use_cone_patterns = 1;
+
+	if (!is_null_oid(&oid)) {
+		struct module_graph graph;
+		struct module_def *mod;
+
+		module_graph_init(&graph);
+		if (!module_graph_load_blob(&graph, r, &oid) &&
+		    (mod = module_graph_lookup(&graph, d->name)) &&
+		    !module_graph_resolve(&graph, mod)) {
+			struct strbuf line = STRBUF_INIT;
+
+			for (size_t i = 0; i < mod->closure_nr; i++) {
+				strbuf_reset(&line);
+				strbuf_addstr(&line, mod->closure[i]);
+				strbuf_to_cone_pattern(&line, &cone->pl);
+			}
+			strbuf_release(&line);
+		}
+		module_graph_release(&graph);
+	}
+
+	oidmap_put(&d->cones, cone);
+	return &cone->pl;
+}
+
+static enum list_objects_filter_result filter_module(
+	struct repository *r,
+	enum list_objects_filter_situation filter_situation,
+	struct object *obj,
+	const char *pathname,
+	const char *filename,
+	struct oidset *omits,
+	void *filter_data_)
+{
+	struct filter_module_data *filter_data = filter_data_;
+	enum pattern_match_result match;
+	int dtype;
+
+	switch (filter_situation) {
+	default:
+		BUG("unknown filter_situation: %d", filter_situation);
+
+	case LOFS_TAG:
+		assert(obj->type == OBJ_TAG);
+		/* always include all tag objects */
+		return LOFR_MARK_SEEN | LOFR_DO_SHOW;
+
+	case LOFS_COMMIT:
+		assert(obj->type == OBJ_COMMIT);
+		/* always include all commit objects */
+		return LOFR_MARK_SEEN | LOFR_DO_SHOW;
+
+	case LOFS_BEGIN_TREE:
+		assert(obj->type == OBJ_TREE);
+		if (!filter_data->depth++) {
+			/*
+			 * Objects given directly (e.g. "HEAD:dir" or a tag
+			 * pointing at a tree) bypass the filter, so a tree
+			 * with a path that we see first is an entry of one
+			 * of them. There is no .modgit to go by: include it
+			 * whole, like the tree it is in. Only the root
+			 * trees of commits are filtered.
+			 */
+			filter_data->whole = !!*pathname;
+			if (!filter_data->whole)
+				filter_data->pl = module_cone(r, filter_data, obj);
+		}
+
+		if (filter_data->whole) {
+			match = MATCHED_RECURSIVE;
+		} else if (!*pathname) {
+			match = MATCHED;
+		} else {
+			/* Cone-mode patterns expect directories to end in '/'. */
+			strbuf_reset(&filter_data->dir);
+			strbuf_addf(&filter_data->dir, "%s/", pathname);
+			dtype = DT_DIR;
+			match = path_matches_pattern_list(filter_data->dir.buf,
+							  filter_data->dir.len,
+							  filename, &dtype,
+							  filter_data->pl, r->index);
+		}
+
+		if (match == MATCHED_RECURSIVE) {
+			/*
+			 * Everything below is included: never look again.
+			 * The tree may already have been shown as a leading
+			 * directory at another path.
+			 */
+			if (omits)
+				oidset_remove(omits, &obj->oid);
+			if (obj->flags & FILTER_SHOWN_BUT_REVISIT)
+				return LOFR_MARK_SEEN;
+			return LOFR_MARK_SEEN | LOFR_DO_SHOW;
+		}
+
+		if (match == MATCHED) {
+			/*
+			 * A leading directory of the closure, of which only
+			 * some entries are included. The same tree may be
+			 * reached again at a path with more of them, so
+			 * only show it once but keep walking it.
+			 */
+			if (omits)
+				oidset_remove(omits, &obj->oid);
+			if (obj->flags & FILTER_SHOWN_BUT_REVISIT)
+				return LOFR_ZERO;
+			obj->flags |= FILTER_SHOWN_BUT_REVISIT;
+			return LOFR_DO_SHOW;
+		}
+
+		/*
+		 * Provisionally omit the tree and everything below it; it
+		 * may still be included at another path.
+		 */
+		if (omits && !(obj->flags & FILTER_SHOWN_BUT_REVISIT))
+			oidset_insert(omits, &obj->oid);
+		return LOFR_SKIP_TREE;
+
+	case LOFS_END_TREE:
+		assert(obj->type == OBJ_TREE);
+		if (!--filter_data->depth)
+			filter_data->whole = 0;
+		return LOFR_ZERO;
+
+	case LOFS_BLOB:
+		assert(obj->type == OBJ_BLOB);
+		assert((obj->flags & SEEN) == 0);
+
+		/* An entry of a tree given directly, see above. */
+		if (!filter_data->depth || filter_data->whole) {
+			match = MATCHED;
+		} else {
+			dtype = DT_REG;
+			match = path_matches_pattern_list(pathname, strlen(pathname),
+							  filename, &dtype,
+							  filter_data->pl, r->index);
+		}
+		if (match > 0) {
+			if (omits)
+				oidset_remove(omits, &obj->oid);
+			return LOFR_MARK_SEEN | LOFR_DO_SHOW;
+		}
+
+		/* Provisionally omit it, like the sparse filter does. */
+		if (omits)
+			oidset_insert(omits, &obj->oid);
+		return LOFR_ZERO;
+	}
+}
+
+static void filter_module_free(void *filter_data)
+{
+	struct filter_module_data *d = filter_data;
+	struct oidmap_iter iter;
+	struct module_cone *cone;
+
+	oidmap_iter_init(&d->cones, &iter);
+	while ((cone = oidmap_iter_next(&iter)))
+		clear_pattern_list(&cone->pl);
+	oidmap_clear(&d->cones, 1);
+	strbuf_release(&d->dir);
+	free(d);
+}
+
+static void filter_module__init(
+	struct list_objects_filter_options *filter_options,
+	struct filter *filter)
+{
+	struct filter_module_data *d = xcalloc(1, sizeof(*d));
+
+	d->name = filter_options->module_name;
+	oidmap_init(&d->cones, 0);
+	strbuf_init(&d->dir, 0);
+
+	filter->filter_data = d;
+	filter->filter_object_fn = filter_module;
+	filter->free_fn = filter_module_free;
+}
+
 /* A filter which only shows objects shown by all sub-filters. */
 struct combine_filter_data {
 	struct subfilter *sub;
@@ -760,6 +989,7 @@ static filter_init_fn s_filters[] = {
 	filter_sparse_oid__init,
 	filter_object_type__init,
 	filter_combine__init,
+	filter_module__init,
 };
 
 struct filter *list_objects_filter__init(
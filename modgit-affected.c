@@ -0,0 +1,220 @@
+#include "git-compat-util.h"
+#include "modgit-affected.h"
+#include "bloom.h"
+#include "commit.h"
+#include "commit-graph.h"
+#include "diff.h"
+#include "diffcore.h"
+#include "gettext.h"
+#include "hex.h"
+#include "modgit.h"
+#include "pathspec.h"
+#include "repository.h"
+#include "revision.h"
+#include "strvec.h"
+#include "trace2.h"
+
+struct affected_state {
+	struct repository *repo;
+	struct module_graph *graph;
+	struct module_trie trie;
+
+	/* Indexed by module position; set once a module is affected. */
+	char *affected;
+	size_t unaffected;
+
+	/* The Bloom keys of the paths of the modules, with their owners. */
+	struct bloom_filter_settings *settings;
+	struct bloom_key *keys;
+	struct module_def **key_modules;
+	size_t keys_nr;
+};
+
+static void setup_bloom_keys(struct affected_state *state)
+{
+	struct module_graph *graph = state->graph;
+	size_t nr = 0;
+
+	state->settings = get_bloom_filter_settings(state->repo);
+	if (!state->settings)
+		return;
+
+	for (size_t i = 0; i < graph->modules_nr; i++)
+		nr += graph->modules[i]->paths_nr;
+	CALLOC_ARRAY(state->keys, nr);
+	ALLOC_ARRAY(state->key_modules, nr);
+
+	for (size_t i = 0; i < graph->modules_nr; i++) {
+		struct module_def *module = graph->modules[i];
+
+		for (size_t j = 0; j < module->paths_nr; j++) {
+			const char *path = module->paths[j];
+			size_t len = strlen(path);
+
+			while (len && path[len - 1] == '/')
+				len--;
+			bloom_key_fill(&state->keys[state->keys_nr], path, len,
+				       state->settings);
+			state->key_modules[state->keys_nr++] = module;
+		}
+	}
+}
+
+/*
+ * Return whether the Bloom filter of `commit` says that it may change a
+ * path of a module that is not affected yet.
+ */
+static int maybe_changes_unaffected(struct affected_state *state,
+				    struct commit *commit)
+{
+	struct bloom_filter *filter;
+
+	if (!state->keys || !commit->parents)
+		return 1;
+	filter = get_bloom_filter(state->repo, commit);
+	if (!filter)
+		return 1;
+
+	for (size_t i = 0; i < state->keys_nr; i++) {
+		if (state->affected[state->key_modules[i]->index])
+			continue;
+		if (bloom_filter_contains(filter, &state->keys[i], state->settings))
+			return 1;
+	}
+	return 0;
+}
+
+static void mark_affected(struct affected_state *state, const char *path,
+			  struct module_list *found)
+{
+	found->nr = 0;
+	module_trie_lookup(&state->trie, path, found);
+	for (size_t i = 0; i < found->nr; i++) {
+		struct module_def *module = found->items[i];
+
+		if (state->affected[module->index])
+			continue;
+		state->affected[module->index] = 1;
+		state->unaffected--;
+	}
+}
+
+static void mark_dependents(struct affected_state *state)
+{
+	struct module_graph *graph = state->graph;
+	struct module_list *dependents;
+	struct module_list queue = MODULE_LIST_INIT;
+
+	CALLOC_ARRAY(dependents, graph->modules_nr);
+	for (size_t i = 0; i < graph->modules_nr; i++) {
+		struct module_def *module = graph->modules[i];
+
+		for (size_t j = 0; j < module->deps_nr; j++)
+			module_list_append(&dependents[module->deps[j]->index],
+					   module);
+		if (state->affected[i])
+			module_list_append(&queue, module);
+	}
+
+	for (size_t i = 0; i < queue.nr; i++) {
+		struct module_list *list = &dependents[queue.items[i]->index];
+
+		for (size_t j = 0; j < list->nr; j++) {
+			struct module_def *module = list->items[j];
+
+			if (state->affected[module->index])
+				continue;
+			state->affected[module->index] = 1;
+			module_list_append(&queue, module);
+		}
+	}
+
+	for (size_t i = 0; i < graph->modules_nr; i++)
+		module_list_clear(&dependents[i]);
+	free(dependents);
+	module_list_clear(&queue);
+}
+
+int modgit_affected_modules(struct repository *r, struct module_graph *graph,
+			    struct rev_info *revs, int dependents,
+			    struct module_list *out)
+{
+	struct affected_state state = {
+		.repo = r,
+		.graph = graph,
+		.trie = MODULE_TRIE_INIT,
+	};
+	struct module_list found = MODULE_LIST_INIT;
+	struct strvec paths = STRVEC_INIT;
+	struct diff_options diffopt;
+	struct commit *commit;
+	int walked = 0, diffed = 0, ret = 0;
+
+	trace2_region_enter("modgit", "affected", r);
+
+	CALLOC_ARRAY(state.affected, graph->modules_nr);
+	for (size_t i = 0; i < graph->modules_nr; i++) {
+		if (graph->modules[i]->paths_nr)
+			state.unaffected++;
+		for (size_t j = 0; j < graph->modules[i]->paths_nr; j++)
+			strvec_push(&paths, graph->modules[i]->paths[j]);
+	}
+	module_trie_build(&state.trie, graph, 0);
+	setup_bloom_keys(&state);
+
+	/* Only look into the trees below the paths of some module. */
+	repo_diff_setup(r, &diffopt);
+	diffopt.flags.recursive = 1;
+	diffopt.output_format = DIFF_FORMAT_NO_OUTPUT;
+	parse_pathspec(&diffopt.pathspec, 0, PATHSPEC_LITERAL_PATH,
+		       NULL, paths.v);
+	diff_setup_done(&diffopt);
+
+	if (state.unaffected && prepare_revision_walk(revs))
+		ret = error(_("revision walk setup failed"));
+
+	while (!ret && state.unaffected && (commit = get_revision(revs))) {
+		struct commit *parent = commit->parents ? commit->parents->item : NULL;
+
+		walked++;
+		if (!maybe_changes_unaffected(&state, commit))
+			continue;
+		if (parent && repo_parse_commit(r, parent)) {
+			ret = error(_("unable to parse commit %s"),
+				    oid_to_hex(&parent->object.oid));
+			break;
+		}
+
+		diffed++;
+		diff_tree_oid(parent ? get_commit_tree_oid(parent) : NULL,
+			      get_commit_tree_oid(commit), "", &diffopt);
+		for (int i = 0; i < diff_queued_diff.nr; i++)
+			mark_affected(&state, diff_queued_diff.queue[i]->two->path,
+				      &found);
+		diff_queue_clear(&diff_queued_diff);
+	}
+
+	trace2_data_intmax("modgit", r, "affected/walked", walked);
+	trace2_data_intmax("modgit", r, "affected/diffed", diffed);
+
+	if (!ret) {
+		if (dependents)
+			mark_dependents(&state);
+		for (size_t i = 0; i < graph->modules_nr; i++)
+			if (state.affected[i])
+				module_list_append(out, graph->modules[i]);
+	}
+
+	trace2_region_leave("modgit", "affected", r);
+
+	diff_free(&diffopt);
+	for (size_t i = 0; i < state.keys_nr; i++)
+		bloom_key_clear(&state.keys[i]);
+	free(state.keys);
+	free(state.key_modules);
+	free(state.affected);
+	module_trie_clear(&state.trie);
+	module_list_clear(&found);
+	strvec_clear(&paths);
+	return ret;
+}
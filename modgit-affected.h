@@ -0,0 +1,26 @@
+#ifndef MODGIT_AFFECTED_H
+#define MODGIT_AFFECTED_H
+
+struct module_graph;
+struct module_list;
+struct repository;
+struct rev_info;
+
+/*
+ * Append to `out`, in .modgit order, the modules of `graph` whose paths
+ * are changed by a commit of `revs`, which must have been set up but not
+ * yet walked. Each commit is compared with its first parent. With
+ * `dependents`, also append every module that transitively depends on
+ * such a module.
+ *
+ * Commits whose changed-path Bloom filter rules out all the modules not
+ * yet known to be affected are skipped without reading their trees, and
+ * the walk stops as soon as every module is affected.
+ *
+ * Returns -1 if the history cannot be walked, which is reported.
+ */
+int modgit_affected_modules(struct repository *r, struct module_graph *graph,
+			    struct rev_info *revs, int dependents,
+			    struct module_list *out);
+
+#endif
@@ -0,0 +1,833 @@
+#include "git-compat-util.h"
+#include "modgit-context.h"
+#include "bloom.h"
+#include "commit.h"
+#include "commit-graph.h"
+#include "diff.h"
+#include "diffcore.h"
+#include "gettext.h"
+#include "hex.h"
+#include "json-writer.h"
+#include "object-name.h"
+#include "odb.h"
+#include "odb/streaming.h"
+#include "pathspec.h"
+#include "repository.h"
+#include "strbuf.h"
+#include "strmap.h"
+#include "strvec.h"
+#include "thread-utils.h"
+#include "trace2.h"
+#include "tree.h"
+#include "write-or-die.h"
+#include "xdiff-interface.h"
+
+/*
+ * The output of a file is buffered up to this size; beyond it, the thread
+ * formatting the file waits for its turn and writes it out directly.
+ */
+#define CONTEXT_FLUSH_LIMIT (256 * 1024)
+
+/* Size of the chunks read from streamed blobs. */
+#define CONTEXT_STREAM_CHUNK (64 * 1024)
+
+/*
+ * Blobs up to this size are read into memory whole, which lets us pick
+ * the shortest fence that works for them; larger ones are streamed.
+ * Every thread may hold one such blob, so keep this well below
+ * core.bigFileThreshold.
+ */
+#define CONTEXT_IN_CORE_LIMIT (1024 * 1024)
+
+/*
+ * What a file costs against the budget beyond its contents, for the
+ * heading or JSON keys around it.
+ */
+#define CONTEXT_FILE_OVERHEAD 32
+
+struct context_file {
+	char *path;
+	struct object_id oid;
+
+	/* Only filled in when packing a budget. */
+	unsigned long size;
+	timestamp_t date;
+};
+
+struct context_slot {
+	struct strbuf buf;
+	int done;
+	/* Part of the file has already been written out. */
+	int flushed;
+};
+
+struct context_state {
+	struct repository *repo;
+	enum modgit_context_format format;
+	unsigned long stream_threshold;
+
+	struct context_file *files;
+	size_t files_nr, files_alloc;
+
+	/* The files that did not fit into the budget, in path order. */
+	struct context_file *omitted;
+	size_t omitted_nr;
+	unsigned long budget;
+
+	/*
+	 * The files are claimed in order by the threads, and each formats
+	 * its file into the slot `index % window`. A file can only be
+	 * claimed while its slot is free, i.e. when fewer than `window`
+	 * files are waiting to be written.
+	 */
+	struct context_slot *slots;
+	size_t window;
+	size_t next_file;
+	size_t next_write;
+	int err;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static int collect_file(const struct object_id *oid, struct strbuf *base,
+			const char *pathname, unsigned mode, void *data)
+{
+	struct context_state *state = data;
+	struct context_file *file;
+
+	if (S_ISDIR(mode))
+		return READ_TREE_RECURSIVE;
+	if (!S_ISREG(mode))
+		return 0;
+
+	ALLOC_GROW(state->files, state->files_nr + 1, state->files_alloc);
+	file = &state->files[state->files_nr++];
+	file->path = xstrfmt("%.*s%s", (int)base->len, base->buf, pathname);
+	oidcpy(&file->oid, oid);
+	file->size = 0;
+	file->date = 0;
+	return 0;
+}
+
+/*
+ * Write out the slots that are done, in order. Must be called with the
+ * mutex held.
+ */
+static void flush_done_slots(struct context_state *state)
+{
+	while (state->next_write < state->files_nr) {
+		struct context_slot *slot =
+			&state->slots[state->next_write % state->window];
+
+		if (!slot->done)
+			break;
+		write_or_die(1, slot->buf.buf, slot->buf.len);
+		strbuf_reset(&slot->buf);
+		slot->done = 0;
+		state->next_write++;
+	}
+	pthread_cond_broadcast(&state->cond);
+}
+
+/*
+ * Called while formatting the file `index` whenever output was added to
+ * its slot. Once the slot holds more than CONTEXT_FLUSH_LIMIT bytes, wait
+ * until all files before this one have been written and write the slot
+ * out. From then on, nobody else writes until this file is done.
+ */
+static void maybe_flush_slot(struct context_state *state, size_t index,
+			     struct context_slot *slot)
+{
+	if (slot->buf.len < CONTEXT_FLUSH_LIMIT)
+		return;
+
+	pthread_mutex_lock(&state->mutex);
+	while (state->next_write != index)
+		pthread_cond_wait(&state->cond, &state->mutex);
+	pthread_mutex_unlock(&state->mutex);
+
+	write_or_die(1, slot->buf.buf, slot->buf.len);
+	strbuf_reset(&slot->buf);
+	slot->flushed = 1;
+}
+
+static void add_content(struct context_state *state, struct strbuf *out,
+			const char *buf, size_t len)
+{
+	if (state->format == MODGIT_CONTEXT_JSON)
+		jw_strbuf_add_escaped(out, buf, len);
+	else
+		strbuf_add(out, buf, len);
+}
+
+/*
+ * Return the longest run of backticks in `buf`. A run left open at the
+ * end of the buffer is kept in `*run`, so that it can be continued by
+ * the next chunk of the same content.
+ */
+static size_t longest_backtick_run(const char *buf, size_t len, size_t *run)
+{
+	size_t longest = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (buf[i] == '`') {
+			if (++*run > longest)
+				longest = *run;
+		} else {
+			*run = 0;
+		}
+	}
+	return longest;
+}
+
+static void begin_file(struct context_state *state, struct strbuf *out,
+		       size_t index, unsigned long size)
+{
+	struct context_file *file = &state->files[index];
+
+	if (state->format == MODGIT_CONTEXT_JSON) {
+		struct json_writer jw = JSON_WRITER_INIT;
+
+		/*
+		 * The object is left open, so that the content can be
+		 * appended to it piecewise.
+		 */
+		jw_object_begin(&jw, 0);
+		jw_object_string(&jw, "path", file->path);
+		jw_object_string(&jw, "oid", oid_to_hex(&file->oid));
+		jw_object_intmax(&jw, "size", size);
+		if (index)
+			strbuf_addch(out, ',');
+		strbuf_addbuf(out, &jw.json);
+		jw_release(&jw);
+	} else {
+		strbuf_addf(out, "## %s\n\n", file->path);
+	}
+}
+
+static void add_binary(struct context_state *state, struct strbuf *out,
+		       unsigned long size)
+{
+	if (state->format == MODGIT_CONTEXT_JSON)
+		strbuf_addstr(out, ",\"binary\":true}");
+	else
+		strbuf_addf(out, _("(binary file, %lu bytes)\n\n"), size);
+}
+
+static void add_unreadable(struct context_state *state, struct strbuf *out,
+			   size_t index)
+{
+	struct context_file *file = &state->files[index];
+
+	if (state->format == MODGIT_CONTEXT_JSON) {
+		struct json_writer jw = JSON_WRITER_INIT;
+
+		jw_object_begin(&jw, 0);
+		jw_object_string(&jw, "path", file->path);
+		jw_object_string(&jw, "oid", oid_to_hex(&file->oid));
+		jw_object_true(&jw, "error");
+		jw_end(&jw);
+		if (index)
+			strbuf_addch(out, ',');
+		strbuf_addbuf(out, &jw.json);
+		jw_release(&jw);
+	} else {
+		strbuf_addf(out, "## %s\n\n", file->path);
+		strbuf_addstr(out, _("(unable to read file)\n\n"));
+	}
+}
+
+/*
+ * End the content of a file of which only a part could be read, and
+ * which has already been written out in part, so that its record is
+ * still well-formed.
+ */
+static void end_truncated(struct context_state *state, struct strbuf *out,
+			  size_t fence, int ends_with_newline)
+{
+	if (state->format == MODGIT_CONTEXT_JSON)
+		strbuf_addstr(out, "\",\"error\":true}");
+	else {
+		if (!ends_with_newline)
+			strbuf_addch(out, '\n');
+		strbuf_addchars(out, '`', fence);
+		strbuf_addstr(out, "\n\n");
+		strbuf_addstr(out, _("(unable to read the rest of the file)\n\n"));
+	}
+}
+
+static void begin_content(struct context_state *state, struct strbuf *out,
+			  size_t fence)
+{
+	if (state->format == MODGIT_CONTEXT_JSON)
+		strbuf_addstr(out, ",\"content\":\"");
+	else {
+		strbuf_addchars(out, '`', fence);
+		strbuf_addch(out, '\n');
+	}
+}
+
+static void end_content(struct context_state *state, struct strbuf *out,
+			size_t fence, int ends_with_newline)
+{
+	if (state->format == MODGIT_CONTEXT_JSON)
+		strbuf_addstr(out, "\"}");
+	else {
+		if (!ends_with_newline)
+			strbuf_addch(out, '\n');
+		strbuf_addchars(out, '`', fence);
+		strbuf_addstr(out, "\n\n");
+	}
+}
+
+static int format_in_core(struct context_state *state, size_t index,
+			  struct context_slot *slot)
+{
+	struct context_file *file = &state->files[index];
+	enum object_type type;
+	unsigned long len;
+	size_t fence, run = 0;
+	char *buf;
+
+	buf = odb_read_object(state->repo->objects, &file->oid, &type, &len);
+	if (!buf || type != OBJ_BLOB) {
+		free(buf);
+		return error(_("unable to read %s for '%s'"),
+			     oid_to_hex(&file->oid), file->path);
+	}
+
+	begin_file(state, &slot->buf, index, len);
+	if (buffer_is_binary(buf, len)) {
+		add_binary(state, &slot->buf, len);
+		free(buf);
+		return 0;
+	}
+
+	fence = longest_backtick_run(buf, len, &run) + 1;
+	if (fence < 3)
+		fence = 3;
+	begin_content(state, &slot->buf, fence);
+	for (size_t pos = 0; pos < len; pos += CONTEXT_STREAM_CHUNK) {
+		size_t n = len - pos;
+
+		if (n > CONTEXT_STREAM_CHUNK)
+			n = CONTEXT_STREAM_CHUNK;
+		add_content(state, &slot->buf, buf + pos, n);
+		maybe_flush_slot(state, index, slot);
+	}
+	end_content(state, &slot->buf, fence, !len || buf[len - 1] == '\n');
+
+	free(buf);
+	return 0;
+}
+
+/*
+ * Find the longest run of backticks in a blob that is not held in core,
+ * with a first pass over its stream. Binary blobs are not fenced, so
+ * the scan stops at a binary first chunk. Returns -1 if the blob could
+ * not be read.
+ */
+static int stream_backtick_run(struct context_state *state,
+			       const struct object_id *oid, char *buf,
+			       size_t *longest)
+{
+	struct odb_read_stream *st;
+	size_t run = 0, chunk_longest;
+	int first = 1, ret = 0;
+
+	*longest = 0;
+	obj_read_lock();
+	st = odb_read_stream_open(state->repo->objects, oid, NULL);
+	obj_read_unlock();
+	if (!st)
+		return -1;
+
+	for (;;) {
+		ssize_t n;
+
+		obj_read_lock();
+		n = odb_read_stream_read(st, buf, CONTEXT_STREAM_CHUNK);
+		obj_read_unlock();
+		if (n < 0)
+			ret = -1;
+		if (n <= 0 || (first && buffer_is_binary(buf, n)))
+			break;
+		first = 0;
+		chunk_longest = longest_backtick_run(buf, n, &run);
+		if (chunk_longest > *longest)
+			*longest = chunk_longest;
+	}
+
+	obj_read_lock();
+	odb_read_stream_close(st);
+	obj_read_unlock();
+	return ret;
+}
+
+/*
+ * Blobs above the streaming threshold are read through the streaming
+ * interface. Reading a pack stream is not thread-safe, so each call into
+ * the stream holds the object read lock; it is never held while waiting
+ * for our turn to write.
+ */
+static int format_streamed(struct context_state *state, size_t index,
+			   struct context_slot *slot)
+{
+	struct context_file *file = &state->files[index];
+	struct odb_read_stream *st = NULL;
+	char *buf = xmalloc(CONTEXT_STREAM_CHUNK);
+	size_t fence = 3;
+	int first = 1, ends_with_newline = 1, ret = 0;
+
+	/*
+	 * The fence has to be written before the content, so for Markdown
+	 * read the blob twice: once to size the fence, then to copy it.
+	 */
+	if (state->format != MODGIT_CONTEXT_JSON) {
+		size_t longest;
+
+		if (stream_backtick_run(state, &file->oid, buf, &longest) < 0) {
+			ret = error(_("unable to stream %s for '%s'"),
+				    oid_to_hex(&file->oid), file->path);
+			goto out;
+		}
+		if (longest >= fence)
+			fence = longest + 1;
+	}
+
+	obj_read_lock();
+	st = odb_read_stream_open(state->repo->objects, &file->oid, NULL);
+	obj_read_unlock();
+	if (!st || st->type != OBJ_BLOB) {
+		ret = error(_("unable to stream %s for '%s'"),
+			    oid_to_hex(&file->oid), file->path);
+		goto out;
+	}
+
+	begin_file(state, &slot->buf, index, st->size);
+	for (;;) {
+		ssize_t n;
+
+		obj_read_lock();
+		n = odb_read_stream_read(st, buf, CONTEXT_STREAM_CHUNK);
+		obj_read_unlock();
+		if (n < 0) {
+			ret = error(_("unable to stream %s for '%s'"),
+				    oid_to_hex(&file->oid), file->path);
+			if (slot->flushed)
+				end_truncated(state, &slot->buf, fence,
+					      ends_with_newline);
+			break;
+		}
+
+		if (first) {
+			first = 0;
+			if (buffer_is_binary(buf, n)) {
+				add_binary(state, &slot->buf, st->size);
+				break;
+			}
+			begin_content(state, &slot->buf, fence);
+		}
+		if (!n) {
+			end_content(state, &slot->buf, fence, ends_with_newline);
+			break;
+		}
+
+		add_content(state, &slot->buf, buf, n);
+		ends_with_newline = buf[n - 1] == '\n';
+		maybe_flush_slot(state, index, slot);
+	}
+
+out:
+	if (st) {
+		obj_read_lock();
+		odb_read_stream_close(st);
+		obj_read_unlock();
+	}
+	free(buf);
+	return ret;
+}
+
+static int format_file(struct context_state *state, size_t index,
+		       struct context_slot *slot)
+{
+	struct context_file *file = &state->files[index];
+	unsigned long size;
+
+	if (odb_read_object_info(state->repo->objects, &file->oid, &size) != OBJ_BLOB)
+		return error(_("unable to read %s for '%s'"),
+			     oid_to_hex(&file->oid), file->path);
+
+	if (size > state->stream_threshold)
+		return format_streamed(state, index, slot);
+	return format_in_core(state, index, slot);
+}
+
+static void *context_worker(void *data)
+{
+	struct context_state *state = data;
+
+	pthread_mutex_lock(&state->mutex);
+	for (;;) {
+		struct context_slot *slot;
+		size_t index;
+		int ret;
+
+		while (state->next_file < state->files_nr &&
+		       state->next_file >= state->next_write + state->window)
+			pthread_cond_wait(&state->cond, &state->mutex);
+		if (state->next_file >= state->files_nr)
+			break;
+
+		index = state->next_file++;
+		slot = &state->slots[index % state->window];
+		pthread_mutex_unlock(&state->mutex);
+
+		ret = format_file(state, index, slot);
+
+		pthread_mutex_lock(&state->mutex);
+		if (ret < 0) {
+			/*
+			 * Unless the start of the file has been written
+			 * out already, replace what we have of it.
+			 */
+			if (!slot->flushed) {
+				strbuf_reset(&slot->buf);
+				add_unreadable(state, &slot->buf, index);
+			}
+			state->err = 1;
+		}
+		slot->flushed = 0;
+		slot->done = 1;
+		flush_done_slots(state);
+	}
+	pthread_mutex_unlock(&state->mutex);
+	return NULL;
+}
+
+static void write_header(struct context_state *state, const char *module,
+			 const struct object_id *oid)
+{
+	struct strbuf out = STRBUF_INIT;
+
+	if (state->format == MODGIT_CONTEXT_JSON) {
+		struct json_writer jw = JSON_WRITER_INIT;
+
+		jw_object_begin(&jw, 0);
+		jw_object_string(&jw, "module", module);
+		jw_object_string(&jw, "commit", oid_to_hex(oid));
+		if (state->budget)
+			jw_object_intmax(&jw, "budget", state->budget);
+		/* Leave the object open, and the "files" array after it. */
+		strbuf_addbuf(&out, &jw.json);
+		strbuf_addstr(&out, ",\"files\":[");
+		jw_release(&jw);
+	} else {
+		strbuf_addf(&out, _("# Context for module '%s'\n\n"), module);
+		strbuf_addf(&out, _("Revision: %s\n\n"), oid_to_hex(oid));
+		if (state->budget)
+			strbuf_addf(&out, _("Budget: %lu bytes\n\n"), state->budget);
+	}
+	write_or_die(1, out.buf, out.len);
+	strbuf_release(&out);
+}
+
+static void write_footer(struct context_state *state)
+{
+	struct strbuf out = STRBUF_INIT;
+
+	if (state->format == MODGIT_CONTEXT_JSON) {
+		strbuf_addch(&out, ']');
+		if (state->budget) {
+			strbuf_addstr(&out, ",\"omitted\":[");
+			for (size_t i = 0; i < state->omitted_nr; i++) {
+				struct context_file *file = &state->omitted[i];
+				struct json_writer jw = JSON_WRITER_INIT;
+
+				jw_object_begin(&jw, 0);
+				jw_object_string(&jw, "path", file->path);
+				jw_object_string(&jw, "oid", oid_to_hex(&file->oid));
+				jw_object_intmax(&jw, "size", file->size);
+				jw_end(&jw);
+				if (i)
+					strbuf_addch(&out, ',');
+				strbuf_addbuf(&out, &jw.json);
+				jw_release(&jw);
+			}
+			strbuf_addch(&out, ']');
+		}
+		strbuf_addstr(&out, "}\n");
+	} else if (state->omitted_nr) {
+		strbuf_addstr(&out, _("## Omitted files\n\n"));
+		strbuf_addf(&out, _("These files did not fit into the budget of %lu bytes:\n\n"),
+			    state->budget);
+		for (size_t i = 0; i < state->omitted_nr; i++)
+			strbuf_addf(&out, _("- %s (%lu bytes)\n"),
+				    state->omitted[i].path, state->omitted[i].size);
+	}
+	write_or_die(1, out.buf, out.len);
+	strbuf_release(&out);
+}
+
+/*
+ * Record in `date` of each file the commit date of the last commit on
+ * the first-parent history of `commit` that changed it. The walk stops
+ * once every file is dated. Commits in which the Bloom filters of the
+ * commit-graph rule out a change below all of `paths` are skipped
+ * without diffing their trees; with a commit-graph, their dates and
+ * parents are not even read from the object database.
+ */
+static void date_files(struct context_state *state, struct commit *commit,
+		       const struct strvec *paths, const struct pathspec *pathspec)
+{
+	struct repository *r = state->repo;
+	struct bloom_filter_settings *settings = get_bloom_filter_settings(r);
+	struct bloom_key *keys = NULL;
+	struct strmap by_path = STRMAP_INIT;
+	struct diff_options diffopt;
+	size_t undated = state->files_nr;
+	int walked = 0, diffed = 0;
+
+	for (size_t i = 0; i < state->files_nr; i++)
+		strmap_put(&by_path, state->files[i].path, &state->files[i]);
+
+	if (settings) {
+		CALLOC_ARRAY(keys, paths->nr);
+		for (size_t i = 0; i < paths->nr; i++) {
+			size_t len = strlen(paths->v[i]);
+
+			while (len && paths->v[i][len - 1] == '/')
+				len--;
+			bloom_key_fill(&keys[i], paths->v[i], len, settings);
+		}
+	}
+
+	repo_diff_setup(r, &diffopt);
+	diffopt.flags.recursive = 1;
+	diffopt.output_format = DIFF_FORMAT_NO_OUTPUT;
+	copy_pathspec(&diffopt.pathspec, pathspec);
+	diff_setup_done(&diffopt);
+
+	while (commit && undated) {
+		struct commit *parent;
+		struct bloom_filter *filter;
+		int changed = 1;
+
+		if (repo_parse_commit(r, commit))
+			break;
+		walked++;
+		parent = commit->parents ? commit->parents->item : NULL;
+
+		if (keys && parent &&
+		    (filter = get_bloom_filter(r, commit))) {
+			changed = 0;
+			for (size_t i = 0; !changed && i < paths->nr; i++)
+				changed = bloom_filter_contains(filter, &keys[i], settings);
+		}
+
+		if (changed) {
+			diffed++;
+			if (parent && repo_parse_commit(r, parent))
+				break;
+			diff_tree_oid(parent ? get_commit_tree_oid(parent) : NULL,
+				      get_commit_tree_oid(commit), "", &diffopt);
+			for (int i = 0; i < diff_queued_diff.nr; i++) {
+				struct diff_filepair *p = diff_queued_diff.queue[i];
+				struct context_file *file;
+
+				if (p->status == DIFF_STATUS_DELETED)
+					continue;
+				file = strmap_get(&by_path, p->two->path);
+				if (file && !file->date) {
+					file->date = commit->date;
+					undated--;
+				}
+			}
+			diff_queue_clear(&diff_queued_diff);
+		}
+		commit = parent;
+	}
+
+	trace2_data_intmax("modgit", r, "ai-context/walked", walked);
+	trace2_data_intmax("modgit", r, "ai-context/diffed", diffed);
+
+	diff_free(&diffopt);
+	if (keys) {
+		for (size_t i = 0; i < paths->nr; i++)
+			bloom_key_clear(&keys[i]);
+		free(keys);
+	}
+	strmap_clear(&by_path, 0);
+}
+
+/* Most recently changed first, then smallest first. */
+static int compare_by_rank(const void *a_, const void *b_)
+{
+	const struct context_file *a = *(const struct context_file **)a_;
+	const struct context_file *b = *(const struct context_file **)b_;
+
+	if (a->date != b->date)
+		return a->date < b->date ? 1 : -1;
+	if (a->size != b->size)
+		return a->size < b->size ? -1 : 1;
+	return strcmp(a->path, b->path);
+}
+
+/*
+ * Keep only the files that fit into the budget, picking them greedily
+ * in the order of compare_by_rank(), and move the others to `omitted`.
+ * The sizes come from the object headers, so nothing is inflated for
+ * the files that are left out.
+ */
+static void pack_budget(struct context_state *state, struct commit *commit,
+			const struct strvec *paths, const struct pathspec *pathspec)
+{
+	struct context_file **ranked;
+	struct context_file *kept;
+	unsigned char *selected;
+	unsigned long left = state->budget;
+	size_t kept_nr = 0;
+
+	for (size_t i = 0; i < state->files_nr; i++) {
+		struct context_file *file = &state->files[i];
+
+		if (odb_read_object_info(state->repo->objects, &file->oid,
+					 &file->size) < 0)
+			file->size = 0;
+	}
+	if (commit)
+		date_files(state, commit, paths, pathspec);
+
+	ALLOC_ARRAY(ranked, state->files_nr);
+	for (size_t i = 0; i < state->files_nr; i++)
+		ranked[i] = &state->files[i];
+	QSORT(ranked, state->files_nr, compare_by_rank);
+
+	CALLOC_ARRAY(selected, state->files_nr);
+	for (size_t i = 0; i < state->files_nr; i++) {
+		struct context_file *file = ranked[i];
+		unsigned long cost = file->size + strlen(file->path) +
+				     CONTEXT_FILE_OVERHEAD;
+
+		if (cost > left)
+			continue;
+		left -= cost;
+		selected[file - state->files] = 1;
+	}
+
+	ALLOC_ARRAY(kept, state->files_nr);
+	ALLOC_ARRAY(state->omitted, state->files_nr);
+	for (size_t i = 0; i < state->files_nr; i++) {
+		if (selected[i])
+			kept[kept_nr++] = state->files[i];
+		else
+			state->omitted[state->omitted_nr++] = state->files[i];
+	}
+	free(state->files);
+	state->files = kept;
+	state->files_nr = kept_nr;
+	state->files_alloc = state->files_nr;
+
+	trace2_data_intmax("modgit", state->repo, "ai-context/omitted",
+			   state->omitted_nr);
+
+	free(selected);
+	free(ranked);
+}
+
+int write_module_context(struct repository *r, const char *module,
+			 const char *rev, const struct strvec *paths,
+			 const struct modgit_context_options *opts)
+{
+	struct context_state state = {
+		.repo = r,
+		.format = opts->format,
+		.budget = opts->budget,
+	};
+	struct object_id oid;
+	struct tree *tree;
+	int nr_threads = opts->nr_threads;
+
+	if (repo_get_oid(r, rev, &oid))
+		return error(_("not a valid revision: '%s'"), rev);
+	tree = repo_parse_tree_indirect(r, &oid);
+	if (!tree)
+		return error(_("not a tree object: '%s'"), rev);
+
+	trace2_region_enter("modgit", "ai-context", r);
+
+	if (paths->nr) {
+		struct pathspec pathspec;
+
+		parse_pathspec(&pathspec, 0, PATHSPEC_LITERAL_PATH,
+			       NULL, (const char **)paths->v);
+		read_tree(r, tree, &pathspec, collect_file, &state);
+		if (state.budget)
+			pack_budget(&state, lookup_commit_reference_gently(r, &oid, 1),
+				    paths, &pathspec);
+		clear_pathspec(&pathspec);
+	}
+
+	if (!HAVE_THREADS || nr_threads < 0)
+		nr_threads = 1;
+	else if (!nr_threads)
+		nr_threads = online_cpus();
+	if ((size_t)nr_threads > state.files_nr)
+		nr_threads = state.files_nr ? state.files_nr : 1;
+
+	state.stream_threshold = repo_settings_get_big_file_threshold(r);
+	if (state.stream_threshold > CONTEXT_IN_CORE_LIMIT)
+		state.stream_threshold = CONTEXT_IN_CORE_LIMIT;
+	state.window = 2 * nr_threads;
+	CALLOC_ARRAY(state.slots, state.window);
+	for (size_t i = 0; i < state.window; i++)
+		strbuf_init(&state.slots[i].buf, 0);
+
+	trace2_data_intmax("modgit", r, "ai-context/files", state.files_nr);
+	trace2_data_intmax("modgit", r, "ai-context/threads", nr_threads);
+
+	write_header(&state, module, &oid);
+
+	pthread_mutex_init(&state.mutex, NULL);
+	pthread_cond_init(&state.cond, NULL);
+
+	if (nr_threads == 1) {
+		context_worker(&state);
+	} else {
+		pthread_t *threads;
+
+		enable_obj_read_lock();
+
+		CALLOC_ARRAY(threads, nr_threads);
+		for (int i = 0; i < nr_threads; i++) {
+			int err = pthread_create(&threads[i], NULL,
+						 context_worker, &state);
+			if (err)
+				die(_("unable to create thread: %s"), strerror(err));
+		}
+		for (int i = 0; i < nr_threads; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
+
+		disable_obj_read_lock();
+	}
+
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.mutex);
+
+	write_footer(&state);
+	trace2_region_leave("modgit", "ai-context", r);
+
+	for (size_t i = 0; i < state.window; i++)
+		strbuf_release(&state.slots[i].buf);
+	free(state.slots);
+	for (size_t i = 0; i < state.files_nr; i++)
+		free(state.files[i].path);
+	free(state.files);
+	for (size_t i = 0; i < state.omitted_nr; i++)
+		free(state.omitted[i].path);
+	free(state.omitted);
+
+	return state.err ? -1 : 0;
+}
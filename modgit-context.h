@@ -0,0 +1,48 @@
+#ifndef MODGIT_CONTEXT_H
+#define MODGIT_CONTEXT_H
+
+struct repository;
+struct strvec;
+
+enum modgit_context_format {
+	MODGIT_CONTEXT_MARKDOWN,
+	MODGIT_CONTEXT_JSON,
+};
+
+struct modgit_context_options {
+	enum modgit_context_format format;
+
+	/* Number of threads reading and formatting blobs; 0 means one per core. */
+	int nr_threads;
+
+	/*
+	 * If non-zero, only write the files that fit into this many bytes,
+	 * preferring recently changed and small files, and list the others.
+	 */
+	unsigned long budget;
+};
+
+#define MODGIT_CONTEXT_OPTIONS_INIT { .format = MODGIT_CONTEXT_MARKDOWN }
+
+/*
+ * Write the contents of all files below `paths` in the tree of `rev` to
+ * the standard output, formatted for consumption by a language model.
+ *
+ * Blobs are read and formatted by a pool of threads but written in path
+ * order. Large blobs are streamed, and a file is only buffered up to a
+ * fixed size before its thread waits for the files before it to be
+ * written, so memory use does not grow with the size of the module.
+ *
+ * With a budget, the sizes of the files are looked up in the object
+ * headers and their last change on the first-parent history of `rev`
+ * is found using the commit-graph, so that only the selected blobs are
+ * ever read.
+ *
+ * Returns 0 on success and -1 if `rev` cannot be read or some blob
+ * could not be read, which is reported.
+ */
+int write_module_context(struct repository *r, const char *module,
+			 const char *rev, const struct strvec *paths,
+			 const struct modgit_context_options *opts);
+
+#endif
@@ -0,0 +1,580 @@
+#include "git-compat-util.h"
+#include "modgit-graph.h"
+#include "modgit.h"
+#include "chunk-format.h"
+#include "csum-file.h"
+#include "gettext.h"
+#include "hash.h"
+#include "lockfile.h"
+#include "object-file.h"
+#include "object-name.h"
+#include "path.h"
+#include "repository.h"
+#include "strbuf.h"
+#include "strmap.h"
+#include "string-list.h"
+#include "strvec.h"
+#include "trace2.h"
+
+#define MODGIT_GRAPH_SIGNATURE 0x4d475248 /* "MGRH" */
+#define MODGIT_GRAPH_VERSION 1
+#define MODGIT_GRAPH_HEADER_SIZE 12
+#define MODGIT_GRAPH_CHUNK_ALIGNMENT 4
+
+#define MODGIT_GRAPH_CHUNKID_SOURCE 0x4d535243 /* "MSRC" */
+#define MODGIT_GRAPH_CHUNKID_NAME_OFFSETS 0x4d4e4f46 /* "MNOF" */
+#define MODGIT_GRAPH_CHUNKID_NAMES 0x4d4e414d /* "MNAM" */
+#define MODGIT_GRAPH_CHUNKID_NAME_HASH 0x4d485348 /* "MHSH" */
+#define MODGIT_GRAPH_CHUNKID_CLOSURE_INDEX 0x4d434c4f /* "MCLO" */
+#define MODGIT_GRAPH_CHUNKID_CLOSURE_PATHS 0x4d435054 /* "MCPT" */
+#define MODGIT_GRAPH_CHUNKID_PATHS 0x4d505448 /* "MPTH" */
+
+#define MODGIT_GRAPH_CYCLIC 0xffffffff
+
+static int modgit_graph_read_name_offsets(const unsigned char *chunk_start,
+					  size_t chunk_size, void *data)
+{
+	struct modgit_graph *g = data;
+
+	if (chunk_size != st_mult(g->num_modules, sizeof(uint32_t)))
+		return error(_("modgit-graph name offset chunk is the wrong size"));
+	g->chunk_name_offsets = chunk_start;
+	return 0;
+}
+
+static int modgit_graph_read_name_hash(const unsigned char *chunk_start,
+				       size_t chunk_size, void *data)
+{
+	struct modgit_graph *g = data;
+	size_t size = chunk_size / sizeof(uint32_t);
+
+	if (chunk_size % sizeof(uint32_t) || size > UINT32_MAX ||
+	    (size & (size - 1)) || size < g->num_modules)
+		return error(_("modgit-graph name hash chunk is the wrong size"));
+	g->chunk_name_hash = chunk_start;
+	g->name_hash_size = size;
+	return 0;
+}
+
+static int modgit_graph_read_closure_index(const unsigned char *chunk_start,
+					   size_t chunk_size, void *data)
+{
+	struct modgit_graph *g = data;
+
+	if (chunk_size != st_mult(g->num_modules, 2 * sizeof(uint32_t)))
+		return error(_("modgit-graph closure index chunk is the wrong size"));
+	g->chunk_closure_index = chunk_start;
+	return 0;
+}
+
+static int modgit_graph_read_closure_paths(const unsigned char *chunk_start,
+					   size_t chunk_size, void *data)
+{
+	struct modgit_graph *g = data;
+
+	if (chunk_size % sizeof(uint32_t))
+		return error(_("modgit-graph closure path chunk is the wrong size"));
+	g->chunk_closure_paths = chunk_start;
+	g->closure_paths_nr = chunk_size / sizeof(uint32_t);
+	return 0;
+}
+
+static int pair_string_chunk(struct chunkfile *cf, uint32_t chunk_id,
+			     const char **p, size_t *size)
+{
+	if (pair_chunk(cf, chunk_id, (const unsigned char **)p, size))
+		return -1;
+	/* Make sure that every offset into the chunk hits a NUL eventually. */
+	if (*size && (*p)[*size - 1])
+		return -1;
+	return 0;
+}
+
+struct modgit_graph *load_modgit_graph(struct repository *r,
+				       const struct object_id *source_oid)
+{
+	struct modgit_graph *g = NULL;
+	struct chunkfile *cf = NULL;
+	const unsigned char *source;
+	size_t source_len;
+	char *graph_name;
+	struct stat st;
+	void *data;
+	size_t data_len;
+	unsigned char num_chunks;
+	int fd;
+
+	graph_name = repo_git_path(r, MODGIT_GRAPH_FILE);
+	fd = git_open(graph_name);
+	free(graph_name);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+	data_len = xsize_t(st.st_size);
+	if (data_len < MODGIT_GRAPH_HEADER_SIZE + CHUNK_TOC_ENTRY_SIZE +
+		       r->hash_algo->rawsz) {
+		close(fd);
+		return NULL;
+	}
+	data = xmmap(NULL, data_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	CALLOC_ARRAY(g, 1);
+	g->data = data;
+	g->data_len = data_len;
+
+	if (get_be32(g->data) != MODGIT_GRAPH_SIGNATURE ||
+	    g->data[4] != MODGIT_GRAPH_VERSION ||
+	    g->data[5] != oid_version(r->hash_algo))
+		goto cleanup_fail;
+
+	num_chunks = g->data[6];
+	g->num_modules = get_be32(g->data + 8);
+
+	cf = init_chunkfile(NULL);
+	if (read_table_of_contents(cf, g->data, g->data_len,
+				   MODGIT_GRAPH_HEADER_SIZE, num_chunks,
+				   MODGIT_GRAPH_CHUNK_ALIGNMENT))
+		goto cleanup_fail;
+
+	if (pair_chunk(cf, MODGIT_GRAPH_CHUNKID_SOURCE, &source, &source_len) ||
+	    source_len != r->hash_algo->rawsz)
+		goto cleanup_fail;
+	oidread(&g->source_oid, source, r->hash_algo);
+
+	/* A stale graph is not an error; the caller simply rebuilds it. */
+	if (!oideq(&g->source_oid, source_oid)) {
+		free_chunkfile(cf);
+		close_modgit_graph(g);
+		return NULL;
+	}
+
+	if (read_chunk(cf, MODGIT_GRAPH_CHUNKID_NAME_OFFSETS,
+		       modgit_graph_read_name_offsets, g) ||
+	    read_chunk(cf, MODGIT_GRAPH_CHUNKID_NAME_HASH,
+		       modgit_graph_read_name_hash, g) ||
+	    read_chunk(cf, MODGIT_GRAPH_CHUNKID_CLOSURE_INDEX,
+		       modgit_graph_read_closure_index, g) ||
+	    read_chunk(cf, MODGIT_GRAPH_CHUNKID_CLOSURE_PATHS,
+		       modgit_graph_read_closure_paths, g) ||
+	    pair_string_chunk(cf, MODGIT_GRAPH_CHUNKID_NAMES,
+			      &g->chunk_names, &g->chunk_names_len) ||
+	    pair_string_chunk(cf, MODGIT_GRAPH_CHUNKID_PATHS,
+			      &g->chunk_paths, &g->chunk_paths_len))
+		goto cleanup_fail;
+
+	free_chunkfile(cf);
+	return g;
+
+cleanup_fail:
+	warning(_("ignoring corrupt modgit-graph file"));
+	free_chunkfile(cf);
+	close_modgit_graph(g);
+	return NULL;
+}
+
+void close_modgit_graph(struct modgit_graph *g)
+{
+	if (!g)
+		return;
+	munmap((void *)g->data, g->data_len);
+	free(g);
+}
+
+static const char *modgit_graph_name(struct modgit_graph *g, uint32_t pos)
+{
+	uint32_t offset = get_be32(g->chunk_name_offsets + st_mult(pos, sizeof(uint32_t)));
+
+	if (offset >= g->chunk_names_len)
+		return NULL;
+	return g->chunk_names + offset;
+}
+
+/*
+ * Find the module called `name` in `g`. Returns its position, or -1 if
+ * there is no such module.
+ */
+static int64_t modgit_graph_lookup(struct modgit_graph *g, const char *name)
+{
+	uint32_t mask = g->name_hash_size - 1;
+	uint32_t slot = strhash(name) & mask;
+
+	for (uint32_t i = 0; i < g->name_hash_size; i++, slot = (slot + 1) & mask) {
+		uint32_t entry = get_be32(g->chunk_name_hash +
+					  st_mult(slot, sizeof(uint32_t)));
+		const char *candidate;
+
+		if (!entry || entry > g->num_modules)
+			return -1;
+
+		candidate = modgit_graph_name(g, entry - 1);
+		if (candidate && !strcmp(candidate, name))
+			return entry - 1;
+	}
+	return -1;
+}
+
+/*
+ * Append the closure of the module at `pos` to `paths`. Returns -1 if
+ * the module is cyclic, or if the graph is corrupt.
+ */
+static int modgit_graph_closure(struct modgit_graph *g, uint32_t pos,
+				struct strvec *paths)
+{
+	const unsigned char *index = g->chunk_closure_index +
+				     st_mult(pos, 2 * sizeof(uint32_t));
+	uint32_t start = get_be32(index);
+	uint32_t nr = get_be32(index + sizeof(uint32_t));
+	size_t orig_nr = paths->nr;
+
+	if (nr == MODGIT_GRAPH_CYCLIC)
+		return -1;
+	if (start > g->closure_paths_nr || nr > g->closure_paths_nr - start)
+		return -1;
+
+	for (uint32_t i = 0; i < nr; i++) {
+		uint32_t offset = get_be32(g->chunk_closure_paths +
+					   st_mult(start + i, sizeof(uint32_t)));
+
+		if (offset >= g->chunk_paths_len) {
+			while (paths->nr > orig_nr)
+				strvec_pop(paths);
+			return -1;
+		}
+		strvec_push(paths, g->chunk_paths + offset);
+	}
+	return 0;
+}
+
+struct write_modgit_graph_context {
+	struct module_graph *graph;
+	const struct object_id *source_oid;
+	const struct git_hash_algo *algop;
+
+	uint32_t *name_hash;
+	size_t name_hash_size;
+	size_t names_len;
+
+	/* All distinct closure paths, and their offsets in MPTH. */
+	struct string_list paths;
+	struct strintmap path_offsets;
+	size_t paths_len;
+	size_t closure_paths_nr;
+};
+
+static int write_modgit_graph_source(struct hashfile *f, void *data)
+{
+	struct write_modgit_graph_context *ctx = data;
+
+	hashwrite(f, ctx->source_oid->hash, ctx->algop->rawsz);
+	return 0;
+}
+
+static int write_modgit_graph_name_offsets(struct hashfile *f, void *data)
+{
+	struct write_modgit_graph_context *ctx = data;
+	uint32_t offset = 0;
+
+	for (size_t i = 0; i < ctx->graph->modules_nr; i++) {
+		hashwrite_be32(f, offset);
+		offset += strlen(ctx->graph->modules[i]->name) + 1;
+	}
+	return 0;
+}
+
+static size_t padding_len(size_t len)
+{
+	return (MODGIT_GRAPH_CHUNK_ALIGNMENT - len % MODGIT_GRAPH_CHUNK_ALIGNMENT) %
+		MODGIT_GRAPH_CHUNK_ALIGNMENT;
+}
+
+/*
+ * The string chunks are padded with NULs so that the chunks following
+ * them stay aligned.
+ */
+static void write_padding(struct hashfile *f, size_t len)
+{
+	static const unsigned char padding[MODGIT_GRAPH_CHUNK_ALIGNMENT];
+
+	hashwrite(f, padding, padding_len(len));
+}
+
+static int write_modgit_graph_names(struct hashfile *f, void *data)
+{
+	struct write_modgit_graph_context *ctx = data;
+
+	for (size_t i = 0; i < ctx->graph->modules_nr; i++) {
+		const char *name = ctx->graph->modules[i]->name;
+		hashwrite(f, name, strlen(name) + 1);
+	}
+	write_padding(f, ctx->names_len);
+	return 0;
+}
+
+static int write_modgit_graph_name_hash(struct hashfile *f, void *data)
+{
+	struct write_modgit_graph_context *ctx = data;
+
+	for (size_t i = 0; i < ctx->name_hash_size; i++)
+		hashwrite_be32(f, ctx->name_hash[i]);
+	return 0;
+}
+
+static int write_modgit_graph_closure_index(struct hashfile *f, void *data)
+{
+	struct write_modgit_graph_context *ctx = data;
+	uint32_t start = 0;
+
+	for (size_t i = 0; i < ctx->graph->modules_nr; i++) {
+		struct module_def *mod = ctx->graph->modules[i];
+
+		hashwrite_be32(f, start);
+		if (!mod->closure_valid) {
+			hashwrite_be32(f, MODGIT_GRAPH_CYCLIC);
+			continue;
+		}
+		hashwrite_be32(f, mod->closure_nr);
+		start += mod->closure_nr;
+	}
+	return 0;
+}
+
+static int write_modgit_graph_closure_paths(struct hashfile *f, void *data)
+{
+	struct write_modgit_graph_context *ctx = data;
+
+	for (size_t i = 0; i < ctx->graph->modules_nr; i++) {
+		struct module_def *mod = ctx->graph->modules[i];
+
+		if (!mod->closure_valid)
+			continue;
+		for (size_t j = 0; j < mod->closure_nr; j++)
+			hashwrite_be32(f, strintmap_get(&ctx->path_offsets,
+							mod->closure[j]));
+	}
+	return 0;
+}
+
+static int write_modgit_graph_paths(struct hashfile *f, void *data)
+{
+	struct write_modgit_graph_context *ctx = data;
+
+	for (size_t i = 0; i < ctx->paths.nr; i++) {
+		const char *path = ctx->paths.items[i].string;
+		hashwrite(f, path, strlen(path) + 1);
+	}
+	write_padding(f, ctx->paths_len);
+	return 0;
+}
+
+static void prepare_modgit_graph(struct write_modgit_graph_context *ctx)
+{
+	struct module_graph *graph = ctx->graph;
+	uint32_t mask;
+
+	ctx->name_hash_size = 1;
+	while (ctx->name_hash_size < 2 * graph->modules_nr)
+		ctx->name_hash_size <<= 1;
+	CALLOC_ARRAY(ctx->name_hash, ctx->name_hash_size);
+	mask = ctx->name_hash_size - 1;
+
+	for (size_t i = 0; i < graph->modules_nr; i++) {
+		struct module_def *mod = graph->modules[i];
+		uint32_t slot = strhash(mod->name) & mask;
+
+		while (ctx->name_hash[slot])
+			slot = (slot + 1) & mask;
+		ctx->name_hash[slot] = i + 1;
+		ctx->names_len += strlen(mod->name) + 1;
+
+		if (!mod->closure_valid)
+			continue;
+
+		for (size_t j = 0; j < mod->closure_nr; j++) {
+			const char *path = mod->closure[j];
+
+			if (!strintmap_contains(&ctx->path_offsets, path)) {
+				strintmap_set(&ctx->path_offsets, path,
+					      ctx->paths_len);
+				string_list_append(&ctx->paths, path);
+				ctx->paths_len += strlen(path) + 1;
+			}
+		}
+		ctx->closure_paths_nr += mod->closure_nr;
+	}
+}
+
+int write_modgit_graph(struct repository *r, struct module_graph *graph,
+		       const struct object_id *source_oid)
+{
+	struct write_modgit_graph_context ctx = {
+		.graph = graph,
+		.source_oid = source_oid,
+		.algop = r->hash_algo,
+		.paths = STRING_LIST_INIT_NODUP,
+	};
+	struct lock_file lk = LOCK_INIT;
+	struct chunkfile *cf;
+	struct hashfile *f;
+	char *graph_name;
+	int ret = 0;
+
+	graph_name = repo_git_path(r, MODGIT_GRAPH_FILE);
+	if (hold_lock_file_for_update(&lk, graph_name, 0) < 0) {
+		/* Somebody else is writing it, or $GIT_DIR is read-only. */
+		free(graph_name);
+		return -1;
+	}
+	free(graph_name);
+
+	trace2_region_enter("modgit", "write-graph", r);
+
+	strintmap_init(&ctx.path_offsets, -1);
+	prepare_modgit_graph(&ctx);
+
+	f = hashfd(r->hash_algo, get_lock_file_fd(&lk), get_lock_file_path(&lk));
+	cf = init_chunkfile(f);
+
+	add_chunk(cf, MODGIT_GRAPH_CHUNKID_SOURCE, r->hash_algo->rawsz,
+		  write_modgit_graph_source);
+	add_chunk(cf, MODGIT_GRAPH_CHUNKID_NAME_OFFSETS,
+		  st_mult(graph->modules_nr, sizeof(uint32_t)),
+		  write_modgit_graph_name_offsets);
+	add_chunk(cf, MODGIT_GRAPH_CHUNKID_NAME_HASH,
+		  st_mult(ctx.name_hash_size, sizeof(uint32_t)),
+		  write_modgit_graph_name_hash);
+	add_chunk(cf, MODGIT_GRAPH_CHUNKID_CLOSURE_INDEX,
+		  st_mult(graph->modules_nr, 2 * sizeof(uint32_t)),
+		  write_modgit_graph_closure_index);
+	add_chunk(cf, MODGIT_GRAPH_CHUNKID_CLOSURE_PATHS,
+		  st_mult(ctx.closure_paths_nr, sizeof(uint32_t)),
+		  write_modgit_graph_closure_paths);
+	add_chunk(cf, MODGIT_GRAPH_CHUNKID_NAMES,
+		  st_add(ctx.names_len, padding_len(ctx.names_len)),
+		  write_modgit_graph_names);
+	add_chunk(cf, MODGIT_GRAPH_CHUNKID_PATHS,
+		  st_add(ctx.paths_len, padding_len(ctx.paths_len)),
+		  write_modgit_graph_paths);
+
+	hashwrite_be32(f, MODGIT_GRAPH_SIGNATURE);
+	hashwrite_u8(f, MODGIT_GRAPH_VERSION);
+	hashwrite_u8(f, oid_version(r->hash_algo));
+	hashwrite_u8(f, get_num_chunks(cf));
+	hashwrite_u8(f, 0); /* unused padding byte */
+	hashwrite_be32(f, graph->modules_nr);
+
+	if (write_chunkfile(cf, &ctx))
+		ret = -1;
+
+	finalize_hashfile(f, NULL, FSYNC_COMPONENT_NONE,
+			  CSUM_HASH_IN_STREAM);
+	free_chunkfile(cf);
+
+	if (ret < 0)
+		rollback_lock_file(&lk);
+	else if (commit_lock_file(&lk) < 0)
+		ret = error_errno(_("unable to write modgit-graph file"));
+
+	trace2_region_leave("modgit", "write-graph", r);
+
+	free(ctx.name_hash);
+	string_list_clear(&ctx.paths, 0);
+	strintmap_clear(&ctx.path_offsets);
+	return ret;
+}
+
+/*
+ * Look up the closure of `name` in the .modgit blob `blob`, or in the
+ * .modgit at the top of the worktree if `blob` is NULL.
+ */
+static int lookup_closure(struct repository *r, const char *name,
+			  const struct object_id *blob, struct strvec *paths)
+{
+	struct strbuf buf = STRBUF_INIT;
+	struct object_id source_oid;
+	struct module_graph graph;
+	struct module_def *mod;
+	int have_source = 0, write_graph = 0;
+	int ret;
+
+	if (r && !r->gitdir)
+		r = NULL;
+
+	if (blob) {
+		oidcpy(&source_oid, blob);
+		have_source = 1;
+	} else if (r && strbuf_read_file(&buf, MODGIT_FILE, 0) >= 0) {
+		hash_object_file(r->hash_algo, buf.buf, buf.len, OBJ_BLOB,
+				 &source_oid);
+		have_source = 1;
+	}
+	strbuf_release(&buf);
+
+	if (have_source) {
+		struct modgit_graph *g = load_modgit_graph(r, &source_oid);
+
+		if (g) {
+			int64_t pos = modgit_graph_lookup(g, name);
+
+			ret = pos < 0 ? MODULE_NOT_FOUND :
+				modgit_graph_closure(g, pos, paths);
+			close_modgit_graph(g);
+
+			/*
+			 * Cyclic modules are resolved again from .modgit
+			 * below, which reports the cycle.
+			 */
+			if (ret != -1)
+				return ret;
+		} else {
+			write_graph = 1;
+		}
+	}
+
+	trace2_region_enter("modgit", "parse", r);
+	module_graph_init(&graph);
+	if (blob)
+		module_graph_load_blob(&graph, r, blob);
+	else
+		module_graph_load(&graph, MODGIT_FILE);
+	trace2_region_leave("modgit", "parse", r);
+
+	if (write_graph) {
+		module_graph_resolve_all(&graph);
+		write_modgit_graph(r, &graph, &source_oid);
+	}
+
+	mod = module_graph_lookup(&graph, name);
+	if (!mod)
+		ret = MODULE_NOT_FOUND;
+	else
+		ret = resolve_dependencies(&graph, mod, paths);
+
+	module_graph_release(&graph);
+	return ret;
+}
+
+int lookup_module_closure(struct repository *r, const char *name,
+			  struct strvec *paths)
+{
+	return lookup_closure(r, name, NULL, paths);
+}
+
+int lookup_module_closure_rev(struct repository *r, const char *rev,
+			      const char *name, struct strvec *paths)
+{
+	struct strbuf spec = STRBUF_INIT;
+	struct object_id oid;
+	int ret;
+
+	strbuf_addf(&spec, "%s:%s", rev, MODGIT_FILE);
+	if (repo_get_oid(r, spec.buf, &oid))
+		ret = MODULE_NOT_FOUND;
+	else
+		ret = lookup_closure(r, name, &oid, paths);
+	strbuf_release(&spec);
+	return ret;
+}
@@ -0,0 +1,91 @@
+#ifndef MODGIT_GRAPH_H
+#define MODGIT_GRAPH_H
+
+#include "hash.h"
+
+struct module_graph;
+struct repository;
+struct strvec;
+
+/*
+ * The modgit-graph file in $GIT_DIR stores the resolved closure of every
+ * module defined by .modgit, so that looking up the paths of a module
+ * neither parses .modgit nor walks its dependencies. The file records the
+ * blob OID of the .modgit it was compiled from and is only used while the
+ * worktree copy of .modgit still hashes to that OID.
+ *
+ * It uses the chunk-based format of the commit-graph and multi-pack-index
+ * files. After a 12-byte header (signature "MGRH", version, hash version,
+ * number of chunks, a reserved byte and the number of modules) it contains:
+ *
+ *   MSRC: the blob OID of the source .modgit.
+ *   MNOF: for each module, the offset of its name in MNAM.
+ *   MNAM: the NUL-terminated module names, in .modgit order.
+ *   MHSH: an open-addressing table of strhash(name), holding one plus the
+ *	   position of the module, or zero for an empty slot.
+ *   MCLO: for each module, the position of its first closure entry in MCPT
+ *	   and the number of entries, or 0xffffffff if the dependencies of
+ *	   the module form a cycle.
+ *   MCPT: offsets into MPTH of the closure paths of all modules.
+ *   MPTH: the NUL-terminated, deduplicated closure paths.
+ */
+#define MODGIT_GRAPH_FILE "modgit-graph"
+
+struct modgit_graph {
+	const unsigned char *data;
+	size_t data_len;
+
+	uint32_t num_modules;
+	struct object_id source_oid;
+
+	const unsigned char *chunk_name_offsets;
+	const char *chunk_names;
+	size_t chunk_names_len;
+	const unsigned char *chunk_name_hash;
+	uint32_t name_hash_size;
+	const unsigned char *chunk_closure_index;
+	const unsigned char *chunk_closure_paths;
+	size_t closure_paths_nr;
+	const char *chunk_paths;
+	size_t chunk_paths_len;
+};
+
+/*
+ * Map $GIT_DIR/modgit-graph of `r`. Returns NULL if the file does not
+ * exist, is corrupt, or was compiled from a .modgit other than the one
+ * with the blob OID `source_oid`.
+ */
+struct modgit_graph *load_modgit_graph(struct repository *r,
+				       const struct object_id *source_oid);
+void close_modgit_graph(struct modgit_graph *g);
+
+/*
+ * Compile the closures of all modules in `graph`, which was parsed from a
+ * .modgit with the blob OID `source_oid`, into $GIT_DIR/modgit-graph.
+ */
+int write_modgit_graph(struct repository *r, struct module_graph *graph,
+		       const struct object_id *source_oid);
+
+/*
+ * Append the closure of the module `name`, as defined by the .modgit at
+ * the top of the worktree, to `paths`. The closure is read from the
+ * modgit-graph file of `r` when that is up to date; otherwise .modgit is
+ * parsed and the modgit-graph file rewritten. `r` may be NULL, in which
+ * case .modgit is always parsed.
+ *
+ * Returns MODULE_NOT_FOUND if there is no such module, and -1 if its
+ * dependencies form a cycle, which is reported.
+ */
+#define MODULE_NOT_FOUND (-2)
+int lookup_module_closure(struct repository *r, const char *name,
+			  struct strvec *paths);
+
+/*
+ * Like lookup_module_closure(), but use the .modgit committed in the
+ * revision `rev` of `r`, which must not be NULL. A missing .modgit is
+ * reported as MODULE_NOT_FOUND.
+ */
+int lookup_module_closure_rev(struct repository *r, const char *rev,
+			      const char *name, struct strvec *paths);
+
+#endif
@@ -0,0 +1,145 @@
+#include "git-compat-util.h"
+#include "modgit-permissions.h"
+#include "commit.h"
+#include "diff.h"
+#include "diffcore.h"
+#include "gettext.h"
+#include "hex.h"
+#include "ident.h"
+#include "modgit.h"
+#include "object-name.h"
+#include "repository.h"
+#include "revision.h"
+#include "strbuf.h"
+#include "strvec.h"
+
+int modgit_check_tree_change(struct repository *r,
+			     const struct module_trie *trie,
+			     const struct object_id *old_tree,
+			     const struct object_id *new_tree,
+			     const char *email, struct strbuf *err)
+{
+	struct module_list owners = MODULE_LIST_INIT;
+	struct diff_options diffopt;
+	int ret = 0;
+
+	repo_diff_setup(r, &diffopt);
+	diffopt.flags.recursive = 1;
+	diffopt.output_format = DIFF_FORMAT_NO_OUTPUT;
+	diff_setup_done(&diffopt);
+
+	diff_tree_oid(old_tree, new_tree, "", &diffopt);
+	for (int i = 0; !ret && i < diff_queued_diff.nr; i++) {
+		struct diff_filepair *p = diff_queued_diff.queue[i];
+
+		owners.nr = 0;
+		module_trie_lookup(trie, p->two->path, &owners);
+		for (size_t j = 0; j < owners.nr; j++) {
+			const struct module_def *module = owners.items[j];
+
+			if (module_allows_change(module, email))
+				continue;
+			if (module->read_only)
+				strbuf_addf(err, _("'%s' belongs to the read-only module '%s'"),
+					    p->two->path, module->name);
+			else
+				strbuf_addf(err, _("'%s' belongs to the module '%s', which only its owners may change"),
+					    p->two->path, module->name);
+			ret = -1;
+			break;
+		}
+	}
+	diff_queue_clear(&diff_queued_diff);
+	diff_free(&diffopt);
+	module_list_clear(&owners);
+	return ret;
+}
+
+static int load_permissions(struct repository *r, const char *rev,
+			    struct module_graph *graph, struct module_trie *trie)
+{
+	struct strbuf spec = STRBUF_INIT;
+	struct object_id oid;
+	int found;
+
+	strbuf_addf(&spec, "%s:%s", rev, MODGIT_FILE);
+	found = !repo_get_oid(r, spec.buf, &oid);
+	strbuf_release(&spec);
+	if (!found || module_graph_load_blob(graph, r, &oid) < 0)
+		return 0;
+
+	module_trie_build(trie, graph, 1);
+	return !!trie->modules_nr;
+}
+
+/* Copy the e-mail of the committer of `commit` into `email`. */
+static void committer_email(struct repository *r, struct commit *commit,
+			    struct strbuf *email)
+{
+	const char *buffer = repo_get_commit_buffer(r, commit, NULL);
+	struct ident_split ident;
+	const char *line;
+	size_t len;
+
+	strbuf_reset(email);
+	line = find_commit_header(buffer, "committer", &len);
+	if (line && !split_ident_line(&ident, line, len))
+		strbuf_add(email, ident.mail_begin,
+			   ident.mail_end - ident.mail_begin);
+	repo_unuse_commit_buffer(r, commit, buffer);
+}
+
+int modgit_check_push(struct repository *r, const struct object_id *old_oid,
+		      const struct object_id *new_oid, struct strbuf *err)
+{
+	struct module_graph graph;
+	struct module_trie trie = MODULE_TRIE_INIT;
+	struct rev_info revs;
+	struct strvec args = STRVEC_INIT;
+	struct strbuf email = STRBUF_INIT;
+	struct commit *commit;
+	int ret = 0;
+
+	module_graph_init(&graph);
+	if (!load_permissions(r, is_null_oid(old_oid) ? "HEAD" : oid_to_hex(old_oid),
+			      &graph, &trie))
+		goto out;
+
+	repo_init_revisions(r, &revs, NULL);
+	strvec_pushl(&args, "rev-list", oid_to_hex(new_oid), "--not", "--all", NULL);
+	setup_revisions_from_strvec(&args, &revs, NULL);
+	if (prepare_revision_walk(&revs)) {
+		strbuf_addstr(err, _("revision walk setup failed"));
+		ret = -1;
+	}
+
+	while (!ret && (commit = get_revision(&revs))) {
+		struct commit *parent = commit->parents ? commit->parents->item : NULL;
+
+		if (parent && repo_parse_commit(r, parent)) {
+			strbuf_addf(err, _("unable to parse commit %s"),
+				    oid_to_hex(&parent->object.oid));
+			ret = -1;
+			break;
+		}
+		committer_email(r, commit, &email);
+		if (modgit_check_tree_change(r, &trie,
+					     parent ? get_commit_tree_oid(parent) : NULL,
+					     get_commit_tree_oid(commit),
+					     email.buf, err)) {
+			strbuf_addf(err, _(" (commit %s by <%s>)"),
+				    oid_to_hex(&commit->object.oid),
+				    email.buf);
+			ret = -1;
+		}
+	}
+
+	reset_revision_walk();
+	release_revisions(&revs);
+out:
+	strvec_clear(&args);
+	strbuf_release(&email);
+	module_trie_clear(&trie);
+	module_graph_release(&graph);
+	return ret;
+}
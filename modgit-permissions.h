@@ -0,0 +1,39 @@
+#ifndef MODGIT_PERMISSIONS_H
+#define MODGIT_PERMISSIONS_H
+
+struct module_trie;
+struct object_id;
+struct repository;
+struct strbuf;
+
+/*
+ * Check that the committer with the e-mail `email` may make the changes
+ * between the trees `old_tree` (the empty tree if NULL) and `new_tree`.
+ * `trie` holds the restricted modules of the .modgit that applies, as
+ * built by module_trie_build(). Each changed path is looked up in the
+ * trie, so the cost does not grow with the number of modules.
+ *
+ * Returns 0 if the change is allowed. Otherwise describes the first
+ * forbidden path in `err` and returns -1.
+ */
+int modgit_check_tree_change(struct repository *r,
+			     const struct module_trie *trie,
+			     const struct object_id *old_tree,
+			     const struct object_id *new_tree,
+			     const char *email, struct strbuf *err);
+
+/*
+ * Check that the commits a push would add to `r` by updating a ref from
+ * `old_oid` to `new_oid` respect the permissions of the modules. The
+ * .modgit of `old_oid` applies, or that of HEAD if the ref is created,
+ * so that a push cannot lift a restriction in the same go. Each commit
+ * not yet reachable from any ref is checked against its first parent
+ * with the e-mail of its committer.
+ *
+ * Returns 0 if the push is allowed. Otherwise describes the offending
+ * commit in `err` and returns -1.
+ */
+int modgit_check_push(struct repository *r, const struct object_id *old_oid,
+		      const struct object_id *new_oid, struct strbuf *err);
+
+#endif
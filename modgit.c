@@ -1,128 +1,573 @@
 #include "git-compat-util.h"
 #include "modgit.h"
 #include "config.h"
+#include "dir.h"
+#include "gettext.h"
+#include "path.h"
+#include "strbuf.h"
+#include "string-list.h"
 #include "strvec.h"
+#include "ewah/ewok.h"
 
-static struct module_def *current_module = NULL;
-static const char *target_module_name = NULL;
-
-static int modgit_config_cb(const char *var, const char *value, void *data)
-{
-    const char *subkey;
-    
-    if (!skip_prefix(var, "module.", &var))
-        return 0;
-    
-    // Check if this config belongs to the module we are looking for
-    // format: module.<name>.<key>
-    const char *dot = strrchr(var, '.');
-    if (!dot) return 0;
-    
-    size_t name_len = dot - var;
-    if (strncmp(var, target_module_name, name_len) || target_module_name[name_len] != '\0')
-        return 0;
-        
-    subkey = dot + 1;
-    
-    if (!strcmp(subkey, "path")) {
-        strvec_push(&current_module->paths, value);
-    } else if (!strcmp(subkey, "depends")) {
-        strvec_push(&current_module->depends_on, value);
-    }
-    
-    return 0;
-}
-
-struct module_def *load_module_def(const char *module_name)
-{
-    current_module = xcalloc(1, sizeof(struct module_def));
-    current_module->name = xstrdup(module_name);
-    strvec_init(&current_module->paths);
-    strvec_init(&current_module->depends_on);
-    
-    target_module_name = module_name;
-    
-    // Read from .modgit file in root
-    // We assume the file is in Git config format
-    git_config_from_file(modgit_config_cb, ".modgit", NULL);
-    
-    if (current_module->paths.nr == 0) {
-        // Module not found or empty
-        // TODO: Handle error properly
-    }
-    
-    return current_module;
-}
-
-void free_module_def(struct module_def *module)
-{
-    if (!module) return;
-    free(module->name);
-    strvec_clear(&module->paths);
-    strvec_clear(&module->depends_on);
-    free(module);
-}
-
-void resolve_dependencies(struct module_def *module, struct strvec *all_paths)
-{
-    // Add current module paths
-    for (int i = 0; i < module->paths.nr; i++) {
-        strvec_push(all_paths, module->paths.v[i]);
-    }
-
-    // Recursively resolve dependencies
-    for (int i = 0; i < module->depends_on.nr; i++) {
-        struct module_def *dep = load_module_def(module->depends_on.v[i]);
-        if (dep) {
-            resolve_dependencies(dep, all_paths);
-            free_module_def(dep);
-        } else {
-            warning("Dependency '%s' not found for module '%s'", 
-                    module->depends_on.v[i], module->name);
-        }
-    }
-}
-
-static int list_modules_cb(const char *var, const char *value, void *data)
-{
-    struct strvec *names = data;
-    const char *subkey;
-
-    if (!skip_prefix(var, "module.", &var))
-        return 0;
-
-    const char *dot = strrchr(var, '.');
-    if (!dot) return 0;
-
-    size_t name_len = dot - var;
-    // We strictly want the name, so we check if we already have it
-    // But since we can't easily check for duplicates in strvec without iterating,
-    // we will rely on checking if the key is 'path' to only add it once per module definition
-    // assuming valid config module.<name>.path exists.
-    
-    subkey = dot + 1;
-    if (strcmp(subkey, "path"))
-        return 0;
-        
-    char *name = xmemdupz(var, name_len);
-    
-    // Check duplicates
-    int found = 0;
-    for (int i = 0; i < names->nr; i++) {
-        if (!strcmp(names->v[i], name)) {
-            found = 1;
-            break;
-        }
-    }
-    
-    if (!found)
-        strvec_push(names, name);
-        
-    free(name);
-    return 0;
-}
-
-void list_modules(struct strvec *names)
-{
-    git_config_from_file(list_modules_cb, ".modgit", names);
+/*
+ * While the .modgit file is being parsed, the paths and dependency names
+ * of a module are collected in lists allocated from the graph's pool. They
+ * are flattened into the arrays of `struct module_def` once the whole file
+ * has been read, when all dependency names can be resolved.
+ */
+struct module_item {
+	struct module_item *next;
+	const char *value;
+};
+
+struct module_builder {
+	struct module_def def;
+
+	struct module_item *paths, **paths_tail;
+	struct module_item *deps, **deps_tail;
+	struct module_item *owners, **owners_tail;
+	size_t paths_nr, deps_nr, owners_nr;
+};
+
+static int module_def_cmp(const void *cmp_data UNUSED,
+			  const struct hashmap_entry *eptr,
+			  const struct hashmap_entry *entry_or_key,
+			  const void *keydata)
+{
+	const struct module_def *a, *b;
+
+	a = container_of(eptr, const struct module_def, ent);
+	b = container_of(entry_or_key, const struct module_def, ent);
+
+	return strcmp(a->name, keydata ? keydata : b->name);
+}
+
+void module_graph_init(struct module_graph *graph)
+{
+	memset(graph, 0, sizeof(*graph));
+	hashmap_init(&graph->map, module_def_cmp, NULL, 0);
+	mem_pool_init(&graph->pool, 0);
+}
+
+struct module_def *module_graph_lookup(struct module_graph *graph,
+				       const char *name)
+{
+	return hashmap_get_entry_from_hash(&graph->map, strhash(name), name,
+					   struct module_def, ent);
+}
+
+static struct module_builder *module_builder_get(struct module_graph *graph,
+						 const char *name)
+{
+	struct module_def *mod = module_graph_lookup(graph, name);
+	struct module_builder *mb;
+
+	if (mod)
+		return container_of(mod, struct module_builder, def);
+
+	mb = mem_pool_calloc(&graph->pool, 1, sizeof(*mb));
+	mb->def.name = mem_pool_strdup(&graph->pool, name);
+	mb->def.index = graph->modules_nr;
+	mb->paths_tail = &mb->paths;
+	mb->deps_tail = &mb->deps;
+	mb->owners_tail = &mb->owners;
+
+	hashmap_entry_init(&mb->def.ent, strhash(mb->def.name));
+	hashmap_add(&graph->map, &mb->def.ent);
+	ALLOC_GROW(graph->modules, graph->modules_nr + 1, graph->modules_alloc);
+	graph->modules[graph->modules_nr++] = &mb->def;
+
+	return mb;
+}
+
+static void module_item_append(struct mem_pool *pool,
+			       struct module_item ***tail, const char *value)
+{
+	struct module_item *item = mem_pool_calloc(pool, 1, sizeof(*item));
+
+	item->value = mem_pool_strdup(pool, value);
+	**tail = item;
+	*tail = &item->next;
+}
+
+static int module_graph_config(const char *var, const char *value,
+			       const struct config_context *ctx UNUSED,
+			       void *data)
+{
+	struct module_graph *graph = data;
+	struct module_builder *mb;
+	struct strbuf name = STRBUF_INIT;
+	const char *subsection, *key;
+	size_t subsection_len;
+	int is_bool;
+
+	if (parse_config_key(var, "module", &subsection, &subsection_len, &key) < 0 ||
+	    !subsection)
+		return 0;
+
+	is_bool = !strcmp(key, "readonly") || !strcmp(key, "ownersonly");
+	if (!is_bool && strcmp(key, "path") && strcmp(key, "depends") &&
+	    strcmp(key, "owner"))
+		return 0;
+	if (!is_bool && !value)
+		return config_error_nonbool(var);
+
+	strbuf_add(&name, subsection, subsection_len);
+	mb = module_builder_get(graph, name.buf);
+	strbuf_release(&name);
+
+	if (!strcmp(key, "readonly")) {
+		mb->def.read_only = git_config_bool(var, value);
+		return 0;
+	}
+	if (!strcmp(key, "ownersonly")) {
+		mb->def.owners_only = git_config_bool(var, value);
+		return 0;
+	}
+	if (!strcmp(key, "owner")) {
+		module_item_append(&graph->pool, &mb->owners_tail, value);
+		mb->owners_nr++;
+		return 0;
+	}
+
+	if (!strcmp(key, "path")) {
+		char *path = xmalloc(strlen(value) + 1);
+
+		/*
+		 * Store paths in canonical form, without "./", "//" or
+		 * trailing slashes, so that closures can be compared and
+		 * collapsed textually.
+		 */
+		if (normalize_path_copy(path, value) < 0 || !*path ||
+		    !strcmp(path, "/")) {
+			warning(_("ignoring invalid path '%s' of module '%s'"),
+				value, mb->def.name);
+			free(path);
+			return 0;
+		}
+		strip_dir_trailing_slashes(path);
+		module_item_append(&graph->pool, &mb->paths_tail,
+				   path + (*path == '/'));
+		mb->paths_nr++;
+		free(path);
+	} else {
+		module_item_append(&graph->pool, &mb->deps_tail, value);
+		mb->deps_nr++;
+	}
+
+	return 0;
+}
+
+static void module_graph_finalize(struct module_graph *graph)
+{
+	for (size_t i = 0; i < graph->modules_nr; i++) {
+		struct module_def *mod = graph->modules[i];
+		struct module_builder *mb;
+		struct module_item *item;
+
+		mb = container_of(mod, struct module_builder, def);
+
+		mod->paths = mem_pool_calloc(&graph->pool, mb->paths_nr,
+					     sizeof(*mod->paths));
+		for (item = mb->paths; item; item = item->next)
+			mod->paths[mod->paths_nr++] = item->value;
+
+		mod->owners = mem_pool_calloc(&graph->pool, mb->owners_nr,
+					      sizeof(*mod->owners));
+		for (item = mb->owners; item; item = item->next)
+			mod->owners[mod->owners_nr++] = item->value;
+
+		mod->deps = mem_pool_calloc(&graph->pool, mb->deps_nr,
+					    sizeof(*mod->deps));
+		for (item = mb->deps; item; item = item->next) {
+			struct module_def *dep = module_graph_lookup(graph, item->value);
+
+			if (!dep) {
+				warning(_("module '%s' depends on unknown module '%s'"),
+					mod->name, item->value);
+				continue;
+			}
+			mod->deps[mod->deps_nr++] = dep;
+		}
+	}
+}
+
+int module_graph_load(struct module_graph *graph, const char *path)
+{
+	if (git_config_from_file(module_graph_config, path, graph) < 0)
+		return -1;
+
+	module_graph_finalize(graph);
+	return 0;
+}
+
+int module_graph_load_blob(struct module_graph *graph, struct repository *r,
+			   const struct object_id *oid)
+{
+	if (git_config_from_blob_oid(module_graph_config, MODGIT_FILE, r, oid,
+				     graph, CONFIG_SCOPE_UNKNOWN) < 0)
+		return -1;
+
+	module_graph_finalize(graph);
+	return 0;
+}
+
+void module_graph_release(struct module_graph *graph)
+{
+	hashmap_clear(&graph->map);
+	mem_pool_discard(&graph->pool, 0);
+	FREE_AND_NULL(graph->modules);
+	graph->modules_nr = graph->modules_alloc = 0;
+}
+
+void module_list_append(struct module_list *list, struct module_def *module)
+{
+	ALLOC_GROW(list->items, list->nr + 1, list->alloc);
+	list->items[list->nr++] = module;
+}
+
+void module_list_clear(struct module_list *list)
+{
+	FREE_AND_NULL(list->items);
+	list->nr = list->alloc = 0;
+}
+
+struct topo_walk {
+	struct bitmap *done;
+	struct bitmap *on_stack;
+	struct module_list stack;
+	struct module_list *out;
+
+	/* Do not descend into modules whose closure is already known. */
+	unsigned skip_resolved : 1;
+	unsigned quiet : 1;
+};
+
+static void topo_walk_init(struct topo_walk *walk, struct module_graph *graph,
+			   struct module_list *out)
+{
+	size_t words = DIV_ROUND_UP(graph->modules_nr, BITS_IN_EWORD);
+
+	memset(walk, 0, sizeof(*walk));
+	walk->done = bitmap_word_alloc(words);
+	walk->on_stack = bitmap_word_alloc(words);
+	walk->out = out;
+}
+
+static void topo_walk_release(struct topo_walk *walk)
+{
+	bitmap_free(walk->done);
+	bitmap_free(walk->on_stack);
+	module_list_clear(&walk->stack);
+}
+
+static void report_cycle(struct topo_walk *walk, struct module_def *module)
+{
+	struct strbuf chain = STRBUF_INIT;
+	size_t i = walk->stack.nr;
+
+	while (i && walk->stack.items[i - 1] != module)
+		i--;
+	for (i = i ? i - 1 : 0; i < walk->stack.nr; i++)
+		strbuf_addf(&chain, "%s -> ", walk->stack.items[i]->name);
+	strbuf_addstr(&chain, module->name);
+
+	error(_("dependency cycle between modules: %s"), chain.buf);
+	strbuf_release(&chain);
+}
+
+static int topo_visit(struct topo_walk *walk, struct module_def *module)
+{
+	if (bitmap_get(walk->done, module->index))
+		return 0;
+	if (walk->skip_resolved && module->closure_valid)
+		return 0;
+	if (bitmap_get(walk->on_stack, module->index)) {
+		if (!walk->quiet)
+			report_cycle(walk, module);
+		return -1;
+	}
+
+	bitmap_set(walk->on_stack, module->index);
+	module_list_append(&walk->stack, module);
+
+	for (size_t i = 0; i < module->deps_nr; i++)
+		if (topo_visit(walk, module->deps[i]) < 0)
+			return -1;
+
+	walk->stack.nr--;
+	bitmap_unset(walk->on_stack, module->index);
+	bitmap_set(walk->done, module->index);
+	module_list_append(walk->out, module);
+	return 0;
+}
+
+int module_graph_topo_order(struct module_graph *graph,
+			    struct module_def *module,
+			    struct module_list *out)
+{
+	struct topo_walk walk;
+	int ret;
+
+	topo_walk_init(&walk, graph, out);
+	ret = topo_visit(&walk, module);
+	topo_walk_release(&walk);
+	return ret;
+}
+
+int module_graph_topo_order_all(struct module_graph *graph,
+				struct module_list *out)
+{
+	struct topo_walk walk;
+	int ret = 0;
+
+	topo_walk_init(&walk, graph, out);
+	for (size_t i = 0; !ret && i < graph->modules_nr; i++)
+		ret = topo_visit(&walk, graph->modules[i]);
+	topo_walk_release(&walk);
+	return ret;
+}
+
+/*
+ * Sort and deduplicate `paths`, drop every path that lies inside another
+ * one of the set and store the result in the closure of `module`.
+ *
+ * After sorting, all paths inside a directory "a" directly follow "a"
+ * itself, possibly interleaved with siblings like "a-b" that merely share
+ * its textual prefix. Keeping the directories that are still "open" on a
+ * stack thus finds the enclosing directory of every path in linear time.
+ */
+static void set_closure(struct module_graph *graph, struct module_def *module,
+			struct string_list *paths)
+{
+	const char **open;
+	size_t open_nr = 0;
+
+	string_list_sort(paths);
+	string_list_remove_duplicates(paths, 0);
+
+	CALLOC_ARRAY(open, paths->nr);
+	module->closure = mem_pool_calloc(&graph->pool, paths->nr,
+					  sizeof(*module->closure));
+	module->closure_nr = 0;
+
+	for (size_t i = 0; i < paths->nr; i++) {
+		const char *path = paths->items[i].string;
+		const char *rest = NULL;
+
+		while (open_nr &&
+		       (!skip_prefix(path, open[open_nr - 1], &rest) || *rest > '/'))
+			open_nr--;
+		if (open_nr && *rest == '/')
+			continue;
+
+		open[open_nr++] = path;
+		module->closure[module->closure_nr++] = path;
+	}
+
+	module->closure_valid = 1;
+	free(open);
+}
+
+static int resolve_one(struct module_graph *graph, struct module_def *module,
+		       int quiet)
+{
+	struct module_list order = MODULE_LIST_INIT;
+	struct string_list paths = STRING_LIST_INIT_NODUP;
+	struct topo_walk walk;
+	int ret;
+
+	if (module->closure_valid)
+		return 0;
+
+	topo_walk_init(&walk, graph, &order);
+	walk.skip_resolved = 1;
+	walk.quiet = quiet;
+	ret = topo_visit(&walk, module);
+	topo_walk_release(&walk);
+	if (ret < 0)
+		goto out;
+
+	/*
+	 * Dependencies come first in topological order, so the closures of
+	 * the direct dependencies of a module are always known by the time
+	 * we reach the module itself.
+	 */
+	for (size_t i = 0; i < order.nr; i++) {
+		struct module_def *mod = order.items[i];
+
+		string_list_clear(&paths, 0);
+		for (size_t j = 0; j < mod->paths_nr; j++)
+			string_list_append(&paths, mod->paths[j]);
+		for (size_t j = 0; j < mod->deps_nr; j++) {
+			struct module_def *dep = mod->deps[j];
+
+			for (size_t k = 0; k < dep->closure_nr; k++)
+				string_list_append(&paths, dep->closure[k]);
+		}
+
+		set_closure(graph, mod, &paths);
+	}
+
+out:
+	string_list_clear(&paths, 0);
+	module_list_clear(&order);
+	return ret;
+}
+
+int module_graph_resolve(struct module_graph *graph, struct module_def *module)
+{
+	return resolve_one(graph, module, 0);
+}
+
+int module_graph_resolve_all(struct module_graph *graph)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < graph->modules_nr; i++)
+		if (resolve_one(graph, graph->modules[i], 1) < 0)
+			ret = -1;
+	return ret;
+}
+
+int resolve_dependencies(struct module_graph *graph, struct module_def *module,
+			 struct strvec *all_paths)
+{
+	if (module_graph_resolve(graph, module) < 0)
+		return -1;
+
+	for (size_t i = 0; i < module->closure_nr; i++)
+		strvec_push(all_paths, module->closure[i]);
+	return 0;
+}
+
+struct module_trie_node {
+	const char *name;
+	size_t len;
+
+	/* Sorted by name. */
+	struct module_trie_node **children;
+	size_t children_nr, children_alloc;
+
+	/* The modules with a path ending at this node. */
+	struct module_list modules;
+};
+
+static int trie_child_pos(const struct module_trie_node *node,
+			  const char *name, size_t len)
+{
+	size_t lo = 0, hi = node->children_nr;
+
+	while (lo < hi) {
+		size_t mi = lo + (hi - lo) / 2;
+		const struct module_trie_node *child = node->children[mi];
+		int cmp = memcmp(name, child->name, len < child->len ? len : child->len);
+
+		if (!cmp)
+			cmp = len < child->len ? -1 : len > child->len;
+		if (!cmp)
+			return mi;
+		if (cmp < 0)
+			hi = mi;
+		else
+			lo = mi + 1;
+	}
+	return -1 - (int)lo;
+}
+
+static void module_trie_add(struct module_trie *trie, const char *path,
+			    struct module_def *module)
+{
+	struct module_trie_node *node = trie->root;
+
+	while (*path) {
+		size_t len = strchrnul(path, '/') - path;
+		int pos = trie_child_pos(node, path, len);
+
+		if (pos < 0) {
+			struct module_trie_node *child;
+
+			pos = -1 - pos;
+			CALLOC_ARRAY(child, 1);
+			child->name = path;
+			child->len = len;
+			ALLOC_GROW(node->children, node->children_nr + 1,
+				   node->children_alloc);
+			MOVE_ARRAY(node->children + pos + 1, node->children + pos,
+				   node->children_nr - pos);
+			node->children[pos] = child;
+			node->children_nr++;
+		}
+		node = node->children[pos];
+		path += len;
+		while (*path == '/')
+			path++;
+	}
+	module_list_append(&node->modules, module);
+}
+
+void module_trie_build(struct module_trie *trie, struct module_graph *graph,
+		       int restricted)
+{
+	if (!trie->root)
+		CALLOC_ARRAY(trie->root, 1);
+
+	for (size_t i = 0; i < graph->modules_nr; i++) {
+		struct module_def *module = graph->modules[i];
+
+		if (restricted && !module->read_only && !module->owners_only)
+			continue;
+		trie->modules_nr++;
+		for (size_t j = 0; j < module->paths_nr; j++)
+			module_trie_add(trie, module->paths[j], module);
+	}
+}
+
+static void module_trie_node_free(struct module_trie_node *node)
+{
+	for (size_t i = 0; i < node->children_nr; i++)
+		module_trie_node_free(node->children[i]);
+	free(node->children);
+	module_list_clear(&node->modules);
+	free(node);
+}
+
+void module_trie_clear(struct module_trie *trie)
+{
+	if (trie->root)
+		module_trie_node_free(trie->root);
+	trie->root = NULL;
+	trie->modules_nr = 0;
+}
+
+void module_trie_lookup(const struct module_trie *trie, const char *path,
+			struct module_list *out)
+{
+	const struct module_trie_node *node = trie->root;
+
+	while (node && *path) {
+		size_t len = strchrnul(path, '/') - path;
+		int pos = trie_child_pos(node, path, len);
+
+		if (pos < 0)
+			return;
+		node = node->children[pos];
+		for (size_t i = 0; i < node->modules.nr; i++)
+			module_list_append(out, node->modules.items[i]);
+		path += len;
+		while (*path == '/')
+			path++;
+	}
+}
+
+int module_allows_change(const struct module_def *module, const char *email)
+{
+	if (module->read_only)
+		return 0;
+	if (!module->owners_only)
+		return 1;
+	for (size_t i = 0; i < module->owners_nr; i++)
+		if (!strcasecmp(module->owners[i], email))
+			return 1;
+	return 0;
 }
@@ -1,29 +1,183 @@
 #ifndef MODGIT_H
 #define MODGIT_H
 
-#include "strvec.h"
 #include "hashmap.h"
+#include "mem-pool.h"
 
+struct object_id;
+struct repository;
+struct strvec;
+
+/*
+ * Name of the file, relative to the top of the worktree, that describes
+ * the modules of a repository. It uses the config file syntax:
+ *
+ *	[module "frontend"]
+ *		path = src/ui
+ *		depends = backend
+ */
+#define MODGIT_FILE ".modgit"
+
+/*
+ * A single module of a `struct module_graph`. The name, the paths and the
+ * dependency edges are allocated from the mem-pool of the graph that owns
+ * the module and live exactly as long as that graph.
+ */
 struct module_def {
-    char *name;
-    struct strvec paths;
-    struct strvec depends_on;
-    // Permissions
-    int read_only;
-    int owners_only;
+	struct hashmap_entry ent;
+	const char *name;
+
+	/* Position of this module in `module_graph.modules`. */
+	size_t index;
+
+	const char **paths;
+	size_t paths_nr;
+
+	/* Modules this one depends on, in .modgit order. */
+	struct module_def **deps;
+	size_t deps_nr;
+
+	/*
+	 * The sorted, deduplicated paths of this module and of everything it
+	 * transitively depends on, with paths that lie inside another path of
+	 * the set collapsed into it. Filled in by `module_graph_resolve()`.
+	 */
+	const char **closure;
+	size_t closure_nr;
+	unsigned closure_valid : 1;
+
+	/*
+	 * Permissions, from the "readOnly", "ownersOnly" and "owner" keys.
+	 * No one may change the paths of a read-only module, and only the
+	 * committers whose e-mail is listed in `owners` may change those
+	 * of an owners-only module.
+	 */
+	unsigned read_only : 1;
+	unsigned owners_only : 1;
+	const char **owners;
+	size_t owners_nr;
 };
 
-/* 
- * Loads module definition from .modgit file in the worktree
+/*
+ * All modules of a repository, parsed from a single pass over the .modgit
+ * file. Modules can be looked up by name in constant time and iterated in
+ * the order in which they were first defined.
  */
-struct module_def *load_module_def(const char *module_name);
+struct module_graph {
+	struct hashmap map;
+	struct mem_pool pool;
+
+	struct module_def **modules;
+	size_t modules_nr, modules_alloc;
+};
+
+void module_graph_init(struct module_graph *graph);
+
+/*
+ * Parse the module definitions in `path` into `graph`, which must have
+ * been initialized with `module_graph_init()` and not loaded before.
+ * Dependencies on unknown modules are reported with a warning and dropped.
+ * Returns -1 if the file could not be read, 0 otherwise.
+ */
+int module_graph_load(struct module_graph *graph, const char *path);
+
+/*
+ * Like module_graph_load(), but parse the blob `oid` of `r`, e.g. the
+ * .modgit of a commit that is not checked out.
+ */
+int module_graph_load_blob(struct module_graph *graph, struct repository *r,
+			   const struct object_id *oid);
 
 /*
- * List all available modules
+ * Return the module called `name`, or NULL if the graph has no such module.
  */
-void list_modules(struct strvec *names);
+struct module_def *module_graph_lookup(struct module_graph *graph,
+				       const char *name);
 
-void free_module_def(struct module_def *module);
-void resolve_dependencies(struct module_def *module, struct strvec *all_paths);
+void module_graph_release(struct module_graph *graph);
+
+struct module_list {
+	struct module_def **items;
+	size_t nr, alloc;
+};
+#define MODULE_LIST_INIT { 0 }
+
+void module_list_append(struct module_list *list, struct module_def *module);
+void module_list_clear(struct module_list *list);
+
+/*
+ * Append `module` and every module it transitively depends on to `out`,
+ * listing each module only once and after all of its dependencies. Returns
+ * -1 and reports the offending chain if the dependencies form a cycle.
+ */
+int module_graph_topo_order(struct module_graph *graph,
+			    struct module_def *module,
+			    struct module_list *out);
+
+/*
+ * Append every module of the graph to `out`, each after all of its
+ * dependencies and otherwise in .modgit order. Returns -1 and reports
+ * the offending chain if the dependencies form a cycle.
+ */
+int module_graph_topo_order_all(struct module_graph *graph,
+				struct module_list *out);
+
+/*
+ * Compute `module->closure`, along with the closures of all of its
+ * dependencies. Results are memoized in the graph, so resolving many
+ * modules that share dependencies only computes each closure once.
+ * Returns -1 if the dependencies form a cycle.
+ */
+int module_graph_resolve(struct module_graph *graph, struct module_def *module);
+
+/*
+ * Resolve the closure of every module in the graph. Modules whose
+ * dependencies form a cycle are left unresolved, without reporting the
+ * cycle, and make this function return -1.
+ */
+int module_graph_resolve_all(struct module_graph *graph);
+
+/*
+ * Append the closure of `module` to `all_paths`. Returns -1 if the
+ * dependencies of `module` form a cycle.
+ */
+int resolve_dependencies(struct module_graph *graph, struct module_def *module,
+			 struct strvec *all_paths);
+
+/*
+ * A trie over the components of the paths of the modules of a graph. It
+ * finds the modules containing a path in time proportional to the depth
+ * of the path, however many modules there are.
+ */
+struct module_trie_node;
+struct module_trie {
+	struct module_trie_node *root;
+
+	/* Number of modules added to the trie. */
+	size_t modules_nr;
+};
+#define MODULE_TRIE_INIT { 0 }
+
+/*
+ * Add the paths of the modules of `graph` to `trie`. With `restricted`,
+ * only add the modules that are read-only or owners-only. The trie
+ * points into `graph`, which must outlive it.
+ */
+void module_trie_build(struct module_trie *trie, struct module_graph *graph,
+		       int restricted);
+void module_trie_clear(struct module_trie *trie);
+
+/*
+ * Append to `out` the modules of `trie` that have `path` or one of its
+ * leading directories among their paths, outermost first.
+ */
+void module_trie_lookup(const struct module_trie *trie, const char *path,
+			struct module_list *out);
+
+/*
+ * Return whether the committer with the e-mail `email` may change the
+ * paths of `module`. Owners are compared case-insensitively.
+ */
+int module_allows_change(const struct module_def *module, const char *email);
 
 #endif
@@ -461,32 +461,36 @@ static int handle_range_1(
 	return k - k_start;
 }
 
-struct lazy_dir_thread_data {
-	pthread_t pthread;
+/*
+ * The "dir" phase hands out the index in ranges this small, so that
+ * threads done early can take over ranges from threads stuck in a
+ * part of the index with deep or wide directories.
+ */
+#define LAZY_RANGE_SIZE (500)
+
+struct lazy_dir_range {
 	struct index_state *istate;
 	struct lazy_entry *lazy_entries;
 	int k_start;
 	int k_end;
 };
 
-static void *lazy_dir_thread_proc(void *_data)
+static void lazy_dir_range_proc(void *_data, int worker UNUSED)
 {
-	struct lazy_dir_thread_data *d = _data;
+	struct lazy_dir_range *d = _data;
 	struct strbuf prefix = STRBUF_INIT;
 	handle_range_1(d->istate, d->k_start, d->k_end, NULL, &prefix, d->lazy_entries);
 	strbuf_release(&prefix);
-	return NULL;
 }
 
-struct lazy_name_thread_data {
-	pthread_t pthread;
+struct lazy_name_data {
 	struct index_state *istate;
 	struct lazy_entry *lazy_entries;
 };
 
-static void *lazy_name_thread_proc(void *_data)
+static void lazy_name_proc(void *_data, int worker UNUSED)
 {
-	struct lazy_name_thread_data *d = _data;
+	struct lazy_name_data *d = _data;
 	int k;
 
 	for (k = 0; k < d->istate->cache_nr; k++) {
@@ -497,8 +501,6 @@ static void *lazy_name_thread_proc(void *_data)
 			hashmap_add(&d->istate->name_hash, &ce_k->ent);
 		}
 	}
-
-	return NULL;
 }
 
 static inline void lazy_update_dir_ref_counts(
@@ -516,48 +518,39 @@ static inline void lazy_update_dir_ref_counts(
 static void threaded_lazy_init_name_hash(
 	struct index_state *istate)
 {
-	int err;
-	int nr_each;
-	int k_start;
-	int t;
+	int nr_ranges;
+	int r;
 	struct lazy_entry *lazy_entries;
-	struct lazy_dir_thread_data *td_dir;
-	struct lazy_name_thread_data *td_name;
+	struct lazy_dir_range *ranges;
+	struct lazy_name_data name_data;
+	struct task_pool *pool;
 
 	if (!HAVE_THREADS)
 		return;
 
-	k_start = 0;
-	nr_each = DIV_ROUND_UP(istate->cache_nr, lazy_nr_dir_threads);
+	nr_ranges = DIV_ROUND_UP(istate->cache_nr, LAZY_RANGE_SIZE);
 
 	CALLOC_ARRAY(lazy_entries, istate->cache_nr);
-	CALLOC_ARRAY(td_dir, lazy_nr_dir_threads);
-	CALLOC_ARRAY(td_name, 1);
+	CALLOC_ARRAY(ranges, nr_ranges);
 
 	init_dir_mutex();
+	pool = task_pool_new(lazy_nr_dir_threads);
 
 	/*
 	 * Phase 1:
 	 * Build "istate->dir_hash" using n "dir" threads (and a read-only index).
 	 */
-	for (t = 0; t < lazy_nr_dir_threads; t++) {
-		struct lazy_dir_thread_data *td_dir_t = td_dir + t;
-		td_dir_t->istate = istate;
-		td_dir_t->lazy_entries = lazy_entries;
-		td_dir_t->k_start = k_start;
-		k_start += nr_each;
-		if (k_start > istate->cache_nr)
-			k_start = istate->cache_nr;
-		td_dir_t->k_end = k_start;
-		err = pthread_create(&td_dir_t->pthread, NULL, lazy_dir_thread_proc, td_dir_t);
-		if (err)
-			die(_("unable to create lazy_dir thread: %s"), strerror(err));
-	}
-	for (t = 0; t < lazy_nr_dir_threads; t++) {
-		struct lazy_dir_thread_data *td_dir_t = td_dir + t;
-		if (pthread_join(td_dir_t->pthread, NULL))
-			die("unable to join lazy_dir_thread");
+	for (r = 0; r < nr_ranges; r++) {
+		struct lazy_dir_range *range = ranges + r;
+		range->istate = istate;
+		range->lazy_entries = lazy_entries;
+		range->k_start = r * LAZY_RANGE_SIZE;
+		range->k_end = range->k_start + LAZY_RANGE_SIZE;
+		if (range->k_end > istate->cache_nr)
+			range->k_end = istate->cache_nr;
+		task_pool_add(pool, lazy_dir_range_proc, range);
 	}
+	task_pool_wait(pool);
 
 	/*
 	 * Phase 2:
@@ -569,22 +562,16 @@ static void threaded_lazy_init_name_hash(
 	 * index entry using the current thread.  (This step is very fast and
 	 * doesn't need threading.)
 	 */
-	td_name->istate = istate;
-	td_name->lazy_entries = lazy_entries;
-	err = pthread_create(&td_name->pthread, NULL, lazy_name_thread_proc, td_name);
-	if (err)
-		die(_("unable to create lazy_name thread: %s"), strerror(err));
+	name_data.istate = istate;
+	name_data.lazy_entries = lazy_entries;
+	task_pool_add(pool, lazy_name_proc, &name_data);
 
 	lazy_update_dir_ref_counts(istate, lazy_entries);
 
-	err = pthread_join(td_name->pthread, NULL);
-	if (err)
-		die(_("unable to join lazy_name thread: %s"), strerror(err));
-
+	task_pool_free(pool);
 	cleanup_dir_mutex();
 
-	free(td_name);
-	free(td_dir);
+	free(ranges);
 	free(lazy_entries);
 }
 
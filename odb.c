@@ -914,6 +914,138 @@ void *odb_read_object(struct object_database *odb,
 	return data;
 }
 
+struct read_objects_entry {
+	size_t i;
+	const struct object_id *oid;
+	struct pack_entry e;
+};
+
+static int read_objects_entry_cmp(const void *va, const void *vb)
+{
+	const struct read_objects_entry *a = va, *b = vb;
+
+	if (a->e.p != b->e.p)
+		return strcmp(a->e.p->pack_name, b->e.p->pack_name);
+	if (a->e.offset != b->e.offset)
+		return a->e.offset < b->e.offset ? -1 : 1;
+	return a->i < b->i ? -1 : a->i > b->i;
+}
+
+static int read_objects_deliver(size_t i, enum object_type type,
+				unsigned long size, void *buf,
+				odb_read_objects_fn fn, void *data)
+{
+	int ret;
+
+	if (!buf && type != OBJ_BLOB) {
+		type = OBJ_BAD;
+		size = 0;
+	}
+	ret = fn(i, type, size, &buf, data);
+	free(buf);
+	return ret;
+}
+
+/* Blobs that are left for the caller to stream, see odb_read_objects_fn. */
+static int read_objects_too_big(struct object_database *odb,
+				enum object_type type, unsigned long size)
+{
+	return type == OBJ_BLOB &&
+		size >= repo_settings_get_big_file_threshold(odb->repo);
+}
+
+int odb_read_objects(struct object_database *odb,
+		     const struct object_id *oids, size_t nr,
+		     odb_read_objects_fn fn, void *data)
+{
+	struct read_objects_entry *packed;
+	size_t packed_nr = 0;
+	struct packed_git *advised = NULL;
+	int ret = 0;
+
+	ALLOC_ARRAY(packed, nr);
+	odb_prepare_alternates(odb);
+
+	for (size_t i = 0; i < nr; i++) {
+		const struct object_id *oid = lookup_replace_object(odb->repo, &oids[i]);
+		struct read_objects_entry *entry = &packed[packed_nr];
+		struct odb_source *source;
+		enum object_type type;
+		unsigned long size;
+		void *buf;
+
+		obj_read_lock();
+		for (source = odb->sources; source; source = source->next)
+			if (packfile_store_find_pack_entry(source->packfiles,
+							   oid, &entry->e))
+				break;
+		obj_read_unlock();
+
+		if (source) {
+			entry->i = i;
+			entry->oid = oid;
+			packed_nr++;
+			continue;
+		}
+
+		type = odb_read_object_info(odb, &oids[i], &size);
+		if (read_objects_too_big(odb, type, size))
+			buf = NULL;
+		else
+			buf = odb_read_object(odb, &oids[i], &type, &size);
+		ret = read_objects_deliver(i, type, size, buf, fn, data);
+		if (ret)
+			goto out;
+	}
+
+	QSORT(packed, packed_nr, read_objects_entry_cmp);
+
+	for (size_t j = 0; j < packed_nr; j++) {
+		struct read_objects_entry *entry = &packed[j];
+		struct object_info oi = OBJECT_INFO_INIT;
+		enum object_type type;
+		unsigned long size;
+		void *buf = NULL;
+
+		if (entry->e.p != advised) {
+			if (advised)
+				pack_advise(advised, PACK_ACCESS_RANDOM);
+			advised = entry->e.p;
+			pack_advise(advised, PACK_ACCESS_SEQUENTIAL);
+		}
+
+		oi.typep = &type;
+		oi.sizep = &size;
+		obj_read_lock();
+		if (packed_object_info(entry->e.p, entry->e.offset, &oi) < 0) {
+			type = OBJ_BAD;
+		} else if (!read_objects_too_big(odb, type, size)) {
+			oi.contentp = &buf;
+			if (packed_object_info(entry->e.p, entry->e.offset, &oi) < 0)
+				buf = NULL;
+			if (!buf)
+				type = OBJ_BAD;
+		}
+		if (type == OBJ_BAD)
+			mark_bad_packed_object(entry->e.p, entry->oid);
+		obj_read_unlock();
+
+		/* Let the usual lookup find another copy, or die. */
+		if (type == OBJ_BAD)
+			buf = odb_read_object(odb, &oids[entry->i], &type, &size);
+
+		ret = read_objects_deliver(entry->i, type, size, buf, fn, data);
+		if (ret)
+			break;
+	}
+
+out:
+	if (advised)
+		pack_advise(advised, PACK_ACCESS_RANDOM);
+	free(packed);
+	return ret;
+}
+
 void *odb_read_object_peeled(struct object_database *odb,
 			     const struct object_id *oid,
 			     enum object_type required_type,
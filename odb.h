@@ -298,6 +298,38 @@ void *odb_read_object_peeled(struct object_database *odb,
 			     unsigned long *size,
 			     struct object_id *oid_ret);
 
+/*
+ * Called by odb_read_objects() for the object at position `i` of the
+ * array it was given. `buf` holds the contents of the object, or is
+ * `NULL` if the object could not be read, in which case `type` is
+ * `OBJ_BAD`. Blobs of at least `core.bigFileThreshold` bytes are not
+ * read into memory either: for them, `buf` is `NULL` but `type` and
+ * `size` are set, and the callback is expected to stream the blob (see
+ * "odb/streaming.h"). `buf` is freed after the callback returns, unless
+ * the callback sets `*buf` to `NULL` to take it over.
+ *
+ * A non-zero return value stops the iteration, and is returned by
+ * odb_read_objects().
+ */
+typedef int odb_read_objects_fn(size_t i, enum object_type type,
+				unsigned long size, void **buf, void *data);
+
+/*
+ * Read the `nr` objects of `oids` (after looking up their replacements)
+ * and hand each of them to `fn`, in an order that suits the object
+ * database rather than in the order of `oids`: objects that are not in
+ * a pack come first, then packed objects sorted by pack and by offset.
+ *
+ * Reading in pack order means reading the packs mostly sequentially, and
+ * objects sharing a delta base mostly find it in the delta base cache,
+ * so that it is only unpacked once. Bulk readers that do not depend on
+ * the order of the objects should prefer this to reading objects one by
+ * one.
+ */
+int odb_read_objects(struct object_database *odb,
+		     const struct object_id *oids, size_t nr,
+		     odb_read_objects_fn fn, void *data);
+
 /*
  * Add an object file to the in-memory object store, without writing it
  * to disk.
@@ -158,6 +158,7 @@ void clear_packing_data(struct packing_data *pdata)
 		return;
 
 	free(pdata->cruft_mtime);
+	free(pdata->delta_data);
 	free(pdata->in_pack);
 	free(pdata->in_pack_by_idx);
 	free(pdata->in_pack_pos);
@@ -180,6 +181,8 @@ struct object_entry *packlist_alloc(struct packing_data *pdata,
 			REALLOC_ARRAY(pdata->in_pack, pdata->nr_alloc);
 		if (pdata->delta_size)
 			REALLOC_ARRAY(pdata->delta_size, pdata->nr_alloc);
+		if (pdata->delta_data)
+			REALLOC_ARRAY(pdata->delta_data, pdata->nr_alloc);
 
 		if (pdata->tree_depth)
 			REALLOC_ARRAY(pdata->tree_depth, pdata->nr_alloc);
@@ -211,6 +214,9 @@ struct object_entry *packlist_alloc(struct packing_data *pdata,
 	if (pdata->in_pack)
 		pdata->in_pack[pdata->nr_objects - 1] = NULL;
 
+	if (pdata->delta_data)
+		pdata->delta_data[pdata->nr_objects - 1] = NULL;
+
 	if (pdata->tree_depth)
 		pdata->tree_depth[pdata->nr_objects - 1] = 0;
 
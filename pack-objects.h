@@ -77,18 +77,19 @@ enum dfs_state {
  * compute_write_order(). "delta" and "delta_size" must remain valid
  * at object writing phase in case the delta is not cached.
  *
- * If a delta is cached in memory and is compressed, delta_data points
- * to the data and z_delta_size contains the compressed size. If it's
- * uncompressed [1], z_delta_size must be zero. delta_size is always
- * the uncompressed size and must be valid even if the delta is not
- * cached.
+ * If a delta is cached in memory and is compressed, oe_delta_data()
+ * points to the data and z_delta_size contains the compressed size.
+ * If it's uncompressed [1], z_delta_size must be zero. delta_size is
+ * always the uncompressed size and must be valid even if the delta is
+ * not cached. The pointer is not needed before the delta search nor
+ * after the objects are written, so it lives in packing_data rather
+ * than here, and only in between.
  *
  * [1] during try_delta phase we don't bother with compressing because
  * the delta could be quickly replaced with a better one.
  */
 struct object_entry {
 	struct pack_idx_entry idx;
-	void *delta_data;	/* cached delta (uncompressed) */
 	off_t in_pack_offset;
 	uint32_t hash;			/* name hint hash */
 	unsigned size_:OE_SIZE_BITS;
@@ -125,8 +126,8 @@ struct object_entry {
  * as given by a starting index and a number of elements.
  */
 struct packing_region {
-	size_t start;
-	size_t nr;
+	uint32_t start;
+	uint32_t nr;
 };
 
 struct packing_data {
@@ -143,6 +144,13 @@ struct packing_data {
 	unsigned int *in_pack_pos;
 	unsigned long *delta_size;
 
+	/*
+	 * Cached delta data of each object, see oe_prepare_delta_data().
+	 * NULL until the delta search starts, and again once all objects
+	 * are written.
+	 */
+	void **delta_data;
+
 	/*
 	 * Only one of these can be non-NULL and they have different
 	 * sizes. if in_pack_by_idx is allocated, oe_in_pack() returns
@@ -313,6 +321,51 @@ void oe_set_delta_ext(struct packing_data *pack,
 		      struct object_entry *e,
 		      const struct object_id *oid);
 
+/*
+ * Allocate the cached delta of every object.  This must happen before
+ * the threads of the delta search start, as they set the cached deltas
+ * of their objects concurrently.
+ */
+static inline void oe_prepare_delta_data(struct packing_data *pack)
+{
+	if (!pack->delta_data)
+		CALLOC_ARRAY(pack->delta_data, pack->nr_alloc);
+}
+
+static inline void *oe_delta_data(const struct packing_data *pack,
+				  const struct object_entry *e)
+{
+	if (!pack->delta_data)
+		return NULL;
+	return pack->delta_data[e - pack->objects];
+}
+
+static inline void oe_set_delta_data(struct packing_data *pack,
+				     struct object_entry *e,
+				     void *data)
+{
+	if (!pack->delta_data) {
+		if (!data)
+			return;
+		BUG("delta data cached before oe_prepare_delta_data()");
+	}
+	pack->delta_data[e - pack->objects] = data;
+}
+
+/*
+ * Free the cached delta data once all objects have been written, so
+ * that it does not add to what is needed afterwards, e.g. to write a
+ * bitmap index.
+ */
+static inline void oe_clear_delta_data(struct packing_data *pack)
+{
+	if (!pack->delta_data)
+		return;
+	for (uint32_t i = 0; i < pack->nr_objects; i++)
+		free(pack->delta_data[i]);
+	FREE_AND_NULL(pack->delta_data);
+}
+
 static inline unsigned int oe_tree_depth(struct packing_data *pack,
 					 struct object_entry *e)
 {
@@ -343,6 +343,10 @@ static void scan_windows(struct packed_git *p,
 {
 	struct pack_window *w, *w_l;
 
+	/* A pack mapped as a whole stays mapped until it is closed. */
+	if (p->mapped_whole)
+		return;
+
 	for (w_l = NULL, w = p->windows; w; w = w->next) {
 		if (!w->inuse_cnt) {
 			if (!*lru_w || w->last_used < (*lru_w)->last_used) {
@@ -389,11 +393,13 @@ void close_pack_windows(struct packed_git *p)
 			die("pack '%s' still has open windows to it",
 			    p->pack_name);
 		munmap(w->base, w->len);
-		pack_mapped -= w->len;
+		if (!p->mapped_whole)
+			pack_mapped -= w->len;
 		pack_open_windows--;
 		p->windows = w->next;
 		free(w);
 	}
+	p->mapped_whole = 0;
 }
 
 int close_pack_fd(struct packed_git *p)
@@ -696,6 +702,77 @@ static int in_window(struct repository *r, struct pack_window *win,
 		&& (offset + r->hash_algo->rawsz) <= (win_off + win->len);
 }
 
+/*
+ * Hints are only worth giving for a pack mapped as a whole: windows
+ * are small enough, and short-lived enough, for the kernel defaults.
+ */
+static void apply_pack_advice(struct packed_git *p)
+{
+#if !defined(NO_MMAP) && defined(MADV_RANDOM)
+	struct pack_window *win = p->windows;
+
+	if (!p->mapped_whole)
+		return;
+	if (p->access_sequential) {
+		madvise(win->base, win->len, MADV_SEQUENTIAL);
+		madvise(win->base, win->len, MADV_WILLNEED);
+	} else {
+		madvise(win->base, win->len, MADV_RANDOM);
+	}
+#else
+	(void)p;
+#endif
+}
+
+void pack_advise(struct packed_git *p, enum pack_access_pattern pattern)
+{
+	unsigned sequential = pattern == PACK_ACCESS_SEQUENTIAL;
+
+	if (p->access_sequential == sequential)
+		return;
+	p->access_sequential = sequential;
+	apply_pack_advice(p);
+}
+
+static int want_whole_pack(struct packed_git *p)
+{
+	/* lazy load the settings in case it hasn't been setup */
+	prepare_repo_settings(p->repo);
+	return p->repo->settings.packed_git_map_whole;
+}
+
+/*
+ * With core.packedGitMapWhole, map the whole pack at once and keep it
+ * mapped until the pack is closed.  Such a mapping is not counted
+ * against core.packedGitLimit and never picked by unuse_one_window().
+ */
+static struct pack_window *map_whole_pack(struct packed_git *p)
+{
+	struct pack_window *win;
+
+	if (p->pack_fd == -1 && open_packed_git(p))
+		die("packfile %s cannot be accessed", p->pack_name);
+
+	CALLOC_ARRAY(win, 1);
+	win->len = xsize_t(p->pack_size);
+	win->base = xmmap_gently(NULL, win->len, PROT_READ, MAP_PRIVATE,
+				 p->pack_fd, 0);
+	if (win->base == MAP_FAILED)
+		die_errno(_("packfile %s cannot be mapped%s"),
+			  p->pack_name, mmap_os_err());
+	if (!p->do_not_close)
+		close_pack_fd(p);
+	pack_mmap_calls++;
+	pack_open_windows++;
+	if (pack_open_windows > peak_pack_open_windows)
+		peak_pack_open_windows = pack_open_windows;
+
+	p->windows = win;
+	p->mapped_whole = 1;
+	apply_pack_advice(p);
+	return win;
+}
+
 unsigned char *use_pack(struct packed_git *p,
 		struct pack_window **w_cursor,
 		off_t offset,
@@ -715,7 +792,11 @@ unsigned char *use_pack(struct packed_git *p,
 	if (offset < 0)
 		die(_("offset before end of packfile (broken .idx?)"));
 
-	if (!win || !in_window(p->repo, win, offset)) {
+	if (p->mapped_whole) {
+		win = p->windows;
+	} else if (!p->windows && want_whole_pack(p)) {
+		win = map_whole_pack(p);
+	} else if (!win || !in_window(p->repo, win, offset)) {
 		if (win)
 			win->inuse_cnt--;
 		for (win = p->windows; win; win = win->next) {
@@ -1418,10 +1499,33 @@ static enum object_type packed_to_object_type(struct repository *r,
 	goto out;
 }
 
-static struct hashmap delta_base_cache;
-static size_t delta_base_cached;
+/*
+ * The delta base cache is split into shards, each with its own lock,
+ * hashmap and LRU list, so that threads working on different bases do
+ * not contend.  The memory budget is shared: the total size of all
+ * shards is kept under the limit by evicting the least recently used
+ * entries, from the shard of the new entry first.
+ *
+ * Callers of the functions below must hold obj_read_lock() when the
+ * object reading API is used from several threads; the shard locks
+ * only protect the entries while a thread copies out of the cache
+ * after having released obj_read_lock().
+ */
+#define DELTA_BASE_CACHE_SHARDS_BITS 4
+#define DELTA_BASE_CACHE_SHARDS (1 << DELTA_BASE_CACHE_SHARDS_BITS)
+
+struct delta_base_cache_shard {
+	pthread_mutex_t mutex;
+	struct hashmap map;
+	struct list_head lru;
+};
 
-static LIST_HEAD(delta_base_cache_lru);
+static struct delta_base_cache_shard delta_base_cache[DELTA_BASE_CACHE_SHARDS];
+static int delta_base_cache_initialized;
+
+/* Protects "delta_base_cached". */
+static pthread_mutex_t delta_base_cached_mutex;
+static size_t delta_base_cached;
 
 struct delta_base_cache_key {
 	struct packed_git *p;
@@ -1446,22 +1550,6 @@ static unsigned int pack_entry_hash(struct packed_git *p, off_t base_offset)
 	return hash;
 }
 
-static struct delta_base_cache_entry *
-get_delta_base_cache_entry(struct packed_git *p, off_t base_offset)
-{
-	struct hashmap_entry entry, *e;
-	struct delta_base_cache_key key;
-
-	if (!delta_base_cache.cmpfn)
-		return NULL;
-
-	hashmap_entry_init(&entry, pack_entry_hash(p, base_offset));
-	key.p = p;
-	key.base_offset = base_offset;
-	e = hashmap_get(&delta_base_cache, &entry, &key);
-	return e ? container_of(e, struct delta_base_cache_entry, ent) : NULL;
-}
-
 static int delta_base_cache_key_eq(const struct delta_base_cache_key *a,
 				   const struct delta_base_cache_key *b)
 {
@@ -1485,54 +1573,193 @@ static int delta_base_cache_hash_cmp(const void *cmp_data UNUSED,
 		return !delta_base_cache_key_eq(&a->key, &b->key);
 }
 
-static int in_delta_base_cache(struct packed_git *p, off_t base_offset)
+static void prepare_delta_base_cache(void)
+{
+	if (delta_base_cache_initialized)
+		return;
+	for (int i = 0; i < DELTA_BASE_CACHE_SHARDS; i++) {
+		struct delta_base_cache_shard *shard = &delta_base_cache[i];
+
+		pthread_mutex_init(&shard->mutex, NULL);
+		hashmap_init(&shard->map, delta_base_cache_hash_cmp, NULL, 0);
+		INIT_LIST_HEAD(&shard->lru);
+	}
+	pthread_mutex_init(&delta_base_cached_mutex, NULL);
+	delta_base_cache_initialized = 1;
+}
+
+/*
+ * The hashmap of a shard uses the low bits of the hash, so pick the
+ * shard by the high bits of a multiplicative hash.
+ */
+static struct delta_base_cache_shard *delta_base_cache_shard(unsigned int hash)
+{
+	return &delta_base_cache[(uint32_t)(hash * 2654435761u) >>
+				 (32 - DELTA_BASE_CACHE_SHARDS_BITS)];
+}
+
+static void delta_base_cached_add(ssize_t size)
+{
+	pthread_mutex_lock(&delta_base_cached_mutex);
+	delta_base_cached += size;
+	pthread_mutex_unlock(&delta_base_cached_mutex);
+}
+
+static size_t delta_base_cached_get(void)
 {
-	return !!get_delta_base_cache_entry(p, base_offset);
+	size_t ret;
+
+	pthread_mutex_lock(&delta_base_cached_mutex);
+	ret = delta_base_cached;
+	pthread_mutex_unlock(&delta_base_cached_mutex);
+	return ret;
+}
+
+/* The caller must hold the lock of "shard". */
+static struct delta_base_cache_entry *
+get_delta_base_cache_entry(struct delta_base_cache_shard *shard,
+			   unsigned int hash,
+			   struct packed_git *p, off_t base_offset)
+{
+	struct hashmap_entry entry, *e;
+	struct delta_base_cache_key key;
+
+	hashmap_entry_init(&entry, hash);
+	key.p = p;
+	key.base_offset = base_offset;
+	e = hashmap_get(&shard->map, &entry, &key);
+	return e ? container_of(e, struct delta_base_cache_entry, ent) : NULL;
 }
 
 /*
  * Remove the entry from the cache, but do _not_ free the associated
  * entry data. The caller takes ownership of the "data" buffer, and
- * should copy out any fields it wants before detaching.
+ * should copy out any fields it wants before detaching.  The caller
+ * must hold the lock of "shard".
  */
-static void detach_delta_base_cache_entry(struct delta_base_cache_entry *ent)
+static void detach_delta_base_cache_entry(struct delta_base_cache_shard *shard,
+					  struct delta_base_cache_entry *ent)
 {
-	hashmap_remove(&delta_base_cache, &ent->ent, &ent->key);
+	hashmap_remove(&shard->map, &ent->ent, &ent->key);
 	list_del(&ent->lru);
-	delta_base_cached -= ent->size;
+	delta_base_cached_add(-(ssize_t)ent->size);
 	free(ent);
 }
 
+static inline void release_delta_base_cache(struct delta_base_cache_shard *shard,
+					    struct delta_base_cache_entry *ent)
+{
+	free(ent->data);
+	detach_delta_base_cache_entry(shard, ent);
+}
+
+/*
+ * Take the entry for the given base out of the cache and hand its data
+ * over to the caller.  Returns NULL if the base is not cached.
+ */
+static void *take_delta_base_cache_entry(struct packed_git *p, off_t base_offset,
+					 unsigned long *base_size,
+					 enum object_type *type)
+{
+	unsigned int hash = pack_entry_hash(p, base_offset);
+	struct delta_base_cache_shard *shard;
+	struct delta_base_cache_entry *ent;
+	void *data = NULL;
+
+	prepare_delta_base_cache();
+	shard = delta_base_cache_shard(hash);
+
+	pthread_mutex_lock(&shard->mutex);
+	ent = get_delta_base_cache_entry(shard, hash, p, base_offset);
+	if (ent) {
+		data = ent->data;
+		*base_size = ent->size;
+		*type = ent->type;
+		detach_delta_base_cache_entry(shard, ent);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+	return data;
+}
+
 static void *cache_or_unpack_entry(struct repository *r, struct packed_git *p,
 				   off_t base_offset, unsigned long *base_size,
 				   enum object_type *type)
 {
+	unsigned int hash = pack_entry_hash(p, base_offset);
+	struct delta_base_cache_shard *shard;
 	struct delta_base_cache_entry *ent;
+	void *data;
 
-	ent = get_delta_base_cache_entry(p, base_offset);
-	if (!ent)
+	prepare_delta_base_cache();
+	shard = delta_base_cache_shard(hash);
+
+	pthread_mutex_lock(&shard->mutex);
+	ent = get_delta_base_cache_entry(shard, hash, p, base_offset);
+	if (!ent) {
+		pthread_mutex_unlock(&shard->mutex);
 		return unpack_entry(r, p, base_offset, type, base_size);
+	}
 
 	if (type)
 		*type = ent->type;
 	if (base_size)
 		*base_size = ent->size;
-	return xmemdupz(ent->data, ent->size);
+
+	/*
+	 * The shard lock keeps the entry alive while we copy it, so let
+	 * other threads read objects meanwhile.
+	 */
+	obj_read_unlock();
+	data = xmemdupz(ent->data, ent->size);
+	pthread_mutex_unlock(&shard->mutex);
+	obj_read_lock();
+	return data;
 }
 
-static inline void release_delta_base_cache(struct delta_base_cache_entry *ent)
+void clear_delta_base_cache(void)
 {
-	free(ent->data);
-	detach_delta_base_cache_entry(ent);
+	if (!delta_base_cache_initialized)
+		return;
+	for (int i = 0; i < DELTA_BASE_CACHE_SHARDS; i++) {
+		struct delta_base_cache_shard *shard = &delta_base_cache[i];
+		struct list_head *lru, *tmp;
+
+		pthread_mutex_lock(&shard->mutex);
+		list_for_each_safe(lru, tmp, &shard->lru) {
+			struct delta_base_cache_entry *entry =
+				list_entry(lru, struct delta_base_cache_entry, lru);
+			release_delta_base_cache(shard, entry);
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
 }
 
-void clear_delta_base_cache(void)
+/*
+ * Evict least recently used entries until "incoming" more bytes fit
+ * into the limit, looking at the shard "first" before the others.
+ */
+static void make_room_in_delta_base_cache(struct delta_base_cache_shard *first,
+					  size_t incoming, size_t limit)
 {
-	struct list_head *lru, *tmp;
-	list_for_each_safe(lru, tmp, &delta_base_cache_lru) {
-		struct delta_base_cache_entry *entry =
-			list_entry(lru, struct delta_base_cache_entry, lru);
-		release_delta_base_cache(entry);
+	int start = first - delta_base_cache;
+
+	for (int i = 0; i < DELTA_BASE_CACHE_SHARDS; i++) {
+		struct delta_base_cache_shard *shard =
+			&delta_base_cache[(start + i) % DELTA_BASE_CACHE_SHARDS];
+		struct list_head *lru, *tmp;
+
+		pthread_mutex_lock(&shard->mutex);
+		list_for_each_safe(lru, tmp, &shard->lru) {
+			struct delta_base_cache_entry *f =
+				list_entry(lru, struct delta_base_cache_entry, lru);
+			if (delta_base_cached_get() + incoming <= limit)
+				break;
+			release_delta_base_cache(shard, f);
+		}
+		pthread_mutex_unlock(&shard->mutex);
+
+		if (delta_base_cached_get() + incoming <= limit)
+			break;
 	}
 }
 
@@ -1541,41 +1768,45 @@ static void add_delta_base_cache(struct packed_git *p, off_t base_offset,
 				 unsigned long delta_base_cache_limit,
 				 enum object_type type)
 {
+	unsigned int hash = pack_entry_hash(p, base_offset);
+	struct delta_base_cache_shard *shard;
 	struct delta_base_cache_entry *ent;
-	struct list_head *lru, *tmp;
+
+	prepare_delta_base_cache();
+	shard = delta_base_cache_shard(hash);
 
 	/*
 	 * Check required to avoid redundant entries when more than one thread
 	 * is unpacking the same object, in unpack_entry() (since its phases I
-	 * and III might run concurrently across multiple threads).
+	 * and III might run concurrently across multiple threads).  Check
+	 * again after making room, as the shard was unlocked meanwhile.
 	 */
-	if (in_delta_base_cache(p, base_offset)) {
+	pthread_mutex_lock(&shard->mutex);
+	ent = get_delta_base_cache_entry(shard, hash, p, base_offset);
+	pthread_mutex_unlock(&shard->mutex);
+	if (!ent)
+		make_room_in_delta_base_cache(shard, base_size,
+					      delta_base_cache_limit);
+
+	pthread_mutex_lock(&shard->mutex);
+	if (ent || get_delta_base_cache_entry(shard, hash, p, base_offset)) {
+		pthread_mutex_unlock(&shard->mutex);
 		free(base);
 		return;
 	}
 
-	delta_base_cached += base_size;
-
-	list_for_each_safe(lru, tmp, &delta_base_cache_lru) {
-		struct delta_base_cache_entry *f =
-			list_entry(lru, struct delta_base_cache_entry, lru);
-		if (delta_base_cached <= delta_base_cache_limit)
-			break;
-		release_delta_base_cache(f);
-	}
-
 	ent = xmalloc(sizeof(*ent));
 	ent->key.p = p;
 	ent->key.base_offset = base_offset;
 	ent->type = type;
 	ent->data = base;
 	ent->size = base_size;
-	list_add_tail(&ent->lru, &delta_base_cache_lru);
+	list_add_tail(&ent->lru, &shard->lru);
+	hashmap_entry_init(&ent->ent, hash);
+	hashmap_add(&shard->map, &ent->ent);
+	delta_base_cached_add(base_size);
 
-	if (!delta_base_cache.cmpfn)
-		hashmap_init(&delta_base_cache, delta_base_cache_hash_cmp, NULL, 0);
-	hashmap_entry_init(&ent->ent, pack_entry_hash(p, base_offset));
-	hashmap_add(&delta_base_cache, &ent->ent);
+	pthread_mutex_unlock(&shard->mutex);
 }
 
 int packed_object_info(struct packed_git *p,
@@ -1763,14 +1994,9 @@ void *unpack_entry(struct repository *r, struct packed_git *p, off_t obj_offset,
 	for (;;) {
 		off_t base_offset;
 		int i;
-		struct delta_base_cache_entry *ent;
-
-		ent = get_delta_base_cache_entry(p, curpos);
-		if (ent) {
-			type = ent->type;
-			data = ent->data;
-			size = ent->size;
-			detach_delta_base_cache_entry(ent);
+
+		data = take_delta_base_cache_entry(p, curpos, &size, &type);
+		if (data) {
 			base_from_cache = 1;
 			break;
 		}
@@ -1913,8 +2139,16 @@ void *unpack_entry(struct repository *r, struct packed_git *p, off_t obj_offset,
 			      (uintmax_t)curpos, p->pack_name);
 			data = NULL;
 		} else {
+			/*
+			 * Both `base` and `delta_data` belong to this thread
+			 * alone (a base taken from the cache was detached from
+			 * it above), so let other threads read objects while
+			 * we apply the delta.
+			 */
+			obj_read_unlock();
 			data = patch_delta(base, base_size, delta_data,
 					   delta_size, &size);
+			obj_read_lock();
 
 			/*
 			 * We could not apply the delta; warn the user, but
@@ -2107,9 +2341,9 @@ static int fill_pack_entry(const struct object_id *oid,
 	return 1;
 }
 
-static int find_pack_entry(struct packfile_store *store,
-			   const struct object_id *oid,
-			   struct pack_entry *e)
+int packfile_store_find_pack_entry(struct packfile_store *store,
+				   const struct object_id *oid,
+				   struct pack_entry *e)
 {
 	struct packfile_list_entry *l;
 
@@ -2134,7 +2368,7 @@ int packfile_store_freshen_object(struct packfile_store *store,
 				  const struct object_id *oid)
 {
 	struct pack_entry e;
-	if (!find_pack_entry(store, oid, &e))
+	if (!packfile_store_find_pack_entry(store, oid, &e))
 		return 0;
 	if (e.p->is_cruft)
 		return 0;
@@ -2154,7 +2388,7 @@ int packfile_store_read_object_info(struct packfile_store *store,
 	struct pack_entry e;
 	int ret;
 
-	if (!find_pack_entry(store, oid, &e))
+	if (!packfile_store_find_pack_entry(store, oid, &e))
 		return 1;
 
 	/*
@@ -2228,7 +2462,7 @@ int has_object_pack(struct repository *r, const struct object_id *oid)
 
 	odb_prepare_alternates(r->objects);
 	for (source = r->objects->sources; source; source = source->next) {
-		int ret = find_pack_entry(source->packfiles, oid, &e);
+		int ret = packfile_store_find_pack_entry(source->packfiles, oid, &e);
 		if (ret)
 			return ret;
 	}
@@ -2267,6 +2501,7 @@ int for_each_object_in_pack(struct packed_git *p,
 	if (flags & FOR_EACH_OBJECT_PACK_ORDER) {
 		if (load_pack_revindex(p->repo, p))
 			return -1;
+		pack_advise(p, PACK_ACCESS_SEQUENTIAL);
 	}
 
 	for (i = 0; i < p->num_objects; i++) {
@@ -2290,14 +2525,19 @@ int for_each_object_in_pack(struct packed_git *p,
 		else
 			index_pos = i;
 
-		if (nth_packed_object_id(&oid, p, index_pos) < 0)
-			return error("unable to get sha1 of object %u in %s",
-				     index_pos, p->pack_name);
+		if (nth_packed_object_id(&oid, p, index_pos) < 0) {
+			r = error("unable to get sha1 of object %u in %s",
+				  index_pos, p->pack_name);
+			break;
+		}
 
 		r = cb(&oid, p, index_pos, data);
 		if (r)
 			break;
 	}
+
+	if (flags & FOR_EACH_OBJECT_PACK_ORDER)
+		pack_advise(p, PACK_ACCESS_RANDOM);
 	return r;
 }
 
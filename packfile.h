@@ -12,6 +12,8 @@
 struct object_info;
 struct odb_read_stream;
 
+struct pack_entry;
+
 struct packed_git {
 	struct pack_window *windows;
 	off_t pack_size;
@@ -31,7 +33,9 @@ struct packed_git {
 		 do_not_close:1,
 		 pack_promisor:1,
 		 multi_pack_index:1,
-		 is_cruft:1;
+		 is_cruft:1,
+		 mapped_whole:1,
+		 access_sequential:1;
 	unsigned char hash[GIT_MAX_RAWSZ];
 	struct revindex_entry *revindex;
 	const uint32_t *revindex_data;
@@ -260,6 +264,15 @@ struct packed_git *packfile_store_load_pack(struct packfile_store *store,
 int packfile_store_freshen_object(struct packfile_store *store,
 				  const struct object_id *oid);
 
+/*
+ * Find the pack and offset at which the object is stored in the packs of
+ * the store. Returns 1 and fills in `e` if the object was found, 0
+ * otherwise.
+ */
+int packfile_store_find_pack_entry(struct packfile_store *store,
+				   const struct object_id *oid,
+				   struct pack_entry *e);
+
 enum kept_pack_type {
 	KEPT_PACK_ON_DISK = (1 << 0),
 	KEPT_PACK_IN_CORE = (1 << 1),
@@ -375,6 +388,19 @@ uint32_t get_pack_fanout(struct packed_git *p, uint32_t value);
 
 struct object_database;
 
+/*
+ * How the pack is about to be read, so that a pack mapped as a whole (see
+ * core.packedGitMapWhole) can be given matching hints for the kernel.
+ */
+enum pack_access_pattern {
+	/* Objects are looked up in no particular order (the default). */
+	PACK_ACCESS_RANDOM,
+	/* Objects are read in the order they appear in the pack. */
+	PACK_ACCESS_SEQUENTIAL,
+};
+
+void pack_advise(struct packed_git *p, enum pack_access_pattern pattern);
+
 unsigned char *use_pack(struct packed_git *, struct pack_window **, off_t, unsigned long *);
 void close_pack_windows(struct packed_git *);
 void close_pack(struct packed_git *);
@@ -29,32 +29,46 @@
 #define MAX_PARALLEL (20)
 #define THREAD_COST (500)
 
+/*
+ * The entries are handed to the threads in chunks this small, so that
+ * a thread that is done with its share can take over the work of one
+ * stuck in a slow part of the tree.
+ */
+#define CHUNK_SIZE (100)
+
 struct progress_data {
 	unsigned long n;
 	struct progress *progress;
 	pthread_mutex_t mutex;
 };
 
-struct thread_data {
-	pthread_t pthread;
-	struct index_state *index;
+struct worker_data {
 	struct pathspec pathspec;
+	struct cache_def cache;
+	int t2_nr_lstat;
+};
+
+struct preload_data {
+	struct index_state *index;
 	struct progress_data *progress;
+	struct worker_data *workers;
+};
+
+struct chunk {
+	struct preload_data *data;
 	int offset, nr;
-	int t2_nr_lstat;
 };
 
-static void *preload_thread(void *_data)
+static void preload_chunk(void *_chunk, int worker)
 {
 	int nr, last_nr;
-	struct thread_data *p = _data;
+	struct chunk *chunk = _chunk;
+	struct preload_data *p = chunk->data;
+	struct worker_data *w = &p->workers[worker];
 	struct index_state *index = p->index;
-	struct cache_entry **cep = index->cache + p->offset;
-	struct cache_def cache = CACHE_DEF_INIT;
+	struct cache_entry **cep = index->cache + chunk->offset;
 
-	nr = p->nr;
-	if (nr + p->offset > index->cache_nr)
-		nr = index->cache_nr - p->offset;
+	nr = chunk->nr;
 	last_nr = nr;
 
 	do {
@@ -80,11 +94,11 @@ static void *preload_thread(void *_data)
 			pthread_mutex_unlock(&pd->mutex);
 			last_nr = nr;
 		}
-		if (!ce_path_match(index, ce, &p->pathspec, NULL))
+		if (!ce_path_match(index, ce, &w->pathspec, NULL))
 			continue;
-		if (threaded_has_symlink_leading_path(&cache, ce->name, ce_namelen(ce)))
+		if (threaded_has_symlink_leading_path(&w->cache, ce->name, ce_namelen(ce)))
 			continue;
-		p->t2_nr_lstat++;
+		w->t2_nr_lstat++;
 		if (lstat(ce->name, &st))
 			continue;
 		if (ie_match_stat(index, ce, &st, CE_MATCH_RACY_IS_DIRTY|CE_MATCH_IGNORE_FSMONITOR))
@@ -96,19 +110,20 @@ static void *preload_thread(void *_data)
 		struct progress_data *pd = p->progress;
 
 		pthread_mutex_lock(&pd->mutex);
-		display_progress(pd->progress, pd->n + last_nr);
+		pd->n += last_nr;
+		display_progress(pd->progress, pd->n);
 		pthread_mutex_unlock(&pd->mutex);
 	}
-	cache_def_clear(&cache);
-	return NULL;
 }
 
 void preload_index(struct index_state *index,
 		   const struct pathspec *pathspec,
 		   unsigned int refresh_flags)
 {
-	int threads, i, work, offset;
-	struct thread_data data[MAX_PARALLEL];
+	int threads, i, nr_chunks;
+	struct preload_data data;
+	struct chunk *chunks;
+	struct task_pool *pool;
 	struct progress_data pd;
 	int t2_sum_lstat = 0;
 	int core_preload_index = 1;
@@ -129,9 +144,6 @@ void preload_index(struct index_state *index,
 	trace_performance_enter();
 	if (threads > MAX_PARALLEL)
 		threads = MAX_PARALLEL;
-	offset = 0;
-	work = DIV_ROUND_UP(index->cache_nr, threads);
-	memset(&data, 0, sizeof(data));
 
 	memset(&pd, 0, sizeof(pd));
 	if (refresh_flags & REFRESH_PROGRESS && isatty(2)) {
@@ -141,36 +153,44 @@ void preload_index(struct index_state *index,
 		pthread_mutex_init(&pd.mutex, NULL);
 	}
 
+	data.index = index;
+	data.progress = pd.progress ? &pd : NULL;
+	CALLOC_ARRAY(data.workers, threads);
 	for (i = 0; i < threads; i++) {
-		struct thread_data *p = data+i;
-		int err;
+		struct worker_data *w = &data.workers[i];
 
-		p->index = index;
 		if (pathspec)
-			copy_pathspec(&p->pathspec, pathspec);
-		p->offset = offset;
-		p->nr = work;
-		if (pd.progress)
-			p->progress = &pd;
-		offset += work;
-		err = pthread_create(&p->pthread, NULL, preload_thread, p);
-
-		if (err)
-			die(_("unable to create threaded lstat: %s"), strerror(err));
+			copy_pathspec(&w->pathspec, pathspec);
+		strbuf_init(&w->cache.path, 0);
 	}
-	for (i = 0; i < threads; i++) {
-		struct thread_data *p = data+i;
-		if (pthread_join(p->pthread, NULL))
-			die("unable to join threaded lstat");
-		t2_sum_lstat += p->t2_nr_lstat;
+
+	nr_chunks = DIV_ROUND_UP(index->cache_nr, CHUNK_SIZE);
+	ALLOC_ARRAY(chunks, nr_chunks);
+	pool = task_pool_new(threads);
+	for (i = 0; i < nr_chunks; i++) {
+		struct chunk *chunk = &chunks[i];
+
+		chunk->data = &data;
+		chunk->offset = i * CHUNK_SIZE;
+		chunk->nr = CHUNK_SIZE;
+		if (chunk->offset + chunk->nr > index->cache_nr)
+			chunk->nr = index->cache_nr - chunk->offset;
+		task_pool_add(pool, preload_chunk, chunk);
 	}
+	task_pool_free(pool);
+	free(chunks);
 	stop_progress(&pd.progress);
 
-	if (pathspec) {
+	for (i = 0; i < threads; i++) {
+		struct worker_data *w = &data.workers[i];
+
+		t2_sum_lstat += w->t2_nr_lstat;
+		cache_def_clear(&w->cache);
 		/* earlier we made deep copies for each thread to work with */
-		for (i = 0; i < threads; i++)
-			clear_pathspec(&data[i].pathspec);
+		if (pathspec)
+			clear_pathspec(&w->pathspec);
 	}
+	free(data.workers);
 
 	trace_performance_leave("preload index");
 
@@ -154,6 +154,9 @@ void prepare_repo_settings(struct repository *r)
 
 	if (!repo_config_get_ulong(r, "core.packedgitlimit", &ulongval))
 		r->settings.packed_git_limit = ulongval;
+
+	repo_cfg_bool(r, "core.packedgitmapwhole",
+		      &r->settings.packed_git_map_whole, 0);
 }
 
 void repo_settings_clear(struct repository *r)
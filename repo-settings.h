@@ -65,6 +65,7 @@ struct repo_settings {
 	size_t delta_base_cache_limit;
 	size_t packed_git_window_size;
 	size_t packed_git_limit;
+	int packed_git_map_whole;
 	unsigned long big_file_threshold;
 
 	int max_allowed_tree_depth;
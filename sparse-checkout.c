@@ -0,0 +1,672 @@
+#define USE_THE_REPOSITORY_VARIABLE
+#define DISABLE_SIGN_COMPARE_WARNINGS
+
+#include "git-compat-util.h"
+#include "sparse-checkout.h"
+#include "config.h"
+#include "dir.h"
+#include "environment.h"
+#include "gettext.h"
+#include "hashmap.h"
+#include "lockfile.h"
+#include "path.h"
+#include "pathspec.h"
+#include "read-cache-ll.h"
+#include "repository.h"
+#include "setup.h"
+#include "sparse-index.h"
+#include "strbuf.h"
+#include "string-list.h"
+#include "strvec.h"
+#include "trace2.h"
+#include "unpack-trees.h"
+#include "worktree.h"
+
+void write_patterns_to_file(FILE *fp, struct pattern_list *pl)
+{
+	int i;
+
+	for (i = 0; i < pl->nr; i++) {
+		struct path_pattern *p = pl->patterns[i];
+
+		if (p->flags & PATTERN_FLAG_NEGATIVE)
+			fprintf(fp, "!");
+
+		fprintf(fp, "%s", p->pattern);
+
+		if (p->flags & PATTERN_FLAG_MUSTBEDIR)
+			fprintf(fp, "/");
+
+		fprintf(fp, "\n");
+	}
+}
+
+/*
+ * Remove the directory `name` of the worktree, which `path` must hold the
+ * leading path of, unless it contains untracked files.
+ */
+static void clean_sparse_directory(struct repository *r, struct strbuf *path,
+				   const char *name)
+{
+	struct dir_struct dir = DIR_INIT;
+	struct pathspec p = { 0 };
+	struct strvec s = STRVEC_INIT;
+
+	strbuf_addstr(path, name);
+
+	dir.flags |= DIR_SHOW_IGNORED_TOO;
+
+	setup_standard_excludes(&dir);
+	strvec_push(&s, path->buf);
+
+	parse_pathspec(&p, PATHSPEC_GLOB, 0, NULL, s.v);
+	fill_directory(&dir, r->index, &p);
+
+	if (dir.nr) {
+		warning(_("directory '%s' contains untracked files,"
+			  " but is not in the sparse-checkout cone"),
+			name);
+	} else if (remove_dir_recursively(path, 0)) {
+		/*
+		 * Removal is "best effort". If something blocks
+		 * the deletion, then continue with a warning.
+		 */
+		warning(_("failed to remove directory '%s'"),
+			name);
+	}
+
+	strvec_clear(&s);
+	clear_pathspec(&p);
+	dir_clear(&dir);
+}
+
+void clean_tracked_sparse_directories(struct repository *r)
+{
+	int i, was_full = 0;
+	struct strbuf path = STRBUF_INIT;
+	size_t pathlen;
+	struct string_list_item *item;
+	struct string_list sparse_dirs = STRING_LIST_INIT_DUP;
+
+	/*
+	 * If we are not using cone mode patterns, then we cannot
+	 * delete directories outside of the sparse cone.
+	 */
+	if (!r || !r->index || !r->worktree)
+		return;
+	if (init_sparse_checkout_patterns(r->index) ||
+	    !r->index->sparse_checkout_patterns->use_cone_patterns)
+		return;
+
+	/*
+	 * Use the sparse index as a data structure to assist finding
+	 * directories that are safe to delete. This conversion to a
+	 * sparse index will not delete directories that contain
+	 * conflicted entries or submodules.
+	 */
+	if (r->index->sparse_index == INDEX_EXPANDED) {
+		/*
+		 * If something, such as a merge conflict or other concern,
+		 * prevents us from converting to a sparse index, then do
+		 * not try deleting files.
+		 */
+		if (convert_to_sparse(r->index, SPARSE_INDEX_MEMORY_ONLY))
+			return;
+		was_full = 1;
+	}
+
+	strbuf_addstr(&path, r->worktree);
+	strbuf_complete(&path, '/');
+	pathlen = path.len;
+
+	/*
+	 * Collect directories that have gone out of scope but also
+	 * exist on disk, so there is some work to be done. We need to
+	 * store the entries in a list before exploring, since that might
+	 * expand the sparse-index again.
+	 */
+	for (i = 0; i < r->index->cache_nr; i++) {
+		struct cache_entry *ce = r->index->cache[i];
+
+		if (S_ISSPARSEDIR(ce->ce_mode) &&
+		    repo_file_exists(r, ce->name))
+			string_list_append(&sparse_dirs, ce->name);
+	}
+
+	for_each_string_list_item(item, &sparse_dirs) {
+		strbuf_setlen(&path, pathlen);
+		clean_sparse_directory(r, &path, item->string);
+	}
+
+	string_list_clear(&sparse_dirs, 0);
+	strbuf_release(&path);
+
+	if (was_full)
+		ensure_full_index(r->index);
+}
+
+/*
+ * Whether the sparse directory `dir` could be collapsed into a single
+ * sparse-directory entry, i.e. holds neither conflicts, nor submodules,
+ * nor files that were kept in the worktree.
+ */
+static int can_clean_directory(struct index_state *istate, const char *dir)
+{
+	struct strbuf prefix = STRBUF_INIT;
+	int pos, ret = 1;
+
+	strbuf_addf(&prefix, "%s/", dir);
+	pos = index_name_pos_sparse(istate, prefix.buf, prefix.len);
+	if (pos < 0)
+		pos = -pos - 1;
+
+	for (; pos < istate->cache_nr; pos++) {
+		struct cache_entry *ce = istate->cache[pos];
+
+		if (!starts_with(ce->name, prefix.buf))
+			break;
+		if (ce_stage(ce) || !ce_skip_worktree(ce) ||
+		    S_ISGITLINK(ce->ce_mode)) {
+			ret = 0;
+			break;
+		}
+	}
+
+	strbuf_release(&prefix);
+	return ret;
+}
+
+/*
+ * Like clean_tracked_sparse_directories(), but only look at the
+ * directories `dirs` whose sparsity just changed. For each one that left
+ * the cone of `pl`, its outermost leading directory that left as well is
+ * removed.
+ */
+static void clean_changed_sparse_directories(struct repository *r,
+					     struct pattern_list *pl,
+					     const struct string_list *dirs)
+{
+	struct string_list sparse_dirs = STRING_LIST_INIT_DUP;
+	struct string_list_item *item;
+	struct strbuf path = STRBUF_INIT;
+	size_t pathlen;
+
+	for_each_string_list_item(item, dirs) {
+		const char *slash = item->string;
+		int dtype = DT_DIR;
+
+		do {
+			slash = strchrnul(slash + 1, '/');
+			strbuf_reset(&path);
+			strbuf_add(&path, item->string, slash - item->string);
+			strbuf_addch(&path, '/');
+			if (path_matches_pattern_list(path.buf, path.len, "",
+						      &dtype, pl, r->index) == NOT_MATCHED) {
+				strbuf_setlen(&path, path.len - 1);
+				string_list_insert(&sparse_dirs, path.buf);
+				break;
+			}
+		} while (*slash);
+	}
+
+	strbuf_reset(&path);
+	strbuf_addstr(&path, r->worktree);
+	strbuf_complete(&path, '/');
+	pathlen = path.len;
+
+	for_each_string_list_item(item, &sparse_dirs) {
+		if (!repo_file_exists(r, item->string) ||
+		    !can_clean_directory(r->index, item->string))
+			continue;
+		strbuf_setlen(&path, pathlen);
+		clean_sparse_directory(r, &path, item->string);
+	}
+
+	string_list_clear(&sparse_dirs, 0);
+	strbuf_release(&path);
+}
+
+static int update_working_directory_1(struct repository *r,
+				      struct pattern_list *pl,
+				      const struct string_list *dirs,
+				      const struct string_list *parents)
+{
+	enum update_sparsity_result result;
+	struct unpack_trees_options o;
+	struct lock_file lock_file = LOCK_INIT;
+	struct pattern_list *old_pl;
+
+	/* If no branch has been checked out, there are no updates to make. */
+	if (is_index_unborn(r->index))
+		return UPDATE_SPARSITY_SUCCESS;
+
+	old_pl = r->index->sparse_checkout_patterns;
+	r->index->sparse_checkout_patterns = pl;
+
+	memset(&o, 0, sizeof(o));
+	o.verbose_update = isatty(2);
+	o.update = 1;
+	o.head_idx = -1;
+	o.src_index = r->index;
+	o.dst_index = r->index;
+	o.skip_sparse_checkout = 0;
+
+	setup_work_tree();
+
+	repo_hold_locked_index(r, &lock_file, LOCK_DIE_ON_ERROR);
+
+	setup_unpack_trees_porcelain(&o, "sparse-checkout");
+	if (dirs)
+		result = update_sparsity_dirs(&o, pl, dirs, parents);
+	else
+		result = update_sparsity(&o, pl);
+	clear_unpack_trees_porcelain(&o);
+
+	if (result == UPDATE_SPARSITY_WARNINGS)
+		/*
+		 * We don't do any special handling of warnings from untracked
+		 * files in the way or dirty entries that can't be removed.
+		 */
+		result = UPDATE_SPARSITY_SUCCESS;
+	if (result == UPDATE_SPARSITY_SUCCESS)
+		write_locked_index(r->index, &lock_file, COMMIT_LOCK);
+	else
+		rollback_lock_file(&lock_file);
+
+	if (dirs)
+		clean_changed_sparse_directories(r, pl, dirs);
+	else
+		clean_tracked_sparse_directories(r);
+
+	if (r->index->sparse_checkout_patterns != pl) {
+		clear_pattern_list(r->index->sparse_checkout_patterns);
+		FREE_AND_NULL(r->index->sparse_checkout_patterns);
+	}
+	r->index->sparse_checkout_patterns = old_pl;
+
+	return result;
+}
+
+int update_working_directory(struct repository *r,
+			     struct pattern_list *pl)
+{
+	return update_working_directory_1(r, pl, NULL, NULL);
+}
+
+static char *escaped_pattern(char *pattern)
+{
+	char *p = pattern;
+	struct strbuf final = STRBUF_INIT;
+
+	while (*p) {
+		if (is_glob_special(*p))
+			strbuf_addch(&final, '\\');
+
+		strbuf_addch(&final, *p);
+		p++;
+	}
+
+	return strbuf_detach(&final, NULL);
+}
+
+static void write_cone_to_file(FILE *fp, struct pattern_list *pl)
+{
+	int i;
+	struct pattern_entry *pe;
+	struct hashmap_iter iter;
+	struct string_list sl = STRING_LIST_INIT_DUP;
+	struct strbuf parent_pattern = STRBUF_INIT;
+
+	hashmap_for_each_entry(&pl->parent_hashmap, &iter, pe, ent) {
+		if (hashmap_get_entry(&pl->recursive_hashmap, pe, ent, NULL))
+			continue;
+
+		if (!hashmap_contains_parent(&pl->recursive_hashmap,
+					     pe->pattern,
+					     &parent_pattern))
+			string_list_append(&sl, pe->pattern);
+	}
+
+	string_list_sort(&sl);
+	string_list_remove_duplicates(&sl, 0);
+
+	fprintf(fp, "/*\n!/*/\n");
+
+	for (i = 0; i < sl.nr; i++) {
+		char *pattern = escaped_pattern(sl.items[i].string);
+
+		if (strlen(pattern))
+			fprintf(fp, "%s/\n!%s/*/\n", pattern, pattern);
+		free(pattern);
+	}
+
+	string_list_clear(&sl, 0);
+
+	hashmap_for_each_entry(&pl->recursive_hashmap, &iter, pe, ent) {
+		if (!hashmap_contains_parent(&pl->recursive_hashmap,
+					     pe->pattern,
+					     &parent_pattern))
+			string_list_append(&sl, pe->pattern);
+	}
+
+	strbuf_release(&parent_pattern);
+
+	string_list_sort(&sl);
+	string_list_remove_duplicates(&sl, 0);
+
+	for (i = 0; i < sl.nr; i++) {
+		char *pattern = escaped_pattern(sl.items[i].string);
+		fprintf(fp, "%s/\n", pattern);
+		free(pattern);
+	}
+
+	string_list_clear(&sl, 0);
+}
+
+static int write_patterns_and_update_1(struct repository *repo,
+				       struct pattern_list *pl,
+				       const struct string_list *dirs,
+				       const struct string_list *parents)
+{
+	char *sparse_filename;
+	FILE *fp;
+	struct lock_file lk = LOCK_INIT;
+	int result;
+
+	sparse_filename = get_sparse_checkout_filename();
+
+	if (safe_create_leading_directories(repo, sparse_filename))
+		die(_("failed to create directory for sparse-checkout file"));
+
+	hold_lock_file_for_update(&lk, sparse_filename, LOCK_DIE_ON_ERROR);
+
+	result = update_working_directory_1(repo, pl, dirs, parents);
+	if (result) {
+		rollback_lock_file(&lk);
+		update_working_directory(repo, NULL);
+		goto out;
+	}
+
+	fp = fdopen_lock_file(&lk, "w");
+	if (!fp)
+		die_errno(_("unable to fdopen %s"), get_lock_file_path(&lk));
+
+	if (core_sparse_checkout_cone)
+		write_cone_to_file(fp, pl);
+	else
+		write_patterns_to_file(fp, pl);
+
+	if (commit_lock_file(&lk))
+		die_errno(_("unable to write %s"), sparse_filename);
+
+out:
+	clear_pattern_list(pl);
+	free(sparse_filename);
+	return result;
+}
+
+int write_patterns_and_update(struct repository *repo,
+			      struct pattern_list *pl)
+{
+	return write_patterns_and_update_1(repo, pl, NULL, NULL);
+}
+
+int set_sparse_checkout_config(struct repository *repo,
+			       enum sparse_checkout_mode mode)
+{
+	/* Update to use worktree config, if not already. */
+	if (init_worktree_config(repo)) {
+		error(_("failed to initialize worktree config"));
+		return 1;
+	}
+
+	if (repo_config_set_worktree_gently(repo,
+					    "core.sparseCheckout",
+					    mode ? "true" : "false") ||
+	    repo_config_set_worktree_gently(repo,
+					    "core.sparseCheckoutCone",
+					    mode == MODE_CONE_PATTERNS ?
+						"true" : "false"))
+		return 1;
+
+	if (mode == MODE_NO_PATTERNS)
+		return set_sparse_index_config(repo, 0);
+
+	return 0;
+}
+
+void insert_recursive_pattern(struct pattern_list *pl, struct strbuf *path)
+{
+	struct pattern_entry *e = xmalloc(sizeof(*e));
+	e->patternlen = path->len;
+	e->pattern = strbuf_detach(path, NULL);
+	hashmap_entry_init(&e->ent, fspathhash(e->pattern));
+
+	hashmap_add(&pl->recursive_hashmap, &e->ent);
+
+	while (e->patternlen) {
+		char *slash = strrchr(e->pattern, '/');
+		char *oldpattern = e->pattern;
+		size_t newlen;
+		struct pattern_entry *dup;
+
+		if (!slash || slash == e->pattern)
+			break;
+
+		newlen = slash - e->pattern;
+		e = xmalloc(sizeof(struct pattern_entry));
+		e->patternlen = newlen;
+		e->pattern = xstrndup(oldpattern, newlen);
+		hashmap_entry_init(&e->ent, fspathhash(e->pattern));
+
+		dup = hashmap_get_entry(&pl->parent_hashmap, e, ent, NULL);
+		if (!dup) {
+			hashmap_add(&pl->parent_hashmap, &e->ent);
+		} else {
+			free(e->pattern);
+			free(e);
+			e = dup;
+		}
+	}
+}
+
+void strbuf_to_cone_pattern(struct strbuf *line, struct pattern_list *pl)
+{
+	strbuf_trim(line);
+
+	strbuf_trim_trailing_dir_sep(line);
+
+	if (strbuf_normalize_path(line))
+		die(_("could not normalize path %s"), line->buf);
+
+	if (!line->len)
+		return;
+
+	if (line->buf[0] != '/')
+		strbuf_insertstr(line, 0, "/");
+
+	insert_recursive_pattern(pl, line);
+}
+
+/*
+ * Collect the directories included recursively by the cone-mode patterns
+ * `pl`, leaving out those inside another one, without the leading slash.
+ */
+static void get_cone_dirs(struct pattern_list *pl, struct string_list *dirs)
+{
+	struct pattern_entry *pe;
+	struct hashmap_iter iter;
+	struct strbuf parent_pattern = STRBUF_INIT;
+
+	hashmap_for_each_entry(&pl->recursive_hashmap, &iter, pe, ent) {
+		if (!hashmap_contains_parent(&pl->recursive_hashmap,
+					     pe->pattern, &parent_pattern))
+			string_list_append(dirs, pe->pattern + 1);
+	}
+	strbuf_release(&parent_pattern);
+
+	string_list_sort(dirs);
+	string_list_remove_duplicates(dirs, 0);
+}
+
+/*
+ * Read the cone of the current sparse-checkout file into `dirs`. Returns
+ * -1 if the worktree does not follow cone-mode patterns.
+ */
+static int read_cone_dirs(struct string_list *dirs)
+{
+	struct pattern_list pl;
+	int ret = -1;
+
+	if (!core_apply_sparse_checkout || !core_sparse_checkout_cone)
+		return -1;
+
+	memset(&pl, 0, sizeof(pl));
+	if (!get_sparse_checkout_patterns(&pl) && pl.use_cone_patterns) {
+		get_cone_dirs(&pl, dirs);
+		ret = 0;
+	}
+	clear_pattern_list(&pl);
+	return ret;
+}
+
+/*
+ * Compute the directories whose sparsity differs between the sorted cones
+ * `old_dirs` and `new_dirs`, keeping only the outermost ones, and all
+ * their leading directories.
+ */
+static void diff_cone_dirs(const struct string_list *old_dirs,
+			   const struct string_list *new_dirs,
+			   struct string_list *dirs,
+			   struct string_list *parents)
+{
+	struct string_list changed = STRING_LIST_INIT_NODUP;
+	struct string_list_item *item;
+	const char **open;
+	size_t open_nr = 0, i = 0, j = 0;
+
+	while (i < old_dirs->nr || j < new_dirs->nr) {
+		int cmp;
+
+		if (i == old_dirs->nr)
+			cmp = 1;
+		else if (j == new_dirs->nr)
+			cmp = -1;
+		else
+			cmp = strcmp(old_dirs->items[i].string,
+				     new_dirs->items[j].string);
+
+		if (cmp < 0)
+			string_list_append(&changed, old_dirs->items[i++].string);
+		else if (cmp > 0)
+			string_list_append(&changed, new_dirs->items[j++].string);
+		else
+			i++, j++;
+	}
+	string_list_sort(&changed);
+
+	/*
+	 * Directories inside a changed one sort after it, possibly
+	 * interleaved with siblings like "a-b" that only share its textual
+	 * prefix, so keep the directories that are still open on a stack.
+	 */
+	CALLOC_ARRAY(open, changed.nr);
+	for_each_string_list_item(item, &changed) {
+		const char *rest = NULL, *slash;
+
+		while (open_nr &&
+		       (!skip_prefix(item->string, open[open_nr - 1], &rest) ||
+			*rest > '/'))
+			open_nr--;
+		if (open_nr && *rest == '/')
+			continue;
+		open[open_nr++] = item->string;
+		string_list_append(dirs, item->string);
+
+		for (slash = strchr(item->string, '/'); slash;
+		     slash = strchr(slash + 1, '/'))
+			string_list_append_nodup(parents,
+				xstrndup(item->string, slash - item->string));
+	}
+	string_list_sort(parents);
+	string_list_remove_duplicates(parents, 0);
+
+	free(open);
+	string_list_clear(&changed, 0);
+}
+
+int sparse_checkout_set_cone_dirs(struct repository *repo,
+				  const char **dirs, size_t nr)
+{
+	struct pattern_list *pl;
+	struct strbuf line = STRBUF_INIT;
+	struct string_list old_cone = STRING_LIST_INIT_DUP;
+	struct string_list new_cone = STRING_LIST_INIT_DUP;
+	struct string_list changed = STRING_LIST_INIT_DUP;
+	struct string_list parents = STRING_LIST_INIT_DUP;
+	int incremental, result;
+
+	setup_work_tree();
+	repo_read_index(repo);
+
+	/*
+	 * Cone-mode patterns only name directories; refuse files before
+	 * anything is written, like 'sparse-checkout set' does.
+	 */
+	for (size_t i = 0; i < nr; i++) {
+		int pos = index_name_pos(repo->index, dirs[i], strlen(dirs[i]));
+
+		if (pos >= 0 && !S_ISSPARSEDIR(repo->index->cache[pos]->ce_mode))
+			return error(_("'%s' is not a directory"), dirs[i]);
+	}
+
+	incremental = !read_cone_dirs(&old_cone);
+	if (!core_apply_sparse_checkout || !core_sparse_checkout_cone) {
+		if (set_sparse_checkout_config(repo, MODE_CONE_PATTERNS))
+			return error(_("failed to enable sparse-checkout"));
+		core_apply_sparse_checkout = 1;
+		core_sparse_checkout_cone = 1;
+	}
+
+	CALLOC_ARRAY(pl, 1);
+	hashmap_init(&pl->recursive_hashmap, pl_hashmap_cmp, NULL, 0);
+	hashmap_init(&pl->parent_hashmap, pl_hashmap_cmp, NULL, 0);
+	pl->use_cone_patterns = 1;
+
+	for (size_t i = 0; i < nr; i++) {
+		strbuf_reset(&line);
+		strbuf_addstr(&line, dirs[i]);
+		strbuf_to_cone_pattern(&line, pl);
+	}
+	strbuf_release(&line);
+
+	if (!incremental) {
+		result = write_patterns_and_update(repo, pl);
+		goto out;
+	}
+
+	/*
+	 * The worktree already follows a cone: only the directories that
+	 * enter or leave it need to be checked out or removed.
+	 */
+	get_cone_dirs(pl, &new_cone);
+	diff_cone_dirs(&old_cone, &new_cone, &changed, &parents);
+	trace2_data_intmax("sparse-checkout", repo, "cone/changed", changed.nr);
+	if (!changed.nr) {
+		clear_pattern_list(pl);
+		result = 0;
+		goto out;
+	}
+
+	trace2_region_enter("sparse-checkout", "update-cone", repo);
+	result = write_patterns_and_update_1(repo, pl, &changed, &parents);
+	trace2_region_leave("sparse-checkout", "update-cone", repo);
+
+out:
+	string_list_clear(&old_cone, 0);
+	string_list_clear(&new_cone, 0);
+	string_list_clear(&changed, 0);
+	string_list_clear(&parents, 0);
+	free(pl);
+	return result;
+}
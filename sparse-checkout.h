@@ -0,0 +1,63 @@
+#ifndef SPARSE_CHECKOUT_H
+#define SPARSE_CHECKOUT_H
+
+struct pattern_list;
+struct repository;
+struct strbuf;
+
+enum sparse_checkout_mode {
+	MODE_NO_PATTERNS = 0,
+	MODE_ALL_PATTERNS = 1,
+	MODE_CONE_PATTERNS = 2,
+};
+
+/*
+ * Record `mode` in the worktree config of `repo`, as core.sparseCheckout
+ * and core.sparseCheckoutCone. Returns non-zero on failure.
+ */
+int set_sparse_checkout_config(struct repository *repo,
+			       enum sparse_checkout_mode mode);
+
+/* Write the patterns of a non-cone `pl` in sparse-checkout file syntax. */
+void write_patterns_to_file(FILE *fp, struct pattern_list *pl);
+
+/*
+ * Remove the directories outside of the sparse-checkout cone that are
+ * still present in the worktree, as long as they contain no untracked
+ * files.
+ */
+void clean_tracked_sparse_directories(struct repository *r);
+
+/*
+ * Update the SKIP_WORKTREE bits of the index of `r` and the worktree to
+ * match the patterns `pl`, or the patterns in the sparse-checkout file if
+ * `pl` is NULL. Returns an `enum update_sparsity_result`.
+ */
+int update_working_directory(struct repository *r, struct pattern_list *pl);
+
+/*
+ * Update the worktree to match `pl` and, if that succeeds, write `pl`
+ * to the sparse-checkout file. `pl` is cleared either way.
+ */
+int write_patterns_and_update(struct repository *repo, struct pattern_list *pl);
+
+/*
+ * Add the cone-mode pattern for the directory `path` to `pl`. The
+ * strbufs are consumed.
+ */
+void insert_recursive_pattern(struct pattern_list *pl, struct strbuf *path);
+void strbuf_to_cone_pattern(struct strbuf *line, struct pattern_list *pl);
+
+/*
+ * Restrict the worktree of `repo` to the directories `dirs`, as
+ * `git sparse-checkout set --cone <dirs>...` would, without spawning
+ * it. Every directory is checked against the index before the
+ * sparse-checkout definition or the worktree is modified. If the
+ * worktree already follows cone-mode patterns, only the entries in the
+ * directories that enter or leave the cone are updated. Returns 0 on
+ * success, and reports an error otherwise.
+ */
+int sparse_checkout_set_cone_dirs(struct repository *repo,
+				  const char **dirs, size_t nr);
+
+#endif /* SPARSE_CHECKOUT_H */
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# This test measures the threaded index and grep code on a tree
+# where most of the work is in a few places: one directory holds
+# half of the files, and the files in it are much larger than the
+# rest.  Splitting such a tree into one part per thread up front
+# leaves most threads idle while one of them does most of the work.
+
+test_description="Tests performance of threads on a skewed tree"
+
+. ./perf-lib.sh
+
+test_perf_fresh_repo
+
+test_expect_success 'setup skewed tree' '
+	mkdir -p heavy &&
+	for i in $(test_seq 1 50)
+	do
+		mkdir -p light/$i || return 1
+		for j in $(test_seq 1 100)
+		do
+			echo "light $i $j" >light/$i/$j.txt || return 1
+		done
+	done &&
+	for i in $(test_seq 1 5000)
+	do
+		test_seq 1 200 >heavy/$i.txt || return 1
+	done &&
+	git add . &&
+	git commit -q -m skewed
+'
+
+test_perf 'status' '
+	git -c core.preloadIndex=true status
+'
+
+test_perf 'status (no preload)' '
+	git -c core.preloadIndex=false status
+'
+
+test_perf 'grep worktree' '
+	git grep --threads=0 -c needle || :
+'
+
+test_perf 'grep worktree, 1 thread' '
+	git grep --threads=1 -c needle || :
+'
+
+test_perf 'grep HEAD' '
+	git grep --threads=0 -c needle HEAD || :
+'
+
+test_done
@@ -71,4 +71,18 @@ done
 
 test_all_with_args --path-walk
 
+# Delta search should scale with the number of threads.
+for threads in 1 2 4 8 16 32 64
+do
+	test_perf "repack with --threads=$threads" "
+		git repack -adf --threads=$threads
+	"
+
+	test_size "repack size with --threads=$threads" '
+		gitdir=$(git rev-parse --git-dir) &&
+		pack=$(ls $gitdir/objects/pack/pack-*.pack) &&
+		test_file_size "$pack"
+	'
+done
+
 test_done
@@ -19,5 +19,11 @@ test_perf 'grep --cached, cheap regex' '
 test_perf 'grep --cached, expensive regex' '
 	git grep --cached "^.* *some_nonexistent_string$" || :
 '
+test_perf 'grep HEAD, cheap regex' '
+	git grep some_nonexistent_string HEAD || :
+'
+test_perf 'grep HEAD, cheap regex, 1 thread' '
+	git grep --threads=1 some_nonexistent_string HEAD || :
+'
 
 test_done
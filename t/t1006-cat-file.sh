@@ -1143,6 +1143,52 @@ test_expect_success 'set up object list for --batch-all-objects tests' '
 	git -C all-two cat-file --batch-all-objects --batch-check="%(objectname)" >objects
 '
 
+test_expect_success 'cat-file --batch --buffer --unordered reads objects from stdin' '
+	git -C all-two cat-file --batch-all-objects \
+		--batch-check="%(objectname) %(objecttype)" >types &&
+	sed -n "s/ blob\$/ rest/p" types >blobs &&
+	echo no-such-object >>blobs &&
+	git -C all-two cat-file --batch="%(objectname) %(rest)" <blobs >expect.raw &&
+	git -C all-two cat-file --batch="%(objectname) %(rest)" --unordered \
+		--buffer <blobs >actual.raw &&
+	grep "^no-such-object missing\$" actual.raw &&
+	grep -v missing expect.raw | paste -d" " - - - | sort >expect &&
+	grep -v missing actual.raw | paste -d" " - - - | sort >actual &&
+	test_line_count = 3 actual &&
+	test_cmp expect actual &&
+
+	# Without --buffer, answer each name as it is read.
+	git -C all-two cat-file --batch="%(objectname) %(rest)" --unordered \
+		<blobs >actual.raw &&
+	test_cmp expect.raw actual.raw
+'
+
+test_expect_success 'cat-file --batch --buffer --unordered streams large blobs' '
+	test_when_finished "rm -rf big-repo" &&
+	git init big-repo &&
+	test-tool genrandom big $((5 * 1024 * 1024)) >big-repo/big &&
+	echo small >big-repo/small &&
+	git -C big-repo add big small &&
+	git -C big-repo commit -m big &&
+	git -C big-repo repack -ad &&
+	git -C big-repo rev-parse HEAD:big >oids &&
+	GIT_ALLOC_LIMIT=1m git -C big-repo -c core.bigFileThreshold=100k \
+		cat-file --batch <oids >expect &&
+	GIT_ALLOC_LIMIT=1m git -C big-repo -c core.bigFileThreshold=100k \
+		cat-file --batch --buffer --unordered <oids >actual &&
+	test_cmp_bin expect actual &&
+
+	# Mixed with small objects, which are read in pack order.
+	git -C big-repo rev-parse HEAD:small HEAD >>oids &&
+	GIT_ALLOC_LIMIT=1m git -C big-repo -c core.bigFileThreshold=100k \
+		cat-file --batch <oids >expect &&
+	GIT_ALLOC_LIMIT=1m git -C big-repo -c core.bigFileThreshold=100k \
+		cat-file --batch --buffer --unordered <oids >actual &&
+	test_file_size expect >expect.size &&
+	test_file_size actual >actual.size &&
+	test_cmp expect.size actual.size
+'
+
 test_expect_success 'cat-file --batch="%(objectname)" with --batch-all-objects will work' '
 	git -C all-two cat-file --batch="%(objectname)" <objects >expect &&
 	git -C all-two cat-file --batch-all-objects --batch="%(objectname)" >actual &&
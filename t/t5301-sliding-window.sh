@@ -58,4 +58,27 @@ test_expect_success 'verify-pack -v, defaults' '
 	git verify-pack -v "$pack2"
 '
 
+test_expect_success 'read objects with packedGitMapWhole' '
+	git cat-file --batch-all-objects --batch >expect &&
+	git -c core.packedGitMapWhole=true \
+		cat-file --batch-all-objects --batch >actual &&
+	test_cmp expect actual &&
+	git -c core.packedGitMapWhole=true -c core.packedGitLimit=512 \
+		cat-file --batch-all-objects --batch --unordered >actual &&
+	git cat-file --batch-all-objects --batch --unordered >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'repack -a -d, packedGitMapWhole' '
+	git config core.packedGitMapWhole true &&
+	commit3=$(git commit-tree $tree -p $commit2 </dev/null) &&
+	git update-ref HEAD $commit3 &&
+	git repack -a -d &&
+	test "$(git count-objects)" = "0 objects, 0 kilobytes" &&
+	pack3=$(ls .git/objects/pack/*.pack) &&
+	git verify-pack -v "$pack3" &&
+	git fsck &&
+	git config --unset core.packedGitMapWhole
+'
+
 test_done
@@ -328,6 +328,65 @@ test_expect_success 'rev-list W/ --missing=print and --missing=allow-any for tre
 	test_must_be_empty rev_list_err
 '
 
+# Test module:<name> filter with objects given directly.
+
+test_expect_success 'setup r-module' '
+	git init r-module &&
+	mkdir r-module/a r-module/b &&
+	echo a >r-module/a/file &&
+	echo b >r-module/b/file &&
+	cat >r-module/.modgit <<-\EOF &&
+	[module "a"]
+		path = a
+	EOF
+	git -C r-module add . &&
+	git -C r-module commit -m "modules" &&
+	git -C r-module tag -a -m "tree" tree-tag HEAD:b
+'
+
+test_expect_success 'verify module:<name> includes a tree tagged directly' '
+	git -C r-module rev-list --objects --filter=module:a \
+		--filter-print-omitted --all >revs &&
+	git -C r-module rev-parse HEAD:b/file HEAD:a/file >expected &&
+	for oid in $(cat expected)
+	do
+		grep "^$oid" revs || return 1
+	done &&
+	test_grep ! "^~" revs
+'
+
+test_expect_success 'verify module:<name> includes a tree named directly' '
+	git -C r-module rev-list --objects --filter=module:a HEAD:b >revs &&
+	git -C r-module rev-parse HEAD:b HEAD:b/file >expected &&
+	awk -f print_1.awk revs >observed &&
+	test_cmp expected observed
+'
+
+test_expect_success 'verify module:<name> shows a tree reached at two paths once' '
+	git init r-module-dup &&
+	mkdir -p r-module-dup/x/y r-module-dup/z/y &&
+	echo y >r-module-dup/x/y/file &&
+	echo y >r-module-dup/z/y/file &&
+	cat >r-module-dup/.modgit <<-\EOF &&
+	[module "m"]
+		path = x/y
+		path = z
+	EOF
+	git -C r-module-dup add . &&
+	git -C r-module-dup commit -m "same tree twice" &&
+	test "$(git -C r-module-dup rev-parse HEAD:x)" = \
+	     "$(git -C r-module-dup rev-parse HEAD:z)" &&
+	git -C r-module-dup rev-list --objects --filter=module:m HEAD >revs &&
+	awk -f print_1.awk revs | sort >observed &&
+	sort -u observed >expected &&
+	test_cmp expected observed &&
+	git -C r-module-dup rev-parse HEAD:x HEAD:x/y HEAD:x/y/file >wanted &&
+	for oid in $(cat wanted)
+	do
+		grep "^$oid" revs || return 1
+	done
+'
+
 # Test tree:0 filter.
 
 test_expect_success 'verify tree:0 includes trees in "filtered" output' '
@@ -571,6 +571,66 @@ test_expect_success 'flush cached data' '
 	grep "file_3" actual_q3
 '
 
+# With fsmonitor.sharedMemory, the daemon publishes the changed paths in
+# a ring buffer that clients read directly, unless the paths they need
+# have already been overwritten.
+
+test_expect_success 'setup shared memory' '
+	git init test_ring &&
+	>test_ring/tracked &&
+	git -C test_ring add tracked &&
+	git -C test_ring commit -m initial &&
+	git -C test_ring config core.fsmonitor true &&
+	git -C test_ring config fsmonitor.sharedMemory true
+'
+
+test_expect_success 'changed paths are read from shared memory' '
+	test_when_finished "test_might_fail git -C test_ring fsmonitor--daemon stop" &&
+
+	start_daemon -C test_ring &&
+	test_path_is_file test_ring/.git/fsmonitor--daemon/changes &&
+	git -C test_ring update-index --fsmonitor &&
+	git -C test_ring status &&
+
+	echo 1 >test_ring/tracked &&
+	>test_ring/untracked &&
+	GIT_TRACE2_EVENT="$PWD/trace_ring" git -C test_ring status --porcelain >actual &&
+	cat >expect <<-\EOF &&
+	 M tracked
+	?? untracked
+	EOF
+	test_cmp expect actual &&
+	test_region fsmonitor apply_ring trace_ring &&
+	! have_t2_data_event fsm_client query/ring-overwritten <trace_ring &&
+
+	git -C test_ring fsmonitor--daemon stop &&
+	test_path_is_missing test_ring/.git/fsmonitor--daemon/changes
+'
+
+test_expect_success 'overwritten shared memory falls back to IPC' '
+	test_when_finished "test_might_fail git -C test_ring fsmonitor--daemon stop" &&
+	git -C test_ring -c core.fsmonitor=false reset --hard &&
+	git -C test_ring -c core.fsmonitor=false clean -fd &&
+
+	(
+		GIT_TEST_FSMONITOR_SHARED_MEMORY_SIZE=1024 &&
+		export GIT_TEST_FSMONITOR_SHARED_MEMORY_SIZE &&
+		start_daemon -C test_ring
+	) &&
+	git -C test_ring update-index --fsmonitor &&
+	git -C test_ring status &&
+
+	echo 2 >test_ring/tracked &&
+	for i in $(test_seq 100)
+	do
+		>test_ring/untracked-file-with-a-long-name-$i || return 1
+	done &&
+	GIT_TRACE2_EVENT="$PWD/trace_ring_wrapped" git -C test_ring status --porcelain >actual &&
+	grep "^ M tracked$" actual &&
+	test_line_count = 101 actual &&
+	test_region ! fsmonitor apply_ring trace_ring_wrapped
+'
+
 # The next few test cases create repos where the .git directory is NOT
 # inside the one of the working directory.  That is, where .git is a file
 # that points to a directory elsewhere.  This happens for submodules and
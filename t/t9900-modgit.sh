@@ -4,6 +4,9 @@ test_description='ModuleGit basic integration tests'
 
 . ./test-lib.sh
 
+# modgit enables the sparse index itself.
+sane_unset GIT_TEST_SPARSE_INDEX
+
 test_expect_success 'setup .modgit config' '
 	git init repo &&
 	cd repo &&
@@ -28,6 +31,977 @@ test_expect_success 'modgit list shows available modules' '
 	test_cmp expected actual
 '
 
+test_expect_success 'modgit ai-context follows dependencies' '
+	git modgit ai-context --module=frontend >actual &&
+	cat >expected <<-\EOF &&
+	Subject: Context for module '"'"'frontend'"'"'
+
+	This context includes the following paths:
+	- src/api
+	- src/assets
+	- src/db
+	- src/ui
+	EOF
+	test_cmp expected actual
+'
+
+test_expect_success 'modgit warns about unknown dependencies' '
+	test_when_finished "git config -f .modgit --unset module.backend.depends" &&
+	git config -f .modgit module.backend.depends nosuch &&
+	git modgit list 2>err &&
+	test_grep "module .backend. depends on unknown module .nosuch." err
+'
+
+test_expect_success 'modgit ai-context rejects unknown modules' '
+	test_must_fail git modgit ai-context --module=nosuch 2>err &&
+	test_grep "module .nosuch. not found" err
+'
+
+test_expect_success 'setup module graph' '
+	git init graph &&
+	cat >graph/.modgit <<-\EOF
+	[module "app"]
+		path = app/
+		depends = left
+		depends = right
+	[module "left"]
+		path = ./lib/left
+		path = shared/util
+		depends = base
+	[module "right"]
+		path = lib/right
+		depends = base
+	[module "base"]
+		path = shared
+		path = shared-data
+		path = lib//right/sub
+	[module "loop-a"]
+		path = a
+		depends = loop-b
+	[module "loop-b"]
+		path = b
+		depends = loop-a
+	EOF
+'
+
+test_expect_success 'modgit deduplicates and collapses diamond dependencies' '
+	git -C graph modgit ai-context --module=app >actual &&
+	cat >expected <<-\EOF &&
+	Subject: Context for module '"'"'app'"'"'
+
+	This context includes the following paths:
+	- app
+	- lib/left
+	- lib/right
+	- shared
+	- shared-data
+	EOF
+	test_cmp expected actual
+'
+
+test_expect_success 'modgit reports dependency cycles' '
+	test_must_fail git -C graph modgit ai-context --module=loop-a 2>err &&
+	test_grep "dependency cycle between modules: loop-a -> loop-b -> loop-a" err
+'
+
+test_expect_success 'modgit compiles the module graph' '
+	rm -f graph/.git/modgit-graph &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git -C graph modgit ai-context --module=app >expect &&
+	test_region modgit parse trace.event &&
+	test_region modgit write-graph trace.event &&
+	test_path_is_file graph/.git/modgit-graph &&
+
+	rm -f trace.event &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git -C graph modgit ai-context --module=app >actual &&
+	test_region ! modgit parse trace.event &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit-graph is invalidated when .modgit changes' '
+	test_when_finished "git -C graph config -f .modgit --unset module.app.path docs" &&
+	git -C graph config -f .modgit --add module.app.path docs &&
+	git -C graph modgit ai-context --module=app >actual &&
+	test_grep "^- docs$" actual
+'
+
+test_expect_success 'modgit-graph still reports dependency cycles' '
+	git -C graph modgit ai-context --module=app &&
+	test_must_fail git -C graph modgit ai-context --module=loop-b 2>err &&
+	test_grep "dependency cycle between modules: loop-b -> loop-a -> loop-b" err
+'
+
+test_expect_success 'modgit ignores a corrupt modgit-graph' '
+	printf "garbage" >graph/.git/modgit-graph &&
+	git -C graph modgit ai-context --module=app >actual &&
+	test_grep "^- shared$" actual
+'
+
+test_expect_success 'setup worktree with modules' '
+	git init work &&
+	(
+		cd work &&
+		mkdir -p src/ui src/assets src/api src/db docs &&
+		for d in src/ui src/assets src/api src/db docs
+		do
+			echo "$d" >$d/file || return 1
+		done &&
+		echo README >README &&
+		cp ../.modgit .modgit &&
+		git add . &&
+		git commit -m initial
+	)
+'
+
+test_expect_success 'modgit switch restricts the worktree to the module' '
+	git -C work modgit switch backend >out &&
+	test_grep "Switched to module .backend." out &&
+	test_cmp_config -C work true core.sparseCheckout &&
+	test_cmp_config -C work true core.sparseCheckoutCone &&
+	test_path_is_file work/README &&
+	test_path_is_file work/src/api/file &&
+	test_path_is_file work/src/db/file &&
+	test_path_is_missing work/src/ui &&
+	test_path_is_missing work/docs &&
+	git -C work sparse-checkout list >actual &&
+	cat >expect <<-\EOF &&
+	src/api
+	src/db
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit switch collapses the index outside the module' '
+	test_cmp_config -C work true index.sparse &&
+	git -C work ls-files --sparse >actual &&
+	cat >expect <<-\EOF &&
+	.modgit
+	README
+	docs/
+	src/api/file
+	src/assets/
+	src/db/file
+	src/ui/
+	EOF
+	test_cmp expect actual &&
+	rm -f trace.event &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" git -C work status --porcelain &&
+	test_region ! index ensure_full_index trace.event &&
+
+	git -C work sparse-checkout set --no-sparse-index src/api src/db &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" git -C work modgit switch backend &&
+	test_region modgit collapse-index trace.event &&
+	test_cmp_config -C work true index.sparse &&
+	rm -f trace.event &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" git -C work ls-files --sparse >actual &&
+	test_region ! index convert_to_sparse trace.event &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit switch to a module with dependencies' '
+	git -C work modgit switch --module=frontend &&
+	test_path_is_file work/src/ui/file &&
+	test_path_is_file work/src/assets/file &&
+	test_path_is_file work/src/api/file &&
+	test_path_is_missing work/docs
+'
+
+test_expect_success 'modgit switch fails before touching the worktree' '
+	test_when_finished "git -C work config -f .modgit --unset module.broken.path" &&
+	git -C work config -f .modgit module.broken.path README &&
+	cp work/.git/info/sparse-checkout expect &&
+	test_must_fail git -C work modgit switch broken 2>err &&
+	test_grep "error: .README. is not a directory" err &&
+	test_cmp expect work/.git/info/sparse-checkout &&
+	test_path_is_file work/src/ui/file &&
+
+	test_must_fail git -C work modgit switch nosuch 2>err &&
+	test_grep "module not found" err &&
+	test_cmp expect work/.git/info/sparse-checkout &&
+
+	test_when_finished "rm -rf fresh" &&
+	git clone work fresh &&
+	git -C fresh config -f .modgit module.broken.path README &&
+	test_must_fail git -C fresh modgit switch broken 2>err &&
+	test_grep "error: .README. is not a directory" err &&
+	test_must_fail git -C fresh config core.sparseCheckout &&
+	test_must_fail git -C fresh config index.sparse &&
+	test_must_fail git -C fresh config extensions.worktreeConfig &&
+	test_path_is_missing fresh/.git/info/sparse-checkout
+'
+
+test_expect_success 'modgit switch only updates the paths that change' '
+	git -C work modgit switch frontend &&
+	echo untracked >work/src/api/untracked &&
+	test_when_finished "rm -f work/src/api/untracked" &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git -C work modgit switch backend &&
+	test_region sparse-checkout update-cone trace.event &&
+	test_trace2_data sparse-checkout cone/changed 2 <trace.event &&
+	test_cmp_config -C work backend modgit.module &&
+	test_path_is_missing work/src/ui &&
+	test_path_is_missing work/src/assets &&
+	test_path_is_file work/src/api/file &&
+	test_path_is_file work/src/api/untracked &&
+	git -C work ls-files -t src >actual &&
+	cat >expect <<-\EOF &&
+	H src/api/file
+	S src/assets/file
+	H src/db/file
+	S src/ui/file
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit switch to the same closure is a no-op' '
+	rm -f trace.event &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git -C work modgit switch backend &&
+	test_trace2_data sparse-checkout cone/changed 0 <trace.event &&
+	test_region ! sparse-checkout update-cone trace.event
+'
+
+test_expect_success 'modgit switch updates nested directories' '
+	test_when_finished "git -C work config -f .modgit --remove-section module.src" &&
+	git -C work config -f .modgit module.src.path src &&
+	git -C work modgit switch src &&
+	test_path_is_file work/src/ui/file &&
+	test_path_is_missing work/docs &&
+	git -C work modgit switch backend &&
+	test_path_is_missing work/src/ui &&
+	test_path_is_file work/src/db/file &&
+	test_path_is_file work/README
+'
+
+test_expect_success 'modgit switch recovers from a non-cone sparse-checkout' '
+	git -C work sparse-checkout set --no-cone "/docs/" &&
+	test_path_is_missing work/src &&
+	rm -f trace.event &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git -C work modgit switch frontend &&
+	test_region ! sparse-checkout update-cone trace.event &&
+	test_cmp_config -C work true core.sparseCheckoutCone &&
+	test_path_is_file work/src/ui/file &&
+	test_path_is_missing work/docs
+'
+
+test_expect_success 'modgit status is limited to the module closure' '
+	git -C work modgit switch frontend &&
+	test_when_finished "git -C work checkout -- src/api/file &&
+		rm -rf work/src/ui/new work/src/db/newdir work/outside" &&
+	echo change >>work/src/api/file &&
+	echo new >work/src/ui/new &&
+	mkdir work/src/db/newdir &&
+	echo new >work/src/db/newdir/file &&
+	echo outside >work/outside &&
+
+	git -C work modgit status -s >actual &&
+	cat >expect <<-\EOF &&
+	 M src/api/file
+	?? src/db/newdir/
+	?? src/ui/new
+	EOF
+	test_cmp expect actual &&
+
+	git -C work modgit status --module=backend --porcelain >actual &&
+	cat >expect <<-\EOF &&
+	 M src/api/file
+	?? src/db/newdir/
+	EOF
+	test_cmp expect actual &&
+
+	git -C work modgit status >actual &&
+	test_grep "^On module .frontend.$" actual &&
+	test_grep "^  backend: 1 changed, 1 untracked$" actual &&
+	test_grep "^  frontend: 0 changed, 1 untracked$" actual &&
+	test_grep ! outside actual &&
+
+	git -C work -c status.showUntrackedFiles=no modgit status -s >actual &&
+	echo " M src/api/file" >expect &&
+	test_cmp expect actual &&
+
+	git -C work -c status.showUntrackedFiles=all modgit status -s >actual &&
+	cat >expect <<-\EOF &&
+	 M src/api/file
+	?? src/db/newdir/file
+	?? src/ui/new
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit status does not walk outside of the module' '
+	test_when_finished "rm -rf work/outside" &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git -C work modgit status >/dev/null &&
+	grep "\"key\":\"directories-visited\"" trace.event >expect &&
+	rm trace.event &&
+	mkdir -p work/outside/a/b work/outside/c &&
+	echo new >work/outside/a/b/file &&
+	echo new >work/outside/c/file &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git -C work modgit status >/dev/null &&
+	grep "\"key\":\"directories-visited\"" trace.event >actual &&
+	rm trace.event &&
+	sed "s/.*\"value\"://" expect >expect.count &&
+	sed "s/.*\"value\"://" actual >actual.count &&
+	test_cmp expect.count actual.count
+'
+
+test_expect_success 'modgit status shows a module in an untracked directory' '
+	test_when_finished "git -C work config -f .modgit --remove-section module.newpkg &&
+		rm -rf work/lib" &&
+	git -C work config -f .modgit module.newpkg.path lib/new/pkg &&
+	mkdir -p work/lib/new/pkg work/lib/new/other &&
+	echo new >work/lib/new/pkg/file &&
+	echo new >work/lib/new/other/file &&
+	git -C work modgit status --module=newpkg -s >actual &&
+	echo "?? lib/new/pkg/" >expect &&
+	test_cmp expect actual &&
+	git -C work status -s -- lib/new/pkg >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit status needs a module' '
+	test_must_fail git -C graph modgit status 2>err &&
+	test_grep "not on a module" err
+'
+
+test_expect_success 'setup server for partial clones' '
+	git clone --bare work server.git &&
+	git -C server.git config uploadpack.allowFilter true &&
+	git -C server.git config uploadpack.allowAnySHA1InWant true
+'
+
+test_expect_success 'modgit clone only fetches the module' '
+	rm -f trace.event &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git modgit clone --module=backend "file://$(pwd)/server.git" cloned &&
+	test_cmp_config -C cloned module:backend remote.origin.partialclonefilter &&
+	test_cmp_config -C cloned backend modgit.module &&
+	test_path_is_file cloned/README &&
+	test_path_is_file cloned/src/api/file &&
+	test_path_is_file cloned/src/db/file &&
+	test_path_is_missing cloned/src/ui &&
+	test_path_is_missing cloned/docs &&
+
+	# Neither the trees nor the blobs outside of the module are needed.
+	test_grep ! "\"event\":\"child_start\".*\"fetch\"" trace.event &&
+	git -C cloned rev-list --objects --missing=print HEAD >objects &&
+	git -C cloned rev-parse HEAD:docs HEAD:src/assets HEAD:src/ui |
+		sed "s/^/?/" | sort >expect &&
+	grep "^?" objects | sort >actual &&
+	test_cmp expect actual &&
+	git -C cloned ls-files --sparse >files &&
+	test_grep "^src/ui/$" files
+'
+
+test_expect_success 'modgit clone fetches the module blobs in one batch' '
+	test_config -C server.git uploadpackfilter.module.allow false &&
+	rm -f trace.event &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git modgit clone --module=backend "file://$(pwd)/server.git" \
+		cloned-blobless 2>err &&
+	test_grep "retrying the clone without the module filter" err &&
+	test_cmp_config -C cloned-blobless blob:none remote.origin.partialclonefilter &&
+	test_path_is_file cloned-blobless/src/api/file &&
+	test_path_is_file cloned-blobless/src/db/file &&
+	test_path_is_missing cloned-blobless/src/ui &&
+	test_region modgit prefetch trace.event &&
+	test_trace2_data modgit prefetch/blobs 3 <trace.event &&
+
+	# One lazy fetch for .modgit, one for the module.
+	grep "\"event\":\"child_start\".*\"fetch\"" trace.event >fetches &&
+	test_line_count = 2 fetches &&
+
+	git -C cloned-blobless rev-list --objects --missing=print HEAD >objects &&
+	grep "^?" objects >missing &&
+	test_line_count = 3 missing
+'
+
+test_expect_success 'rev-list --filter=module: omits paths outside the module' '
+	git -C work rev-list --objects --filter=module:backend \
+		--filter-print-omitted HEAD >objects &&
+	sed -n "s/^[0-9a-f]* //p" objects >actual &&
+	cat >expect <<-\EOF &&
+
+	.modgit
+	README
+	src
+	src/api
+	src/api/file
+	src/db
+	src/db/file
+	EOF
+	test_cmp expect actual &&
+
+	git -C work rev-parse HEAD:docs HEAD:src/assets HEAD:src/ui |
+		sed "s/^/~/" | sort >expect &&
+	grep "^~" objects | sort >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'rev-list --filter=module: follows dependencies' '
+	git -C work rev-list --objects --filter=module:frontend HEAD >objects &&
+	test_grep " src/ui/file$" objects &&
+	test_grep " src/db/file$" objects &&
+	test_grep ! " docs" objects
+'
+
+test_expect_success 'rev-list --filter=module: with an unknown module' '
+	git -C work rev-list --objects --filter=module:nosuch HEAD >objects &&
+	test_grep " README$" objects &&
+	test_grep ! " src" objects &&
+	test_must_fail git -C work rev-list --objects --filter=module: HEAD 2>err &&
+	test_grep "expected .module:<name>." err
+'
+
+test_expect_success 'partial clone with a module filter' '
+	git clone --no-checkout --filter=module:backend \
+		"file://$(pwd)/server.git" module-clone &&
+	test_cmp_config -C module-clone module:backend remote.origin.partialclonefilter &&
+	git -C module-clone rev-list --objects --missing=print HEAD >objects &&
+	git -C module-clone rev-parse HEAD:docs HEAD:src/assets HEAD:src/ui |
+		sed "s/^/?/" | sort >expect &&
+	grep "^?" objects | sort >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'upload-pack can ban the module filter' '
+	test_config -C server.git uploadpackfilter.module.allow false &&
+	test_must_fail git clone --no-checkout --filter=module:backend \
+		"file://$(pwd)/server.git" banned-clone 2>err &&
+	test_grep "filter .module. not supported" err
+'
+
+test_expect_success 'modgit ai-context --format=markdown dumps the module' '
+	git -C work modgit ai-context --module=backend --format=markdown >actual &&
+	cat >expect <<-EOF &&
+	# Context for module ${SQ}backend${SQ}
+
+	Revision: $(git -C work rev-parse HEAD)
+
+	## src/api/file
+
+	\`\`\`
+	src/api
+	\`\`\`
+
+	## src/db/file
+
+	\`\`\`
+	src/db
+	\`\`\`
+
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit ai-context --format=json dumps the module' '
+	git -C work modgit ai-context --module=backend --format=json >actual &&
+	cat >expect <<-EOF &&
+	{"module":"backend","commit":"$(git -C work rev-parse HEAD)","files":[{"path":"src/api/file","oid":"$(git -C work rev-parse HEAD:src/api/file)","size":8,"content":"src/api\\n"},{"path":"src/db/file","oid":"$(git -C work rev-parse HEAD:src/db/file)","size":7,"content":"src/db\\n"}]}
+	EOF
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit ai-context streams files in order with threads' '
+	git init context &&
+	mkdir context/lib &&
+	for i in $(test_seq 1 40)
+	do
+		test_seq $((i * 2000)) >context/lib/file$i || return 1
+	done &&
+	printf "a\\000b" >context/lib/binary &&
+	printf "\\140\\140\\140\\nno newline" >context/lib/fence &&
+	{
+		printf "%065533d" 0 &&
+		printf "\\140\\140\\140\\140\\140\\140\\140\\n"
+	} >context/lib/long-fence &&
+	cat >context/.modgit <<-\EOF &&
+	[module "lib"]
+		path = lib
+	EOF
+	git -C context add . &&
+	git -C context commit -m files &&
+
+	git -C context modgit ai-context --module=lib --format=markdown -j1 >expect &&
+	test_grep "^(binary file, 3 bytes)$" expect &&
+	test_grep "^\`\`\`\`$" expect &&
+	test_grep "^\`\`\`\`\`\`\`\`$" expect &&
+	git -C context ls-tree -r --name-only HEAD lib >paths &&
+	sed -n "s/^## //p" expect >actual &&
+	test_cmp paths actual &&
+
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git -C context modgit ai-context --module=lib --format=markdown -j4 >actual &&
+	test_region modgit ai-context trace.event &&
+	test_trace2_data modgit ai-context/files 43 <trace.event &&
+	test_cmp expect actual &&
+
+	git -C context -c core.bigFileThreshold=1k \
+		modgit ai-context --module=lib --format=markdown -j4 >actual &&
+	test_cmp expect actual &&
+
+	git -C context modgit ai-context --module=lib --format=json -j1 >expect &&
+	git -C context -c core.bigFileThreshold=1k \
+		modgit ai-context --module=lib --format=json -j4 >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit ai-context ends a file it cannot finish reading' '
+	git init truncated &&
+	mkdir truncated/lib &&
+	test_seq 200000 >truncated/lib/big &&
+	echo small >truncated/lib/small &&
+	cat >truncated/.modgit <<-\EOF &&
+	[module "lib"]
+		path = lib
+	EOF
+	git -C truncated add . &&
+	git -C truncated commit -m files &&
+	oid=$(git -C truncated rev-parse HEAD:lib/big) &&
+	obj=truncated/.git/objects/$(test_oid_to_path $oid) &&
+	size=$(wc -c <"$obj") &&
+	test_copy_bytes $((size - 1000)) <"$obj" >broken &&
+	chmod +w "$obj" &&
+	mv broken "$obj" &&
+
+	test_must_fail git -C truncated modgit ai-context --module=lib \
+		--format=markdown >actual 2>err &&
+	test_grep "unable to stream $oid for .lib/big." err &&
+	sed -n "s/^## //p" actual >headings &&
+	test_write_lines lib/big lib/small >expect &&
+	test_cmp expect headings &&
+	test_grep "^(unable to read file)$" actual &&
+	test_grep ! "^1$" actual &&
+
+	test_must_fail git -C truncated modgit ai-context --module=lib \
+		--format=json >actual &&
+	test_grep "\"error\":true},{\"path\":\"lib/small\"" actual &&
+	test_grep ! "\"path\":\"lib/big\",\"oid\":\"$oid\",\"error\"" actual &&
+	test_grep "\"content\":\"small\\\\n\"}\]}$" actual
+'
+
+test_expect_success 'modgit ai-context --rev reads the module from the revision' '
+	git init moved &&
+	mkdir moved/old &&
+	echo file >moved/old/file &&
+	cat >moved/.modgit <<-\EOF &&
+	[module "lib"]
+		path = old
+	[module "gone"]
+		path = old
+	EOF
+	git -C moved add . &&
+	git -C moved commit -m old &&
+	git -C moved mv old new &&
+	cat >moved/.modgit <<-\EOF &&
+	[module "lib"]
+		path = new
+	EOF
+	git -C moved commit -a -m new &&
+
+	git -C moved modgit ai-context --module=lib --rev=HEAD^ \
+		--format=markdown >actual &&
+	test_grep "^## old/file$" actual &&
+	git -C moved modgit ai-context --module=gone --rev=HEAD^ \
+		--format=markdown >actual &&
+	test_grep "^## old/file$" actual &&
+	test_must_fail git -C moved modgit ai-context --module=gone \
+		--format=markdown 2>err &&
+	test_grep "module .gone. not found" err
+'
+
+test_expect_success 'modgit ai-context --budget prefers recent and small files' '
+	git init budget &&
+	mkdir budget/lib &&
+	echo old >budget/lib/old &&
+	test_seq 1000 >budget/lib/big &&
+	cat >budget/.modgit <<-\EOF &&
+	[module "lib"]
+		path = lib
+	EOF
+	git -C budget add . &&
+	test_tick &&
+	git -C budget commit -m old &&
+	echo new >budget/lib/new &&
+	echo small >budget/lib/small &&
+	git -C budget add . &&
+	test_tick &&
+	git -C budget commit -m new &&
+	echo readme >budget/README &&
+	git -C budget add . &&
+	test_tick &&
+	git -C budget commit -m unrelated &&
+	git -C budget commit-graph write --reachable --changed-paths &&
+
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git -C budget modgit ai-context --module=lib --format=markdown \
+		--budget=100 >actual &&
+	test_trace2_data modgit ai-context/walked 3 <trace.event &&
+	test_trace2_data modgit ai-context/diffed 2 <trace.event &&
+	test_trace2_data modgit ai-context/omitted 2 <trace.event &&
+	sed -n "s/^## //p" actual >headings &&
+	cat >expect <<-\EOF &&
+	lib/new
+	lib/small
+	Omitted files
+	EOF
+	test_cmp expect headings &&
+	test_grep "^- lib/big (3893 bytes)$" actual &&
+	test_grep "^- lib/old (4 bytes)$" actual &&
+
+	git -C budget modgit ai-context --module=lib --format=json \
+		--budget=1k >actual &&
+	test_grep "\"budget\":1024" actual &&
+	test_grep "\"omitted\":\[{\"path\":\"lib/big\"" actual &&
+	test_grep "\"path\":\"lib/old\",\"oid\":\"[0-9a-f]*\",\"size\":4,\"content\"" actual
+'
+
+test_expect_success 'modgit ai-context --budget needs a format' '
+	test_must_fail git -C budget modgit ai-context --module=lib --budget=1k 2>err &&
+	test_grep "budget requires" err
+'
+
+test_expect_success 'modgit ai-context rejects an unknown format' '
+	test_must_fail git -C work modgit ai-context --module=backend --format=xml 2>err &&
+	test_grep "invalid --format value .xml." err
+'
+
+test_expect_success 'modgit commit stages only the module' '
+	git -C work modgit switch backend &&
+	echo change >>work/src/api/file &&
+	echo change >>work/README &&
+	echo new >work/src/api/untracked &&
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git -C work modgit commit -m "api change" >out &&
+	test_region modgit commit trace.event &&
+	test_grep "^Committed to new branch .modgit/patch-" out &&
+	test_grep "api change" out &&
+
+	git -C work diff-tree --name-only -r HEAD^ HEAD >actual &&
+	echo src/api/file >expect &&
+	test_cmp expect actual &&
+	git -C work symbolic-ref HEAD >actual &&
+	test_grep "^refs/heads/modgit/patch-" actual &&
+	git -C work rev-parse master >expect &&
+	git -C work rev-parse HEAD^ >actual &&
+	test_cmp expect actual &&
+	git -C work log -g -1 --format=%gs >actual &&
+	echo "modgit commit: api change" >expect &&
+	test_cmp expect actual &&
+
+	git -C work status --porcelain >actual &&
+	cat >expect <<-\EOF &&
+	 M README
+	?? src/api/untracked
+	EOF
+	test_cmp expect actual &&
+
+	test-tool -C work dump-cache-tree >cache-tree &&
+	test_grep ! invalid cache-tree &&
+	git -C work rev-parse HEAD^{tree} >expect &&
+	head -n 1 cache-tree | cut -d" " -f1 >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit commit with nothing to commit' '
+	git -C work rev-parse HEAD >expect &&
+	git -C work modgit commit -m nothing >out &&
+	test_grep "nothing to commit in module .backend." out &&
+	git -C work rev-parse HEAD >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit commit runs the pre-commit hook' '
+	test_hook -C work pre-commit <<-\EOF &&
+	exit 1
+	EOF
+	echo change >>work/src/db/file &&
+	git -C work rev-parse HEAD >expect &&
+	test_must_fail git -C work modgit commit -m refused 2>err &&
+	test_grep "pre-commit hook refused" err &&
+	git -C work rev-parse HEAD >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit commit includes what the pre-commit hook stages' '
+	test_hook -C work pre-commit <<-\EOF &&
+	echo hooked >src/db/hooked &&
+	git add src/db/hooked
+	EOF
+	git -C work modgit commit -m hooked &&
+	git -C work diff-tree --name-only -r HEAD^ HEAD >actual &&
+	cat >expect <<-\EOF &&
+	src/db/file
+	src/db/hooked
+	EOF
+	test_cmp expect actual &&
+	git -C work diff --cached --quiet
+'
+
+test_expect_success 'setup modules with permissions' '
+	git init perm &&
+	(
+		cd perm &&
+		mkdir core app docs &&
+		for d in core app docs
+		do
+			echo "$d" >$d/file || return 1
+		done &&
+		cat >.modgit <<-\EOF &&
+		[module "core"]
+			path = core
+			readOnly = true
+		[module "app"]
+			path = app
+			ownersOnly = true
+			owner = Committer@Example.com
+		[module "docs"]
+			path = docs
+		EOF
+		git add . &&
+		git commit -m initial
+	) &&
+	git clone --bare perm perm.git &&
+	git -C perm.git config receive.modgitPermissions true
+'
+
+test_expect_success 'modgit commit refuses to change a read-only module' '
+	echo change >>perm/core/file &&
+	git -C perm rev-parse HEAD >expect &&
+	test_must_fail git -C perm modgit commit --module=core -m core 2>err &&
+	test_grep "${SQ}core/file${SQ} belongs to the read-only module ${SQ}core${SQ}" err &&
+	git -C perm rev-parse HEAD >actual &&
+	test_cmp expect actual &&
+	git -C perm diff --cached --quiet &&
+	git -C perm checkout core/file
+'
+
+test_expect_success 'modgit commit checks the permissions of HEAD, not the worktree' '
+	test_when_finished "git -C perm checkout .modgit core/file" &&
+	sed "/readOnly/d" perm/.modgit >modgit.tmp &&
+	mv modgit.tmp perm/.modgit &&
+	echo change >>perm/core/file &&
+	git -C perm rev-parse HEAD >expect &&
+	test_must_fail git -C perm modgit commit --module=core -m core 2>err &&
+	test_grep "belongs to the read-only module ${SQ}core${SQ}" err &&
+	git -C perm rev-parse HEAD >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit commit lets owners change an owners-only module' '
+	echo change >>perm/app/file &&
+	test_must_fail env GIT_COMMITTER_EMAIL=other@example.com \
+		git -C perm modgit commit --module=app -m app 2>err &&
+	test_grep "module ${SQ}app${SQ}, which only its owners may change" err &&
+	git -C perm modgit commit --module=app -m app &&
+	git -C perm diff-tree --name-only -r HEAD^ HEAD >actual &&
+	echo app/file >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'receive.modgitPermissions rejects forbidden pushes' '
+	git -C perm push ../perm.git HEAD:refs/heads/app &&
+
+	git -C perm checkout -b forbidden master &&
+	echo change >>perm/docs/file &&
+	git -C perm commit -a -m docs &&
+	echo change >>perm/core/file &&
+	git -C perm commit -a -m core &&
+	test_must_fail git -C perm push ../perm.git forbidden:master 2>err &&
+	test_grep "module permission denied" err &&
+	test_grep "${SQ}core/file${SQ} belongs to the read-only module" err &&
+	test_must_fail git -C perm push ../perm.git forbidden:refs/heads/new 2>err &&
+	test_grep "module permission denied" err &&
+	git -C perm push ../perm.git forbidden^:master &&
+
+	echo change >>perm/app/file &&
+	GIT_COMMITTER_EMAIL=other@example.com git -C perm commit -a -m app &&
+	test_must_fail git -C perm push ../perm.git HEAD:master 2>err &&
+	test_grep "only its owners may change" err &&
+	git -C perm rev-parse forbidden~2 >expect &&
+	git -C perm.git rev-parse master >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'receive-pack ignores modules without receive.modgitPermissions' '
+	git -C perm.git config receive.modgitPermissions false &&
+	git -C perm push ../perm.git HEAD:master
+'
+
+test_expect_success 'setup history for affected modules' '
+	git init affected &&
+	(
+		cd affected &&
+		mkdir lib api ui docs &&
+		for d in lib api ui docs
+		do
+			echo "$d" >$d/file || return 1
+		done &&
+		cat >.modgit <<-\EOF &&
+		[module "lib"]
+			path = lib
+		[module "api"]
+			path = api
+			depends = lib
+		[module "ui"]
+			path = ui
+			depends = api
+		[module "docs"]
+			path = docs
+		EOF
+		git add . &&
+		git commit -m base &&
+		git tag base &&
+		echo change >>docs/file &&
+		git commit -a -m docs &&
+		git tag docs &&
+		echo readme >README &&
+		git add README &&
+		git commit -m readme &&
+		echo change >>api/file &&
+		git commit -a -m api &&
+		git commit-graph write --reachable --changed-paths
+	)
+'
+
+test_expect_success 'modgit affected lists changed modules and their dependents' '
+	git -C affected modgit affected base..docs >actual &&
+	echo docs >expect &&
+	test_cmp expect actual &&
+
+	git -C affected modgit affected base..HEAD >actual &&
+	cat >expect <<-\EOF &&
+	api
+	ui
+	docs
+	EOF
+	test_cmp expect actual &&
+
+	git -C affected modgit affected --direct docs..HEAD >actual &&
+	echo api >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit affected skips commits using Bloom filters' '
+	GIT_TRACE2_EVENT="$(pwd)/trace.event" \
+		git -C affected modgit affected docs..HEAD >actual &&
+	test_trace2_data modgit affected/walked 2 <trace.event &&
+	test_trace2_data modgit affected/diffed 1 <trace.event
+'
+
+test_expect_success 'modgit affected needs a revision range' '
+	test_must_fail git -C affected modgit affected 2>err &&
+	test_grep "no revision range given" err
+'
+
+test_expect_success 'modgit run runs a command' '
+	git -C affected modgit run "echo hello >out" &&
+	echo hello >expect &&
+	test_cmp expect affected/out &&
+	rm affected/out
+'
+
+test_expect_success 'modgit run --each runs in dependency order' '
+	git -C affected modgit run --each -j 1 "pwd" 2>err &&
+	grep "^Running in module" err >actual &&
+	cat >expect <<-EOF &&
+	Running in module ${SQ}lib${SQ}
+	Running in module ${SQ}api${SQ}
+	Running in module ${SQ}ui${SQ}
+	Running in module ${SQ}docs${SQ}
+	EOF
+	test_cmp expect actual &&
+	test_grep "affected/api$" err
+'
+
+test_expect_success 'modgit run --each waits for the dependencies' '
+	test_when_finished "rm -f affected/*/done" &&
+	git -C affected modgit run --each -j 4 "
+		case \$MODGIT_MODULE in
+		api) test -f ../lib/done ;;
+		ui) test -f ../api/done ;;
+		esac &&
+		touch done
+	" &&
+	test_path_is_file affected/ui/done &&
+	test_path_is_file affected/docs/done
+'
+
+test_expect_success 'modgit run --each runs in the first path of a module' '
+	test_when_finished "git -C affected config -f .modgit --unset module.docs.path lib &&
+		rm -f affected/docs/out" &&
+	git -C affected config -f .modgit --add module.docs.path lib &&
+	git -C affected modgit run --each -j 1 "
+		test \$MODGIT_MODULE != docs ||
+		{ pwd && echo \"\$MODGIT_PATHS\"; } >out
+	" &&
+	cat >expect <<-EOF &&
+	$(pwd)/affected/docs
+	docs:lib
+	EOF
+	test_cmp expect affected/docs/out
+'
+
+test_expect_success 'modgit run --each --affected only runs in affected modules' '
+	git -C affected modgit run --each --affected base..docs "pwd" 2>err &&
+	grep "^Running in module" err >actual &&
+	echo "Running in module ${SQ}docs${SQ}" >expect &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit run --each skips the dependents of failed modules' '
+	test_must_fail git -C affected modgit run --each -j 2 \
+		"test \$MODGIT_MODULE != api" 2>err &&
+	test_grep "Command failed in module ${SQ}api${SQ}" err &&
+	test_grep "Skipping module ${SQ}ui${SQ}: ${SQ}api${SQ} failed" err &&
+	test_grep "Running in module ${SQ}docs${SQ}" err
+'
+
+test_expect_success 'modgit worktree add checks out the module closure' '
+	git -C affected modgit worktree add api &&
+	test_path_is_file affected-api/api/file &&
+	test_path_is_file affected-api/lib/file &&
+	test_path_is_missing affected-api/ui &&
+	test_path_is_missing affected-api/docs &&
+	git -C affected-api ls-files --sparse >actual &&
+	cat >expect <<-\EOF &&
+	.modgit
+	README
+	api/file
+	docs/
+	lib/file
+	ui/
+	EOF
+	test_cmp expect actual &&
+	echo api >expect &&
+	git -C affected-api config --worktree modgit.module >actual &&
+	test_cmp expect actual &&
+	echo true >expect &&
+	git -C affected-api config --worktree index.sparse >actual &&
+	test_cmp expect actual
+'
+
+test_expect_success 'modgit worktree add leaves the other worktrees alone' '
+	git -C affected modgit worktree add --rev=docs docs ../docs-wt &&
+	test_path_is_file docs-wt/docs/file &&
+	test_path_is_missing docs-wt/api &&
+	git -C affected rev-parse docs >expect &&
+	git -C docs-wt rev-parse HEAD >actual &&
+	test_cmp expect actual &&
+	test_must_fail git -C affected config modgit.module &&
+	test_path_is_file affected/ui/file &&
+	test_path_is_file affected-api/api/file
+'
+
+test_expect_success 'modgit worktree add with an unknown module' '
+	test_must_fail git -C affected modgit worktree add nope 2>err &&
+	test_grep "module not found" err &&
+	test_path_is_missing affected-nope
+'
+
 test_expect_success 'modgit list hints when .modgit is missing' '
 	mkdir empty-repo &&
 	cd empty-repo &&
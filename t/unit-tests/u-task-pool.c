@@ -0,0 +1,127 @@
+#include "unit-test.h"
+#include "thread-utils.h"
+
+struct counters {
+	struct task_pool *pool;
+	int *nr;
+	int bad_worker;
+};
+
+static void count_task(void *task, int worker)
+{
+	struct counters *c = task;
+
+	if (worker < 0 || worker >= task_pool_nr_workers(c->pool))
+		c->bad_worker = 1;
+	else
+		c->nr[worker]++;
+}
+
+static int sum(struct counters *c)
+{
+	int total = 0;
+
+	for (int i = 0; i < task_pool_nr_workers(c->pool); i++)
+		total += c->nr[i];
+	return total;
+}
+
+static void setup(struct counters *c, int nr_workers)
+{
+	c->pool = task_pool_new(nr_workers);
+	CALLOC_ARRAY(c->nr, task_pool_nr_workers(c->pool));
+	c->bad_worker = 0;
+}
+
+static void teardown(struct counters *c)
+{
+	task_pool_free(c->pool);
+	free(c->nr);
+}
+
+void test_task_pool__nr_workers(void)
+{
+	struct task_pool *pool = task_pool_new(3);
+
+	cl_assert_equal_i(task_pool_nr_workers(pool), HAVE_THREADS ? 3 : 1);
+	task_pool_free(pool);
+
+	pool = task_pool_new(0);
+	cl_assert(task_pool_nr_workers(pool) >= 1);
+	task_pool_free(pool);
+}
+
+void test_task_pool__runs_all_tasks(void)
+{
+	struct counters c;
+
+	setup(&c, 4);
+	for (int i = 0; i < 1000; i++)
+		task_pool_add(c.pool, count_task, &c);
+	task_pool_wait(c.pool);
+	cl_assert_equal_i(sum(&c), 1000);
+	cl_assert_equal_i(c.bad_worker, 0);
+
+	/* The pool can be reused after waiting. */
+	for (int i = 0; i < 10; i++)
+		task_pool_add(c.pool, count_task, &c);
+	task_pool_wait(c.pool);
+	cl_assert_equal_i(sum(&c), 1010);
+	teardown(&c);
+}
+
+struct tree_task {
+	struct counters *c;
+	struct tree_task *all;
+	int index, nr;
+};
+
+/* Every task queues its two children in a binary heap of tasks. */
+static void tree_task(void *task, int worker)
+{
+	struct tree_task *t = task;
+
+	count_task(t->c, worker);
+	for (int child = 2 * t->index + 1;
+	     child < t->nr && child <= 2 * t->index + 2; child++)
+		task_pool_add(t->c->pool, tree_task, &t->all[child]);
+}
+
+void test_task_pool__tasks_add_tasks(void)
+{
+	struct counters c;
+	struct tree_task *tasks;
+	int nr = 4095;
+
+	setup(&c, 4);
+	ALLOC_ARRAY(tasks, nr);
+	for (int i = 0; i < nr; i++) {
+		tasks[i].c = &c;
+		tasks[i].all = tasks;
+		tasks[i].index = i;
+		tasks[i].nr = nr;
+	}
+	task_pool_add(c.pool, tree_task, &tasks[0]);
+	task_pool_wait(c.pool);
+	cl_assert_equal_i(sum(&c), nr);
+	cl_assert_equal_i(c.bad_worker, 0);
+	teardown(&c);
+	free(tasks);
+}
+
+void test_task_pool__free_waits_for_tasks(void)
+{
+	struct counters c;
+	int nr_workers, total = 0;
+
+	setup(&c, 2);
+	nr_workers = task_pool_nr_workers(c.pool);
+	for (int i = 0; i < 100; i++)
+		task_pool_add(c.pool, count_task, &c);
+	task_pool_free(c.pool);
+
+	for (int i = 0; i < nr_workers; i++)
+		total += c.nr[i];
+	cl_assert_equal_i(total, 100);
+	free(c.nr);
+}
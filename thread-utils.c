@@ -1,4 +1,5 @@
 #include "git-compat-util.h"
+#include "gettext.h"
 #include "thread-utils.h"
 
 #if defined(hpux) || defined(__hpux) || defined(_hpux)
@@ -123,3 +124,262 @@ int dummy_pthread_join(pthread_t pthread, void **retval)
 }
 
 #endif
+
+struct task_pool_task {
+	task_pool_fn *fn;
+	void *task;
+};
+
+/*
+ * The deque of a worker: a circular buffer holding `nr` tasks starting
+ * at `first`, the oldest one.  The worker pushes and pops tasks at the
+ * end, and other workers steal them from the front.
+ */
+struct task_pool_deque {
+	pthread_mutex_t mutex;
+	struct task_pool_task *tasks;
+	size_t first, nr, alloc;
+};
+
+struct task_pool_worker {
+	struct task_pool *pool;
+	pthread_t thread;
+	int index;
+	struct task_pool_deque deque;
+};
+
+struct task_pool {
+	struct task_pool_worker *workers;
+	int nr_workers;
+
+	/* Maps each thread of the pool to its worker. */
+	pthread_key_t current_worker;
+
+	/*
+	 * Protects the fields below.  A task is counted in `queued` while
+	 * it is in a deque and in `pending` until it has run.
+	 */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_queued;
+	pthread_cond_t cond_done;
+	size_t queued;
+	size_t pending;
+	int next_worker;
+	int shutdown;
+};
+
+static void deque_push(struct task_pool_deque *d,
+		       const struct task_pool_task *t)
+{
+	pthread_mutex_lock(&d->mutex);
+	if (d->nr == d->alloc) {
+		struct task_pool_task *tasks;
+		size_t alloc = alloc_nr(d->alloc);
+
+		ALLOC_ARRAY(tasks, alloc);
+		for (size_t i = 0; i < d->nr; i++)
+			tasks[i] = d->tasks[(d->first + i) % d->alloc];
+		free(d->tasks);
+		d->tasks = tasks;
+		d->alloc = alloc;
+		d->first = 0;
+	}
+	d->tasks[(d->first + d->nr++) % d->alloc] = *t;
+	pthread_mutex_unlock(&d->mutex);
+}
+
+static int deque_pop(struct task_pool_deque *d, struct task_pool_task *t)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&d->mutex);
+	if (d->nr) {
+		*t = d->tasks[(d->first + --d->nr) % d->alloc];
+		ret = 1;
+	}
+	pthread_mutex_unlock(&d->mutex);
+	return ret;
+}
+
+static int deque_steal(struct task_pool_deque *d, struct task_pool_task *t)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&d->mutex);
+	if (d->nr) {
+		*t = d->tasks[d->first];
+		d->first = (d->first + 1) % d->alloc;
+		d->nr--;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&d->mutex);
+	return ret;
+}
+
+static int take_task(struct task_pool_worker *w, struct task_pool_task *t)
+{
+	struct task_pool *pool = w->pool;
+
+	if (deque_pop(&w->deque, t))
+		return 1;
+	for (int i = 1; i < pool->nr_workers; i++) {
+		struct task_pool_worker *victim =
+			&pool->workers[(w->index + i) % pool->nr_workers];
+
+		if (deque_steal(&victim->deque, t))
+			return 1;
+	}
+	return 0;
+}
+
+static void *task_pool_worker_proc(void *data)
+{
+	struct task_pool_worker *w = data;
+	struct task_pool *pool = w->pool;
+
+	pthread_setspecific(pool->current_worker, w);
+
+	for (;;) {
+		struct task_pool_task t;
+
+		if (take_task(w, &t)) {
+			pthread_mutex_lock(&pool->mutex);
+			pool->queued--;
+			pthread_mutex_unlock(&pool->mutex);
+
+			t.fn(t.task, w->index);
+
+			pthread_mutex_lock(&pool->mutex);
+			if (!--pool->pending)
+				pthread_cond_broadcast(&pool->cond_done);
+			pthread_mutex_unlock(&pool->mutex);
+			continue;
+		}
+
+		/*
+		 * If there are queued tasks that we did not find, another
+		 * worker has just taken them: look again.
+		 */
+		pthread_mutex_lock(&pool->mutex);
+		while (!pool->queued && !pool->shutdown)
+			pthread_cond_wait(&pool->cond_queued, &pool->mutex);
+		if (!pool->queued) {
+			pthread_mutex_unlock(&pool->mutex);
+			break;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	return NULL;
+}
+
+struct task_pool *task_pool_new(int nr_workers)
+{
+	struct task_pool *pool;
+
+	if (!HAVE_THREADS)
+		nr_workers = 1;
+	else if (nr_workers <= 0)
+		nr_workers = online_cpus();
+
+	CALLOC_ARRAY(pool, 1);
+	pool->nr_workers = nr_workers;
+	CALLOC_ARRAY(pool->workers, nr_workers);
+	if (!HAVE_THREADS)
+		return pool;
+
+	pthread_key_create(&pool->current_worker, NULL);
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond_queued, NULL);
+	pthread_cond_init(&pool->cond_done, NULL);
+
+	for (int i = 0; i < nr_workers; i++) {
+		struct task_pool_worker *w = &pool->workers[i];
+		int err;
+
+		w->pool = pool;
+		w->index = i;
+		pthread_mutex_init(&w->deque.mutex, NULL);
+		err = pthread_create(&w->thread, NULL, task_pool_worker_proc, w);
+		if (err)
+			die(_("unable to create thread: %s"), strerror(err));
+	}
+	return pool;
+}
+
+int task_pool_nr_workers(const struct task_pool *pool)
+{
+	return pool->nr_workers;
+}
+
+void task_pool_add(struct task_pool *pool, task_pool_fn *fn, void *task)
+{
+	struct task_pool_task t = { .fn = fn, .task = task };
+	struct task_pool_worker *w;
+
+	if (!HAVE_THREADS) {
+		fn(task, 0);
+		return;
+	}
+
+	w = pthread_getspecific(pool->current_worker);
+
+	/*
+	 * Count the task before any worker can take it, so that
+	 * `pending` cannot drop to zero while tasks are still coming.
+	 */
+	pthread_mutex_lock(&pool->mutex);
+	if (!w) {
+		w = &pool->workers[pool->next_worker];
+		pool->next_worker = (pool->next_worker + 1) % pool->nr_workers;
+	}
+	deque_push(&w->deque, &t);
+	pool->queued++;
+	pool->pending++;
+	pthread_cond_signal(&pool->cond_queued);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void task_pool_wait(struct task_pool *pool)
+{
+	if (!HAVE_THREADS)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->pending)
+		pthread_cond_wait(&pool->cond_done, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void task_pool_free(struct task_pool *pool)
+{
+	if (!pool)
+		return;
+
+	if (HAVE_THREADS) {
+		task_pool_wait(pool);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->shutdown = 1;
+		pthread_cond_broadcast(&pool->cond_queued);
+		pthread_mutex_unlock(&pool->mutex);
+
+		/* Workers look into each other's deques until they exit. */
+		for (int i = 0; i < pool->nr_workers; i++)
+			pthread_join(pool->workers[i].thread, NULL);
+		for (int i = 0; i < pool->nr_workers; i++) {
+			struct task_pool_worker *w = &pool->workers[i];
+
+			pthread_mutex_destroy(&w->deque.mutex);
+			free(w->deque.tasks);
+		}
+
+		pthread_cond_destroy(&pool->cond_done);
+		pthread_cond_destroy(&pool->cond_queued);
+		pthread_mutex_destroy(&pool->mutex);
+		pthread_key_delete(pool->current_worker);
+	}
+
+	free(pool->workers);
+	free(pool);
+}
@@ -53,5 +53,44 @@ int dummy_pthread_init(void *);
 int online_cpus(void);
 int init_recursive_mutex(pthread_mutex_t*);
 
+/*
+ * A pool of worker threads running tasks, for work that is hard to
+ * split into parts of equal cost up front.
+ *
+ * Every worker has its own deque of tasks.  A task queued by a worker
+ * goes onto the worker's own deque, from which the worker takes the
+ * newest task first, while a worker whose deque is empty steals the
+ * oldest task of another worker.  Tasks queued by other threads are
+ * spread over the deques of all workers.
+ */
+struct task_pool;
+
+/*
+ * The function running a task.  `worker` is the index of the worker
+ * running it, between 0 and task_pool_nr_workers() - 1, so that the
+ * caller can keep state per worker.
+ */
+typedef void task_pool_fn(void *task, int worker);
+
+/*
+ * Start a pool of `nr_workers` threads, or of online_cpus() threads if
+ * `nr_workers` is not positive.  Without thread support, the pool has a
+ * single worker and task_pool_add() runs the task right away.
+ */
+struct task_pool *task_pool_new(int nr_workers);
+
+int task_pool_nr_workers(const struct task_pool *pool);
+
+/* Queue `fn(task, worker)`.  This may be called from a task, too. */
+void task_pool_add(struct task_pool *pool, task_pool_fn *fn, void *task);
+
+/*
+ * Wait until all queued tasks, and the tasks queued by them, are done.
+ * Must not be called from a task.
+ */
+void task_pool_wait(struct task_pool *pool);
+
+/* Wait for all tasks and stop the threads of the pool. */
+void task_pool_free(struct task_pool *pool);
 
 #endif /* THREAD_COMPAT_H */
@@ -2119,14 +2119,93 @@ int unpack_trees(unsigned len, struct tree_desc *t, struct unpack_trees_options
 	goto done;
 }
 
+/*
+ * Return the position of the first entry at or after `pos` whose name
+ * does not start with `prefix`, assuming all entries from `pos` on sort
+ * at or after `prefix`.
+ */
+static int prefix_range_end(struct index_state *istate, int pos,
+			    const char *prefix, size_t len)
+{
+	int lo = pos, hi = istate->cache_nr;
+
+	while (lo < hi) {
+		int mi = lo + (hi - lo) / 2;
+
+		if (!strncmp(istate->cache[mi]->name, prefix, len))
+			lo = mi + 1;
+		else
+			hi = mi;
+	}
+	return lo;
+}
+
+/*
+ * Apply the patterns to the entries below `dir`, or only to the files
+ * directly inside it if `recursive` is not set.
+ */
+static enum update_sparsity_result update_sparsity_dir(struct unpack_trees_options *o,
+						       const char *dir,
+						       int recursive)
+{
+	struct index_state *istate = o->src_index;
+	enum update_sparsity_result ret = UPDATE_SPARSITY_SUCCESS;
+	struct strbuf prefix = STRBUF_INIT;
+	int pos, end;
+
+	strbuf_addf(&prefix, "%s/", dir);
+	pos = index_name_pos_sparse(istate, prefix.buf, prefix.len);
+	if (pos < 0)
+		pos = -pos - 1;
+	end = prefix_range_end(istate, pos, prefix.buf, prefix.len);
+
+	while (pos < end) {
+		struct cache_entry *ce = istate->cache[pos];
+		const char *slash = strchr(ce->name + prefix.len, '/');
+		const char *basename;
+		int dtype;
+
+		if (!recursive && slash) {
+			/* Hop over the whole subdirectory. */
+			pos = prefix_range_end(istate, pos, ce->name,
+					       slash - ce->name + 1);
+			continue;
+		}
+
+		if (ce_stage(ce)) {
+			pos += warn_conflicted_path(istate, pos, o);
+			ret = UPDATE_SPARSITY_WARNINGS;
+			continue;
+		}
+
+		basename = strrchr(ce->name, '/');
+		basename = basename ? basename + 1 : ce->name;
+		dtype = S_ISSPARSEDIR(ce->ce_mode) ? DT_DIR : DT_REG;
+		if (path_matches_pattern_list(ce->name, ce_namelen(ce), basename,
+					      &dtype, o->internal.pl, istate) > 0)
+			ce->ce_flags &= ~CE_NEW_SKIP_WORKTREE;
+		else
+			ce->ce_flags |= CE_NEW_SKIP_WORKTREE;
+
+		if (apply_sparse_checkout(istate, ce, o))
+			ret = UPDATE_SPARSITY_WARNINGS;
+		pos++;
+	}
+
+	strbuf_release(&prefix);
+	return ret;
+}
+
 /*
  * Update SKIP_WORKTREE bits according to sparsity patterns, and update
  * working directory to match.
  *
  * CE_NEW_SKIP_WORKTREE is used internally.
  */
-enum update_sparsity_result update_sparsity(struct unpack_trees_options *o,
-					    struct pattern_list *pl)
+static enum update_sparsity_result update_sparsity_1(struct unpack_trees_options *o,
+						     struct pattern_list *pl,
+						     const struct string_list *dirs,
+						     const struct string_list *parents)
 {
 	enum update_sparsity_result ret = UPDATE_SPARSITY_SUCCESS;
 	int i;
@@ -2156,6 +2235,22 @@ enum update_sparsity_result update_sparsity(struct unpack_trees_options *o,
 	/* Expand sparse directories as needed */
 	expand_index(o->src_index, o->internal.pl);
 
+	if (dirs) {
+		const struct string_list_item *item;
+
+		/*
+		 * Only the entries inside the changed directories and
+		 * directly inside their parents can change.
+		 */
+		for_each_string_list_item(item, dirs)
+			if (update_sparsity_dir(o, item->string, 1))
+				ret = UPDATE_SPARSITY_WARNINGS;
+		for_each_string_list_item(item, parents)
+			if (update_sparsity_dir(o, item->string, 0))
+				ret = UPDATE_SPARSITY_WARNINGS;
+		goto update;
+	}
+
 	/* Set NEW_SKIP_WORKTREE on existing entries. */
 	mark_all_ce_unused(o->src_index);
 	mark_new_skip_worktree(o->internal.pl, o->src_index, 0,
@@ -2178,6 +2273,7 @@ enum update_sparsity_result update_sparsity(struct unpack_trees_options *o,
 			ret = UPDATE_SPARSITY_WARNINGS;
 	}
 
+update:
 	if (check_updates(o, o->src_index))
 		ret = UPDATE_SPARSITY_WORKTREE_UPDATE_FAILURES;
 
@@ -2192,6 +2288,22 @@ enum update_sparsity_result update_sparsity(struct unpack_trees_options *o,
 	return ret;
 }
 
+enum update_sparsity_result update_sparsity(struct unpack_trees_options *o,
+					    struct pattern_list *pl)
+{
+	return update_sparsity_1(o, pl, NULL, NULL);
+}
+
+enum update_sparsity_result update_sparsity_dirs(struct unpack_trees_options *o,
+						 struct pattern_list *pl,
+						 const struct string_list *dirs,
+						 const struct string_list *parents)
+{
+	if (!pl || !pl->use_cone_patterns)
+		BUG("update_sparsity_dirs() needs cone-mode patterns");
+	return update_sparsity_1(o, pl, dirs, parents);
+}
+
 /* Here come the merge functions */
 
 static int reject_merge(const struct cache_entry *ce,
@@ -123,6 +123,19 @@ enum update_sparsity_result {
 enum update_sparsity_result update_sparsity(struct unpack_trees_options *options,
 					    struct pattern_list *pl);
 
+/*
+ * Like update_sparsity(), but only reconsider the entries below the
+ * directories in `dirs` and the files directly inside the directories in
+ * `parents`. This is enough when the cone-mode patterns `pl` differ from
+ * the ones the index was last updated with only in whether the
+ * directories in `dirs` are included; `parents` must then hold all their
+ * leading directories.
+ */
+enum update_sparsity_result update_sparsity_dirs(struct unpack_trees_options *options,
+						 struct pattern_list *pl,
+						 const struct string_list *dirs,
+						 const struct string_list *parents);
+
 int verify_uptodate(const struct cache_entry *ce,
 		    struct unpack_trees_options *o);
 